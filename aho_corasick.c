@@ -0,0 +1,310 @@
+// Aho-Corasick multi-pattern automaton.
+//
+// See: http://en.wikipedia.org/wiki/Aho%E2%80%93Corasick_algorithm
+//
+// States are numbered in breadth-first order, so the dense states near
+// the root are the first ndense, and their transition tables are one
+// contiguous block.  Edges of all states are stored sorted by label in
+// one shared array.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "aho_corasick.h"
+#include "boyer_moore.h"
+#include "fold.h"
+
+// Trie node, only used while building.
+struct trie_node
+{
+    int32_t child;      // first child, children sorted by label
+    int32_t sibling;
+    int32_t out;
+    uint32_t depth;
+    uint8_t label;
+};
+
+struct trie
+{
+    struct trie_node *nodes;
+    uint32_t len;
+    uint32_t alloc;
+};
+
+static int32_t trie_add(struct trie *t, uint8_t label, uint32_t depth)
+{
+    if (t->len == t->alloc)
+    {
+        uint32_t alloc = t->alloc ? 2 * t->alloc : 256;
+        struct trie_node *n = (struct trie_node*)realloc(
+            t->nodes, alloc * sizeof(struct trie_node));
+        if (!n)
+        {
+            return -1;
+        }
+        t->nodes = n;
+        t->alloc = alloc;
+    }
+    struct trie_node *n = &t->nodes[t->len];
+    n->child = -1;
+    n->sibling = -1;
+    n->out = -1;
+    n->depth = depth;
+    n->label = label;
+    return (int32_t)t->len++;
+}
+
+// Child of node with the given label, created if needed.  -1 on error.
+static int32_t trie_child(struct trie *t, int32_t node, uint8_t label)
+{
+    int32_t prev = -1;
+    int32_t cur = t->nodes[node].child;
+    while ((cur >= 0) && (t->nodes[cur].label < label))
+    {
+        prev = cur;
+        cur = t->nodes[cur].sibling;
+    }
+    if ((cur >= 0) && (t->nodes[cur].label == label))
+    {
+        return cur;
+    }
+
+    int32_t n = trie_add(t, label, t->nodes[node].depth + 1);
+    if (n < 0)
+    {
+        return -1;
+    }
+    t->nodes[n].sibling = cur;
+    if (prev < 0)
+    {
+        t->nodes[node].child = n;
+    }
+    else
+    {
+        t->nodes[prev].sibling = n;
+    }
+    return n;
+}
+
+// Follow the goto function from st on c, using failure links where
+// there is no edge.  Only valid for states whose failure links, and
+// their failure links, are already set.
+static uint32_t step(const struct ac *a, uint32_t st, uint8_t c)
+{
+    for (;;)
+    {
+        if (st < a->ndense && a->dense)
+        {
+            return a->dense[st * ALPHABET_LEN + c];
+        }
+        for (uint32_t e = a->edge_start[st]; e < a->edge_start[st + 1]; e++)
+        {
+            if (a->labels[e] == c)
+            {
+                return a->targets[e];
+            }
+            if (a->labels[e] > c)
+            {
+                break;
+            }
+        }
+        if (st == 0)
+        {
+            return 0;
+        }
+        st = a->fail[st];
+    }
+}
+
+struct ac *ac_create(const uint8_t *const *pats, const size_t *patlen,
+                     size_t npats, int fold)
+{
+    struct trie t = { NULL, 0, 0 };
+    struct ac *a = NULL;
+    uint32_t *order = NULL;
+    uint32_t *newid = NULL;
+
+    if (trie_add(&t, 0, 0) < 0)
+    {
+        goto error;
+    }
+    for (size_t p=0; p<npats; p++)
+    {
+        int32_t node = 0;
+        for (size_t i=0; i<patlen[p]; i++)
+        {
+            node = trie_child(&t, node, pats[p][i]);
+            if (node < 0)
+            {
+                goto error;
+            }
+        }
+        if (t.nodes[node].out < 0)
+        {
+            t.nodes[node].out = (int32_t)p;
+        }
+    }
+
+    // breadth-first numbering
+    uint32_t n = t.len;
+    order = (uint32_t*)malloc(n * sizeof(uint32_t));
+    newid = (uint32_t*)malloc(n * sizeof(uint32_t));
+    a = (struct ac*)calloc(1, sizeof(struct ac));
+    if (!order || !newid || !a)
+    {
+        goto error;
+    }
+    uint32_t head = 0;
+    uint32_t tail = 0;
+    order[tail++] = 0;
+    while (head < tail)
+    {
+        uint32_t old = order[head++];
+        for (int32_t c = t.nodes[old].child; c >= 0; c = t.nodes[c].sibling)
+        {
+            order[tail++] = (uint32_t)c;
+        }
+    }
+    for (uint32_t k=0; k<n; k++)
+    {
+        newid[order[k]] = k;
+    }
+
+    a->nstates = n;
+    a->patlen = patlen;
+    a->edge_start = (uint32_t*)malloc((n + 1) * sizeof(uint32_t));
+    a->labels = (uint8_t*)malloc(n);
+    a->targets = (uint32_t*)malloc(n * sizeof(uint32_t));
+    a->fail = (uint32_t*)calloc(n, sizeof(uint32_t));
+    a->out = (int32_t*)malloc(n * sizeof(int32_t));
+    if (!a->edge_start || !a->labels || !a->targets || !a->fail || !a->out)
+    {
+        goto error;
+    }
+
+    uint32_t e = 0;
+    for (uint32_t k=0; k<n; k++)
+    {
+        const struct trie_node *node = &t.nodes[order[k]];
+        a->edge_start[k] = e;
+        a->out[k] = node->out;
+        for (int32_t c = node->child; c >= 0; c = t.nodes[c].sibling)
+        {
+            a->labels[e] = t.nodes[c].label;
+            a->targets[e] = newid[c];
+            e++;
+        }
+        if ((node->depth < AC_DENSE_DEPTH) && (k < AC_MAX_DENSE))
+        {
+            a->ndense = k + 1;
+        }
+    }
+    a->edge_start[n] = e;
+
+    // Failure links, and outputs inherited through them, in breadth-first
+    // order so that a state's failure link is always finished first.
+    for (uint32_t k=0; k<n; k++)
+    {
+        for (uint32_t i = a->edge_start[k]; i < a->edge_start[k + 1]; i++)
+        {
+            uint32_t child = a->targets[i];
+            a->fail[child] = (k == 0) ? 0 : step(a, a->fail[k], a->labels[i]);
+            if (a->out[child] < 0)
+            {
+                a->out[child] = a->out[a->fail[child]];
+            }
+        }
+    }
+
+    // Dense tables last, since step() uses them once they exist.
+    uint32_t *dense = (uint32_t*)malloc(
+        (size_t)a->ndense * ALPHABET_LEN * sizeof(uint32_t));
+    if (!dense)
+    {
+        goto error;
+    }
+    for (uint32_t k=0; k<a->ndense; k++)
+    {
+        for (int c=0; c<ALPHABET_LEN; c++)
+        {
+            dense[k * ALPHABET_LEN + c] = (k == 0) ? 0 :
+                dense[a->fail[k] * ALPHABET_LEN + c];
+        }
+        for (uint32_t i = a->edge_start[k]; i < a->edge_start[k + 1]; i++)
+        {
+            dense[k * ALPHABET_LEN + a->labels[i]] = a->targets[i];
+        }
+        if (fold)
+        {
+            // the patterns are lower case; send A-Z the same way
+            for (int c='A'; c<='Z'; c++)
+            {
+                dense[k * ALPHABET_LEN + c] =
+                    dense[k * ALPHABET_LEN + (c | 0x20)];
+            }
+        }
+    }
+    a->dense = dense;
+    a->fold = fold;
+
+    free(newid);
+    free(order);
+    free(t.nodes);
+    return a;
+
+error:
+    ac_free(a);
+    free(newid);
+    free(order);
+    free(t.nodes);
+    return NULL;
+}
+
+void ac_free(struct ac *a)
+{
+    if (!a)
+    {
+        return;
+    }
+    free(a->dense);
+    free(a->out);
+    free(a->fail);
+    free(a->targets);
+    free(a->labels);
+    free(a->edge_start);
+    free(a);
+}
+
+static inline size_t search(const struct ac *a, const uint8_t *string,
+                            size_t stringlen, size_t *which, int fold)
+{
+    uint32_t st = 0;
+    for (size_t i=0; i<stringlen; i++)
+    {
+        uint8_t c = string[i];
+        if (st < a->ndense)
+        {
+            st = a->dense[st * ALPHABET_LEN + c];
+        }
+        else
+        {
+            st = step(a, st, fold ? fold_byte(c) : c);
+        }
+        if (a->out[st] >= 0)
+        {
+            *which = (size_t)a->out[st];
+            return i + 1 - a->patlen[*which];
+        }
+    }
+    return NOT_FOUND;
+}
+
+size_t ac_search(const struct ac *a, const uint8_t *string,
+                 size_t stringlen, size_t *which)
+{
+    if (a->fold)
+    {
+        return search(a, string, stringlen, which, 1);
+    }
+    return search(a, string, stringlen, which, 0);
+}
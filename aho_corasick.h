@@ -0,0 +1,42 @@
+#ifndef AHO_CORASICK_H
+#define AHO_CORASICK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// States closer to the root than this get a full 256-entry transition
+// table, as long as there are no more than AC_MAX_DENSE of them.  They
+// are the ones nearly every input byte touches.  Deeper states only
+// store their real edges, sorted, and fall back along failure links.
+#define AC_DENSE_DEPTH 2
+#define AC_MAX_DENSE 512
+
+struct ac
+{
+    uint32_t nstates;
+    uint32_t ndense;        // states [0, ndense) are dense
+    uint32_t *dense;        // ndense * 256 transitions
+    uint32_t *edge_start;   // edges of sparse state s are
+                            // [edge_start[s], edge_start[s + 1])
+    uint8_t *labels;
+    uint32_t *targets;
+    uint32_t *fail;
+    int32_t *out;           // longest pattern ending here, or -1
+    const size_t *patlen;   // not owned
+    int fold;               // ignore ASCII case
+};
+
+// Build an automaton for npats patterns.  With fold, it ignores ASCII
+// case, and the patterns must be lower case.  Returns NULL on error.
+struct ac *ac_create(const uint8_t *const *pats, const size_t *patlen,
+                     size_t npats, int fold);
+
+void ac_free(struct ac *a);
+
+// Offset of the first match in string that ends earliest, choosing the
+// longest pattern ending there, or NOT_FOUND.  Sets *which to the index
+// of the pattern that matched.
+size_t ac_search(const struct ac *a, const uint8_t *string,
+                 size_t stringlen, size_t *which);
+
+#endif // AHO_CORASICK_H
@@ -0,0 +1,1255 @@
+// Throughput of each search engine over synthetic corpora, and of the
+// hex dump output path.
+//
+// Usage: bench [MB]
+//        bench check [ROUNDS [SEED]]
+//
+// Every engine counts the same non-overlapping matches mgrep would
+// report; rows where an engine disagrees with Boyer-Moore are flagged.
+//
+// "check" instead compares the offsets every engine, and libmgrep's
+// scan and stream API, report against a byte-at-a-time reference, over
+// random patterns and small texts that end where an unmapped page
+// starts, and fuzzes the hex pattern parsers and damaged pattern dbs.
+// It exits 1 if anything disagrees.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "aho_corasick.h"
+#include "boyer_moore.h"
+#include "fold.h"
+#include "libmgrep.h"
+#include "matcher.h"
+#include "output.h"
+#include "pattern_db.h"
+#include "patterns.h"
+#include "rare_byte.h"
+#include "shift_and.h"
+#include "simd_search.h"
+#include "two_way.h"
+
+#define MAX_PATLEN 64
+#define NOISE_PATTERNS 99
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void)
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void fill_random(uint8_t *d, size_t n)
+{
+    for (size_t i=0; i<n; i++)
+    {
+        d[i] = (uint8_t)(rng() >> 56);
+    }
+}
+
+struct corpus
+{
+    const char *name;
+    uint8_t *data;
+    size_t len;
+    // fill pat with a pattern of patlen bytes suited to this corpus
+    void (*pattern)(const struct corpus *c, uint8_t *pat, size_t patlen);
+};
+
+// Random bytes; the pattern is taken from the middle, so it matches
+// about once.
+static void random_pattern(const struct corpus *c, uint8_t *pat,
+                           size_t patlen)
+{
+    memcpy(pat, c->data + c->len / 2, patlen);
+}
+
+// All zeros, as in sparse disk images; the pattern is zeros ending in 01,
+// which Boyer-Moore can only shift past one byte at a time.
+static void zeros_pattern(const struct corpus *c, uint8_t *pat,
+                          size_t patlen)
+{
+    (void)c;
+    memset(pat, 0, patlen);
+    pat[patlen - 1] = 1;
+}
+
+// A 4 KB random block repeated; the pattern is from the block, so it
+// matches every 4 KB.
+static void repeated_pattern(const struct corpus *c, uint8_t *pat,
+                             size_t patlen)
+{
+    memcpy(pat, c->data + 1000, patlen);
+}
+
+// All zeros, with a 01 in the middle of the pattern: every alignment
+// compares half the pattern before failing.
+static void adversarial_pattern(const struct corpus *c, uint8_t *pat,
+                                size_t patlen)
+{
+    (void)c;
+    memset(pat, 0, patlen);
+    pat[patlen / 2] = 1;
+}
+
+// All zeros, and so is the pattern: it matches everywhere.
+static void periodic_pattern(const struct corpus *c, uint8_t *pat,
+                             size_t patlen)
+{
+    (void)c;
+    memset(pat, 0, patlen);
+}
+
+typedef size_t (*count_fn)(const uint8_t *data, size_t len,
+                           const uint8_t *pat, size_t patlen, void *ctx);
+
+// Count matches the way mgrep's search loop does.
+#define COUNT_LOOP(search)                      \
+    size_t count = 0;                           \
+    size_t last = 0;                            \
+    size_t next;                                \
+    while ((next = (search)) != NOT_FOUND)      \
+    {                                           \
+        count++;                                \
+        last += next + step;                    \
+    }                                           \
+    return count
+
+struct bm_ctx
+{
+    int delta1[ALPHABET_LEN];
+    int delta2[MAX_PATLEN];
+};
+
+static size_t count_bm(const uint8_t *data, size_t len,
+                       const uint8_t *pat, size_t patlen, void *ctx)
+{
+    struct bm_ctx *bm = (struct bm_ctx*)ctx;
+    size_t step = patlen;
+    COUNT_LOOP(bm_search(data + last, len - last, pat, patlen,
+                         bm->delta1, bm->delta2));
+}
+
+static size_t count_bm_compact(const uint8_t *data, size_t len,
+                               const uint8_t *pat, size_t patlen, void *ctx)
+{
+    const struct bm *b = (const struct bm*)ctx;
+    (void)pat;
+    size_t step = patlen;
+    COUNT_LOOP(bm_find(b, data + last, len - last));
+}
+
+static size_t count_bm_folded(const uint8_t *data, size_t len,
+                              const uint8_t *pat, size_t patlen, void *ctx)
+{
+    struct bm_ctx *bm = (struct bm_ctx*)ctx;
+    size_t step = patlen;
+    COUNT_LOOP(bm_search_folded(data + last, len - last, pat, patlen,
+                                bm->delta1, bm->delta2));
+}
+
+static size_t count_simd(const uint8_t *data, size_t len,
+                         const uint8_t *pat, size_t patlen, void *ctx)
+{
+    simd_search_fn fn = *(simd_search_fn*)ctx;
+    size_t step = patlen;
+    COUNT_LOOP(fn(data + last, len - last, pat, patlen));
+}
+
+static size_t count_tw(const uint8_t *data, size_t len,
+                       const uint8_t *pat, size_t patlen, void *ctx)
+{
+    const struct two_way *tw = (const struct two_way*)ctx;
+    size_t step = patlen;
+    COUNT_LOOP(tw_search(tw, data + last, len - last, pat, patlen));
+}
+
+static size_t count_sa(const uint8_t *data, size_t len,
+                       const uint8_t *pat, size_t patlen, void *ctx)
+{
+    const struct shift_and *sa = (const struct shift_and*)ctx;
+    (void)pat;
+    size_t step = patlen;
+    COUNT_LOOP(sa_search(sa, data + last, len - last));
+}
+
+struct ac_ctx
+{
+    struct ac *ac;
+    size_t *lens;
+    size_t which;
+};
+
+static size_t count_ac(const uint8_t *data, size_t len,
+                       const uint8_t *pat, size_t patlen, void *ctx)
+{
+    struct ac_ctx *a = (struct ac_ctx*)ctx;
+    (void)pat;
+    (void)patlen;
+    size_t step = 0;
+    size_t count = 0;
+    size_t last = 0;
+    size_t next;
+    while ((next = ac_search(a->ac, data + last, len - last, &a->which))
+           != NOT_FOUND)
+    {
+        step = a->lens[a->which];
+        count++;
+        last += next + step;
+    }
+    return count;
+}
+
+static void row(const char *corpus, const char *engine, size_t patlen,
+                size_t len, count_fn fn, const uint8_t *data,
+                const uint8_t *pat, void *ctx, size_t expect)
+{
+    double start = now();
+    size_t count = fn(data, len, pat, patlen, ctx);
+    double secs = now() - start;
+    printf("%-12s %-16s %6zu %9.2f %10zu%s\n", corpus, engine, patlen,
+           len / secs / 1e9, count,
+           ((expect != NOT_FOUND) && (count != expect)) ? "  MISMATCH" : "");
+}
+
+// Shift-And with the middle byte of pat free (anchored on the longer
+// half when it is long enough), then with every other byte free.
+static void bench_masked(const struct corpus *c, const uint8_t *pat,
+                         size_t patlen)
+{
+    uint8_t masked[MAX_PATLEN];
+    uint8_t mask[MAX_PATLEN];
+
+    for (int sparse=0; sparse<2; sparse++)
+    {
+        for (size_t i=0; i<patlen; i++)
+        {
+            int free_byte = sparse ? (i%2 == 1) : (i == patlen / 2);
+            mask[i] = free_byte ? 0 : 0xff;
+            masked[i] = pat[i] & mask[i];
+        }
+        struct shift_and *sa = sa_create(masked, mask, patlen);
+        if (!sa)
+        {
+            continue;
+        }
+        const char *name = NULL;
+        if (sa->anchorlen && (sa->anchorlen <= SIMD_MAX_PATLEN))
+        {
+            sa->simd = simd_search_select(&name, 0);
+        }
+        // the free bytes may match more, so don't check the count
+        row(c->name, sparse ? "shift-and/2" : "shift-and", patlen, c->len,
+            count_sa, c->data, masked, sa, NOT_FOUND);
+        sa_free(sa);
+    }
+}
+
+static void bench_corpus(const struct corpus *c)
+{
+    static const size_t lens[] = { 1, 2, 4, 8, 16, 32, 64 };
+    static const char *const kernels[] = { "avx2", "sse2", "neon" };
+    uint8_t pat[MAX_PATLEN];
+
+    for (size_t l=0; l<sizeof(lens)/sizeof(lens[0]); l++)
+    {
+        size_t patlen = lens[l];
+        c->pattern(c, pat, patlen);
+
+        struct bm_ctx bm;
+        make_delta1(bm.delta1, pat, (int32_t)patlen);
+        make_delta2(bm.delta2, pat, (int32_t)patlen);
+        double start = now();
+        size_t expect = count_bm(c->data, c->len, pat, patlen, &bm);
+        double secs = now() - start;
+        printf("%-12s %-16s %6zu %9.2f %10zu\n", c->name, "boyer-moore",
+               patlen, c->len / secs / 1e9, expect);
+        struct bm *compact = bm_create(pat, patlen, 0);
+        if (compact)
+        {
+            row(c->name, "boyer-moore/c", patlen, c->len, count_bm_compact,
+                c->data, pat, compact, expect);
+            bm_free(compact);
+        }
+
+        for (size_t k=0; k<sizeof(kernels)/sizeof(kernels[0]); k++)
+        {
+            simd_search_fn fn = simd_search_kernel(kernels[k], 0);
+            if (fn)
+            {
+                row(c->name, kernels[k], patlen, c->len, count_simd,
+                    c->data, pat, &fn, expect);
+            }
+            fn = simd_search_fixed(kernels[k], patlen);
+            if (fn)
+            {
+                char label[32];
+                snprintf(label, sizeof(label), "%s/%zu", kernels[k], patlen);
+                row(c->name, label, patlen, c->len, count_simd, c->data, pat,
+                    &fn, expect);
+            }
+        }
+
+        // -i, which may match more, so don't check the count
+        uint8_t folded[MAX_PATLEN];
+        for (size_t i=0; i<patlen; i++)
+        {
+            folded[i] = fold_byte(pat[i]);
+        }
+        make_delta1_folded(bm.delta1, folded, (int32_t)patlen);
+        make_delta2(bm.delta2, folded, (int32_t)patlen);
+        row(c->name, "boyer-moore/i", patlen, c->len, count_bm_folded,
+            c->data, folded, &bm, NOT_FOUND);
+        const char *name = NULL;
+        simd_search_fn fn = simd_search_select(&name, 1);
+        if (fn)
+        {
+            char label[32];
+            snprintf(label, sizeof(label), "%s/i", name);
+            row(c->name, label, patlen, c->len, count_simd, c->data, folded,
+                &fn, NOT_FOUND);
+        }
+
+        struct two_way tw;
+        tw_init(&tw, pat, patlen);
+        row(c->name, "two-way", patlen, c->len, count_tw, c->data, pat,
+            &tw, expect);
+
+        if (patlen > 1)
+        {
+            bench_masked(c, pat, patlen);
+        }
+
+        // the same pattern alone, then among random noise patterns
+        const uint8_t *pats[1 + NOISE_PATTERNS];
+        size_t plens[1 + NOISE_PATTERNS];
+        uint8_t noise[NOISE_PATTERNS][MAX_PATLEN];
+        pats[0] = pat;
+        plens[0] = patlen;
+        for (int i=0; i<NOISE_PATTERNS; i++)
+        {
+            fill_random(noise[i], patlen < 4 ? 4 : patlen);
+            pats[i + 1] = noise[i];
+            plens[i + 1] = patlen < 4 ? 4 : patlen;
+        }
+        struct ac_ctx ac = { ac_create(pats, plens, 1, 0), plens, 0 };
+        if (ac.ac)
+        {
+            row(c->name, "aho-corasick", patlen, c->len, count_ac,
+                c->data, pat, &ac, expect);
+            ac_free(ac.ac);
+        }
+        ac.ac = ac_create(pats, plens, 1 + NOISE_PATTERNS, 0);
+        if (ac.ac)
+        {
+            // noise may match too, so don't check the count
+            row(c->name, "aho-corasick*100", patlen, c->len, count_ac,
+                c->data, pat, &ac, NOT_FOUND);
+            ac_free(ac.ac);
+        }
+    }
+}
+
+// Hex dump one match every 64 bytes, with default context, to /dev/null.
+static void bench_output(const uint8_t *data, size_t len)
+{
+    int fd = open("/dev/null", O_WRONLY);
+    struct outbuf out;
+    if ((fd < 0) || (outbuf_init(&out, fd, NULL) != 0))
+    {
+        perror("output");
+        return;
+    }
+
+    for (int color=0; color<2; color++)
+    {
+        size_t matches = 0;
+        size_t bytes = 0;
+        double start = now();
+        for (size_t off=64; off + 64 < len; off += 64)
+        {
+            size_t before = out.len;
+            print_match(&out, data, 0, len, off, 4, 16, 16, color);
+            if (out.len > before)
+            {
+                bytes += out.len - before;
+            }
+            matches++;
+        }
+        outbuf_end_group(&out);
+        double secs = now() - start;
+        printf("%-12s %-16s %6d %9.2f %10zu  (%.1f M matches/s)\n",
+               "output", color ? "hexdump+color" : "hexdump", 4,
+               bytes / secs / 1e9, matches, matches / secs / 1e6);
+    }
+    outbuf_free(&out);
+    close(fd);
+}
+
+// The longest text a check searches, and the most matches it can have.
+#define CHECK_TEXT 4096
+#define CHECK_PATTERNS 8
+
+// Matches an engine reported, against what the reference found.
+struct check_result
+{
+    const char *engine;
+    size_t runs;
+    size_t failures;
+};
+
+static struct check_result check_results[64];
+static size_t ncheck_results = 0;
+
+static struct check_result *check_result(const char *engine)
+{
+    for (size_t i=0; i<ncheck_results; i++)
+    {
+        if (strcmp(check_results[i].engine, engine) == 0)
+        {
+            return &check_results[i];
+        }
+    }
+    struct check_result *r = &check_results[ncheck_results++];
+    r->engine = engine;
+    return r;
+}
+
+struct hits
+{
+    size_t n;
+    size_t offset[CHECK_TEXT + 1];
+    size_t len[CHECK_TEXT + 1];
+};
+
+static void print_hex(const char *label, const uint8_t *b, size_t len)
+{
+    fprintf(stderr, "  %s ", label);
+    for (size_t i=0; i<len; i++)
+    {
+        fprintf(stderr, "%02x", b[i]);
+    }
+    fprintf(stderr, "\n");
+}
+
+// Count a run of engine, and report how it differs from expect, if it
+// does; the first few in full.
+static void check_hits(const char *engine, const struct hits *expect,
+                       const struct hits *got, const uint8_t *text,
+                       size_t textlen, const uint8_t *pat, size_t patlen)
+{
+    struct check_result *r = check_result(engine);
+    r->runs++;
+    size_t i = 0;
+    while ((i < expect->n) && (i < got->n) &&
+           (expect->offset[i] == got->offset[i]) &&
+           (expect->len[i] == got->len[i]))
+    {
+        i++;
+    }
+    if ((i == expect->n) && (i == got->n))
+    {
+        return;
+    }
+    if (r->failures++ < 3)
+    {
+        fprintf(stderr, "MISMATCH %s: %zu matches, expected %zu; first "
+                "difference at match %zu, offset %zu, expected %zu\n",
+                engine, got->n, expect->n, i,
+                (i < got->n) ? got->offset[i] : NOT_FOUND,
+                (i < expect->n) ? expect->offset[i] : NOT_FOUND);
+        print_hex("pattern", pat, patlen);
+        print_hex("text", text, textlen);
+    }
+}
+
+// The reference: the first match at or after each one's end, comparing
+// a byte at a time.  With fold, pat is lower case; with mask, pattern
+// bytes already have the free bits cleared.
+static size_t ref_find(const uint8_t *text, size_t len, const uint8_t *pat,
+                       const uint8_t *mask, size_t patlen, int fold)
+{
+    for (size_t i=0; i + patlen <= len; i++)
+    {
+        size_t j = 0;
+        for (; j<patlen; j++)
+        {
+            uint8_t b = fold ? fold_byte(text[i + j]) : text[i + j];
+            if ((mask ? (b & mask[j]) : b) != pat[j])
+            {
+                break;
+            }
+        }
+        if (j == patlen)
+        {
+            return i;
+        }
+    }
+    return NOT_FOUND;
+}
+
+static void ref_hits(struct hits *h, const uint8_t *text, size_t len,
+                     const uint8_t *pat, const uint8_t *mask, size_t patlen,
+                     int fold)
+{
+    h->n = 0;
+    size_t last = 0;
+    size_t next;
+    while ((next = ref_find(text + last, len - last, pat, mask, patlen,
+                            fold)) != NOT_FOUND)
+    {
+        h->offset[h->n] = last + next;
+        h->len[h->n++] = patlen;
+        last += next + patlen;
+    }
+}
+
+// Several patterns, as aho_corasick.h and matcher.h have it: the match
+// that ends first, and of those the longest.
+static void ref_multi(struct hits *h, const uint8_t *text, size_t len,
+                      const uint8_t *const *pats, const size_t *lens,
+                      size_t npats, int fold)
+{
+    h->n = 0;
+    size_t pos = 0;
+    for (size_t end=1; end<=len; end++)
+    {
+        size_t best = 0;
+        for (size_t p=0; p<npats; p++)
+        {
+            if ((lens[p] > best) && (end - pos >= lens[p]) &&
+                (ref_find(text + end - lens[p], lens[p], pats[p], NULL,
+                          lens[p], fold) == 0))
+            {
+                best = lens[p];
+            }
+        }
+        if (best)
+        {
+            h->offset[h->n] = end - best;
+            h->len[h->n++] = best;
+            pos = end;
+        }
+    }
+}
+
+// An engine under test: the first match in data, as count_fn searches.
+typedef size_t (*find_fn)(const uint8_t *data, size_t len,
+                          const uint8_t *pat, size_t patlen, void *ctx);
+
+static size_t find_bm(const uint8_t *data, size_t len, const uint8_t *pat,
+                      size_t patlen, void *ctx)
+{
+    struct bm_ctx *bm = (struct bm_ctx*)ctx;
+    return bm_search(data, len, pat, patlen, bm->delta1, bm->delta2);
+}
+
+static size_t find_bm_folded(const uint8_t *data, size_t len,
+                             const uint8_t *pat, size_t patlen, void *ctx)
+{
+    struct bm_ctx *bm = (struct bm_ctx*)ctx;
+    return bm_search_folded(data, len, pat, patlen, bm->delta1, bm->delta2);
+}
+
+static size_t find_bm_compact(const uint8_t *data, size_t len,
+                              const uint8_t *pat, size_t patlen, void *ctx)
+{
+    (void)pat;
+    (void)patlen;
+    return bm_find((const struct bm*)ctx, data, len);
+}
+
+static size_t find_simd(const uint8_t *data, size_t len, const uint8_t *pat,
+                        size_t patlen, void *ctx)
+{
+    return (*(simd_search_fn*)ctx)(data, len, pat, patlen);
+}
+
+static size_t find_tw(const uint8_t *data, size_t len, const uint8_t *pat,
+                      size_t patlen, void *ctx)
+{
+    return tw_search((const struct two_way*)ctx, data, len, pat, patlen);
+}
+
+static size_t find_sa(const uint8_t *data, size_t len, const uint8_t *pat,
+                      size_t patlen, void *ctx)
+{
+    (void)pat;
+    (void)patlen;
+    return sa_search((const struct shift_and*)ctx, data, len);
+}
+
+static size_t find_rb(const uint8_t *data, size_t len, const uint8_t *pat,
+                      size_t patlen, void *ctx)
+{
+    return rb_search(data, len, pat, patlen, *(size_t*)ctx, NULL);
+}
+
+static void check_engine(const char *engine, find_fn fn, void *ctx,
+                         const struct hits *expect, const uint8_t *text,
+                         size_t len, const uint8_t *pat, size_t patlen)
+{
+    static struct hits got;
+    got.n = 0;
+    size_t last = 0;
+    size_t next;
+    while ((next = fn(text + last, len - last, pat, patlen, ctx))
+           != NOT_FOUND)
+    {
+        if ((next > len - last) || (got.n > CHECK_TEXT))
+        {
+            got.offset[got.n] = next;   // out of bounds; fails
+            got.len[got.n++] = 0;
+            break;
+        }
+        got.offset[got.n] = last + next;
+        got.len[got.n++] = patlen;
+        last += next + patlen;
+    }
+    check_hits(engine, expect, &got, text, len, pat, patlen);
+}
+
+static void check_ac(const char *engine, const struct ac *ac,
+                     const size_t *lens, const struct hits *expect,
+                     const uint8_t *text, size_t len)
+{
+    static struct hits got;
+    got.n = 0;
+    size_t last = 0;
+    size_t next;
+    size_t which = 0;
+    while ((next = ac_search(ac, text + last, len - last, &which))
+           != NOT_FOUND)
+    {
+        if ((next > len - last) || (got.n > CHECK_TEXT))
+        {
+            got.offset[got.n] = next;
+            got.len[got.n++] = 0;
+            break;
+        }
+        got.offset[got.n] = last + next;
+        got.len[got.n++] = lens[which];
+        last += next + lens[which];
+    }
+    check_hits(engine, expect, &got, text, len, NULL, 0);
+}
+
+static int collect(void *arg, uint64_t offset, size_t pattern, size_t len)
+{
+    struct hits *h = (struct hits*)arg;
+    (void)pattern;
+    if (h->n <= CHECK_TEXT)
+    {
+        h->offset[h->n] = (size_t)offset;
+        h->len[h->n++] = len;
+    }
+    return 0;
+}
+
+// Through libmgrep: mgrep_scan over the whole text, then the same text
+// fed to a stream in random pieces, which must find the same matches
+// across the joins.
+static void check_lib(const char *engine, const char *stream_engine,
+                      const char *const *hex, size_t npats, int flags,
+                      const struct hits *expect, const uint8_t *text,
+                      size_t len)
+{
+    static struct hits got;
+    struct mgrep *g = mgrep_compile(hex, npats, flags);
+    if (!g)
+    {
+        fprintf(stderr, "MISMATCH %s: can't compile %s\n", engine, hex[0]);
+        check_result(engine)->failures++;
+        return;
+    }
+    got.n = 0;
+    mgrep_scan(g, text, len, collect, &got);
+    check_hits(engine, expect, &got, text, len, NULL, 0);
+
+    got.n = 0;
+    struct mgrep_stream *st = mgrep_stream_open(g, collect, &got);
+    if (st)
+    {
+        size_t off = 0;
+        while (off < len)
+        {
+            size_t piece = 1 + rng() % ((rng() & 1) ? 8 : 1024);
+            piece = (piece > len - off) ? len - off : piece;
+            mgrep_stream_feed(st, text + off, piece);
+            off += piece;
+        }
+        mgrep_stream_close(st);
+        check_hits(stream_engine, expect, &got, text, len, NULL, 0);
+    }
+    mgrep_free(g);
+}
+
+static void to_hex(char *out, const uint8_t *b, const uint8_t *mask,
+                   size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i=0; i<len; i++)
+    {
+        int m = mask ? mask[i] : 0xff;
+        out[2*i] = (m & 0xf0) ? digits[b[i] >> 4] : '?';
+        out[2*i + 1] = (m & 0x0f) ? digits[b[i] & 0xf] : '?';
+    }
+    out[2*len] = '\0';
+}
+
+// Texts from a few byte values match in many places, and part way in
+// many more, which is where the engines' shifts and verifies go wrong.
+static void random_text(uint8_t *text, size_t len, int fold)
+{
+    static const uint8_t letters[] = "aAbBzZ@[`{";
+    uint8_t alphabet[16];
+    size_t n = (size_t[]){ 1, 2, 3, 4, 16 }[rng() % 5];
+    for (size_t i=0; i<n; i++)
+    {
+        alphabet[i] = fold ? letters[rng() % (sizeof(letters) - 1)]
+                           : (uint8_t)(rng() >> 56);
+    }
+    int any = !fold && (rng() % 4 == 0);
+    for (size_t i=0; i<len; i++)
+    {
+        text[i] = any ? (uint8_t)(rng() >> 56) : alphabet[rng() % n];
+    }
+}
+
+// A pattern usually cut from the text, so that it matches.
+static void random_pat(uint8_t *pat, size_t patlen, const uint8_t *text,
+                       size_t len)
+{
+    if ((len >= patlen) && (rng() % 4 != 0))
+    {
+        memcpy(pat, text + rng() % (len - patlen + 1), patlen);
+    }
+    else
+    {
+        for (size_t i=0; i<patlen; i++)
+        {
+            pat[i] = len ? text[rng() % len] : (uint8_t)(rng() >> 56);
+        }
+    }
+}
+
+static void check_round(uint8_t *end)
+{
+    static struct hits expect;
+    static const char *const kernels[] = { "avx2", "sse2", "neon" };
+    int fold = (rng() % 4 == 0);
+    size_t len = rng() % ((rng() & 1) ? 64 : CHECK_TEXT + 1);
+    size_t patlen = 1 + rng() % ((rng() & 1) ? 16 : MAX_PATLEN);
+    uint8_t *text = end - len;
+    uint8_t pat[MAX_PATLEN];
+    char hex[2*MAX_PATLEN + 1];
+    random_text(text, len, fold);
+    random_pat(pat, patlen, text, len);
+
+    if (fold)
+    {
+        for (size_t i=0; i<patlen; i++)
+        {
+            pat[i] = fold_byte(pat[i]);
+        }
+        ref_hits(&expect, text, len, pat, NULL, patlen, 1);
+
+        struct bm_ctx bm;
+        make_delta1_folded(bm.delta1, pat, (int32_t)patlen);
+        make_delta2(bm.delta2, pat, (int32_t)patlen);
+        check_engine("boyer-moore/i", find_bm_folded, &bm, &expect, text,
+                     len, pat, patlen);
+        struct bm *compact = bm_create(pat, patlen, 1);
+        if (compact)
+        {
+            check_engine("boyer-moore/c/i", find_bm_compact, compact,
+                         &expect, text, len, pat, patlen);
+            bm_free(compact);
+        }
+        for (size_t k=0; k<sizeof(kernels)/sizeof(kernels[0]); k++)
+        {
+            simd_search_fn fn = simd_search_kernel(kernels[k], 1);
+            if (fn)
+            {
+                static char labels[3][32];
+                snprintf(labels[k], sizeof(labels[k]), "%s/i", kernels[k]);
+                check_engine(labels[k], find_simd, &fn, &expect, text, len,
+                             pat, patlen);
+            }
+        }
+        to_hex(hex, pat, NULL, patlen);
+        const char *pats[] = { hex };
+        check_lib("libmgrep/i", "stream/i", pats, 1, MGREP_IGNORE_CASE,
+                  &expect, text, len);
+        return;
+    }
+
+    ref_hits(&expect, text, len, pat, NULL, patlen, 0);
+    struct bm_ctx bm;
+    make_delta1(bm.delta1, pat, (int32_t)patlen);
+    make_delta2(bm.delta2, pat, (int32_t)patlen);
+    check_engine("boyer-moore", find_bm, &bm, &expect, text, len, pat,
+                 patlen);
+    struct bm *compact = bm_create(pat, patlen, 0);
+    if (compact)
+    {
+        check_engine("boyer-moore/c", find_bm_compact, compact, &expect,
+                     text, len, pat, patlen);
+        bm_free(compact);
+    }
+    for (size_t k=0; k<sizeof(kernels)/sizeof(kernels[0]); k++)
+    {
+        simd_search_fn fn = simd_search_kernel(kernels[k], 0);
+        if (fn)
+        {
+            check_engine(kernels[k], find_simd, &fn, &expect, text, len, pat,
+                         patlen);
+        }
+        fn = simd_search_fixed(kernels[k], patlen);
+        if (fn)
+        {
+            static char labels[3][32];
+            snprintf(labels[k], sizeof(labels[k]), "%s/fixed", kernels[k]);
+            check_engine(labels[k], find_simd, &fn, &expect, text, len, pat,
+                         patlen);
+        }
+    }
+    struct two_way tw;
+    tw_init(&tw, pat, patlen);
+    check_engine("two-way", find_tw, &tw, &expect, text, len, pat, patlen);
+    size_t anchor = rng() % patlen;
+    check_engine("rare-byte", find_rb, &anchor, &expect, text, len, pat,
+                 patlen);
+    const uint8_t *one[] = { pat };
+    struct ac *ac = ac_create(one, &patlen, 1, 0);
+    if (ac)
+    {
+        check_ac("aho-corasick", ac, &patlen, &expect, text, len);
+        ac_free(ac);
+    }
+    to_hex(hex, pat, NULL, patlen);
+    const char *pats[CHECK_PATTERNS] = { hex };
+    check_lib("libmgrep", "stream", pats, 1, 0, &expect, text, len);
+
+    // some bits free, then whole nibbles
+    uint8_t mask[MAX_PATLEN];
+    uint8_t masked[MAX_PATLEN];
+    for (int nibbles=0; nibbles<2; nibbles++)
+    {
+        for (size_t i=0; i<patlen; i++)
+        {
+            int r = (int)(rng() % 8);
+            if (r < 5)
+            {
+                mask[i] = 0xff;
+            }
+            else
+            {
+                mask[i] = nibbles ? (uint8_t[]){ 0x0f, 0xf0, 0 }[r - 5]
+                                  : (uint8_t)(rng() >> 56);
+            }
+            masked[i] = pat[i] & mask[i];
+        }
+        ref_hits(&expect, text, len, masked, mask, patlen, 0);
+        struct shift_and *sa = sa_create(masked, mask, patlen);
+        if (sa)
+        {
+            check_engine("shift-and", find_sa, sa, &expect, text, len,
+                         masked, patlen);
+            const char *name = NULL;
+            if (sa->anchorlen && (sa->anchorlen <= SIMD_MAX_PATLEN))
+            {
+                sa->simd = simd_search_select(&name, 0);
+                check_engine("shift-and/simd", find_sa, sa, &expect, text,
+                             len, masked, patlen);
+            }
+            sa_free(sa);
+        }
+        if (nibbles)
+        {
+            to_hex(hex, masked, mask, patlen);
+            check_lib("libmgrep/?", "stream/?", pats, 1, 0, &expect, text,
+                      len);
+        }
+    }
+
+    // several patterns, distinct so that which one matched is clear
+    uint8_t many[CHECK_PATTERNS][MAX_PATLEN];
+    const uint8_t *manyp[CHECK_PATTERNS];
+    size_t lens[CHECK_PATTERNS];
+    char hexes[CHECK_PATTERNS][2*MAX_PATLEN + 1];
+    size_t npats = 0;
+    size_t want = 2 + rng() % (CHECK_PATTERNS - 1);
+    for (size_t tries=0; (npats < want) && (tries < 4 * CHECK_PATTERNS);
+         tries++)
+    {
+        size_t l = 1 + rng() % ((rng() & 1) ? 4 : 16);
+        random_pat(many[npats], l, text, len);
+        int dup = 0;
+        for (size_t p=0; p<npats; p++)
+        {
+            dup |= (lens[p] == l) && (memcmp(many[p], many[npats], l) == 0);
+        }
+        if (!dup)
+        {
+            manyp[npats] = many[npats];
+            lens[npats] = l;
+            to_hex(hexes[npats], many[npats], NULL, l);
+            pats[npats] = hexes[npats];
+            npats++;
+        }
+    }
+    ref_multi(&expect, text, len, manyp, lens, npats, 0);
+    ac = ac_create(manyp, lens, npats, 0);
+    if (ac)
+    {
+        check_ac("aho-corasick*", ac, lens, &expect, text, len);
+        ac_free(ac);
+    }
+    check_lib("libmgrep*", "stream*", pats, npats, 0, &expect, text, len);
+}
+
+// Search text with a pattern db that may be damaged, which db_open let
+// through, and fail if a match it reports lies outside the text.
+static void check_db_search(struct check_result *r,
+                            const struct pattern_db *db,
+                            const uint8_t *text, size_t len)
+{
+    size_t last = 0;
+    size_t next;
+    size_t which = 0;
+    while ((last < len) &&
+           ((next = ac_search(&db->ac, text + last, len - last, &which))
+            != NOT_FOUND))
+    {
+        if ((which >= db->npats) || (next > len - last) ||
+            (db->ac.patlen[which] > len - last - next) ||
+            (db->ac.patlen[which] == 0))
+        {
+            if (r->failures++ < 3)
+            {
+                fprintf(stderr, "MISMATCH %s: match at %zu of pattern %zu "
+                        "outside a text of %zu\n", r->engine, last + next,
+                        which, len);
+            }
+            return;
+        }
+        last += next + db->ac.patlen[which];
+    }
+}
+
+static int write_file(const char *path, const uint8_t *data, size_t len)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f)
+    {
+        return -1;
+    }
+    int ret = (fwrite(data, 1, len, f) == len) ? 0 : -1;
+    return (fclose(f) == 0) ? ret : -1;
+}
+
+// --compile's output, read back through db_open: searched as it was
+// written, it must find what the patterns do, and truncated or with
+// bytes overwritten, it must be refused or else stay inside the text.
+static void check_db(uint8_t *end, size_t rounds)
+{
+    static struct hits expect;
+    struct check_result *whole = check_result("pattern-db");
+    struct check_result *bad = check_result("pattern-db/bad");
+    char path[] = "/tmp/mgrep-check-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        perror("mkstemp");
+        whole->failures++;
+        return;
+    }
+    close(fd);
+
+    uint8_t *good = NULL;
+    uint8_t *broken = NULL;
+    for (size_t n=0; n<rounds; n++)
+    {
+        int fold = (rng() % 4 == 0);
+        size_t len = rng() % (CHECK_TEXT + 1);
+        uint8_t *text = end - len;
+        random_text(text, len, fold);
+
+        uint8_t many[CHECK_PATTERNS][16];
+        const uint8_t *manyp[CHECK_PATTERNS];
+        size_t lens[CHECK_PATTERNS];
+        struct pattern pats[CHECK_PATTERNS];
+        size_t npats = 2 + rng() % (CHECK_PATTERNS - 1);
+        for (size_t p=0; p<npats; p++)
+        {
+            lens[p] = 1 + rng() % ((rng() & 1) ? 4 : 16);
+            random_pat(many[p], lens[p], text, len);
+            for (size_t i=0; fold && (i<lens[p]); i++)
+            {
+                many[p][i] = fold_byte(many[p][i]);
+            }
+            manyp[p] = many[p];
+            pats[p].bytes = many[p];
+            pats[p].mask = NULL;
+            pats[p].len = lens[p];
+            pats[p].text = "check";
+        }
+        struct matcher m;
+        if (matcher_init(&m, pats, npats, fold) != 0)
+        {
+            continue;
+        }
+        int written = db_write(path, &m);
+        matcher_free(&m);
+        FILE *f = fopen(path, "rb");
+        free(good);
+        good = (written == 0) && f ? (uint8_t*)malloc(1 << 20) : NULL;
+        size_t size = good ? fread(good, 1, 1 << 20, f) : 0;
+        if (f)
+        {
+            fclose(f);
+        }
+        struct pattern_db db;
+        if (!good || (db_open(&db, path) != 0))
+        {
+            if (whole->failures++ < 3)
+            {
+                fprintf(stderr, "MISMATCH pattern-db: can't write and open "
+                        "a db of %zu patterns\n", npats);
+            }
+            continue;
+        }
+        ref_multi(&expect, text, len, manyp, lens, npats, fold);
+        check_ac("pattern-db", &db.ac, db.ac.patlen, &expect, text, len);
+        db_close(&db);
+
+        // some damage: cut short, or a few bytes or words overwritten
+        // with small numbers, big ones or noise
+        free(broken);
+        broken = (uint8_t*)malloc(size);
+        if (!broken)
+        {
+            continue;
+        }
+        memcpy(broken, good, size);
+        size_t cut = size;
+        switch (rng() % 3)
+        {
+            case 0:
+                cut = rng() % size;
+                break;
+            case 1:
+                for (size_t k=1 + rng() % 4; k>0; k--)
+                {
+                    broken[rng() % size] = (uint8_t)(rng() >> 56);
+                }
+                break;
+            default:
+                for (size_t k=1 + rng() % 4; k>0; k--)
+                {
+                    uint32_t v = (uint32_t)((rng() & 1) ? rng() % 64
+                                                        : rng() >> 32);
+                    memcpy(broken + (rng() % (size / 4)) * 4, &v, 4);
+                }
+                break;
+        }
+        bad->runs++;
+        if ((write_file(path, broken, cut) == 0) &&
+            (db_open(&db, path) == 0))
+        {
+            if (db.has_ac)
+            {
+                check_db_search(bad, &db, text, len);
+            }
+            db_close(&db);
+        }
+    }
+    free(good);
+    free(broken);
+    unlink(path);
+}
+
+// hex_decode and hex_decode_masked on random strings of hex digits and
+// near misses, against a straightforward reading of the rules in
+// patterns.h.
+static void check_hex(size_t rounds)
+{
+    static const char chars[] = "0123456789abcdefABCDEF?/g x";
+    struct check_result *r = check_result("hex_decode");
+    for (size_t n=0; n<rounds; n++)
+    {
+        char word[24];
+        size_t wlen = rng() % (sizeof(word) - 1);
+        for (size_t i=0; i<wlen; i++)
+        {
+            // mostly hex, which decodes
+            word[i] = chars[rng() % ((rng() % 8) ? 22 : sizeof(chars) - 1)];
+        }
+        word[wlen] = '\0';
+
+        // expected: even, non-empty, digits only; masked: up to a /, with
+        // ?, and a mask after it as long as the pattern
+        uint8_t want[12], want_mask[12];
+        size_t plen = strcspn(word, "/");
+        int ok = (plen > 0) && (plen % 2 == 0);
+        int exact_ok = ok && (plen == wlen);
+        for (size_t i=0; ok && (i<plen); i++)
+        {
+            const char *d = strchr("0123456789abcdef", word[i] | 0x20);
+            int q = (word[i] == '?');
+            exact_ok &= (d != NULL) && (word[i] != '?') && (word[i] != ' ');
+            ok &= q || ((d != NULL) && (word[i] != ' '));
+            int nib = (ok && !q) ? (int)(d - "0123456789abcdef") : 0;
+            if (i % 2 == 0)
+            {
+                want[i/2] = (uint8_t)(nib << 4);
+                want_mask[i/2] = q ? 0 : 0xf0;
+            }
+            else
+            {
+                want[i/2] |= (uint8_t)nib;
+                want_mask[i/2] |= q ? 0 : 0x0f;
+            }
+        }
+        if (ok && (plen < wlen))
+        {
+            size_t got_len = 0;
+            uint8_t *m = hex_decode(word + plen + 1, &got_len);
+            ok = m && (got_len == plen / 2);
+            for (size_t i=0; ok && (i<plen/2); i++)
+            {
+                want_mask[i] &= m[i];
+            }
+            free(m);
+        }
+
+        r->runs++;
+        size_t got_len = 0;
+        uint8_t *got = hex_decode(word, &got_len);
+        int bad = (got != NULL) != exact_ok;
+        for (size_t i=0; !bad && got && (i<got_len); i++)
+        {
+            bad = (got_len != plen / 2) || (got[i] != want[i]);
+        }
+        free(got);
+
+        uint8_t *mask = NULL;
+        got = hex_decode_masked(word, &got_len, &mask);
+        bad |= (got != NULL) != ok;
+        for (size_t i=0; !bad && got && (i<got_len); i++)
+        {
+            uint8_t m = mask ? mask[i] : 0xff;
+            bad = (got_len != plen / 2) || (m != want_mask[i]) ||
+                  (got[i] != (want[i] & want_mask[i]));
+        }
+        free(got);
+        free(mask);
+        if (bad && (r->failures++ < 3))
+        {
+            fprintf(stderr, "MISMATCH hex_decode: \"%s\"\n", word);
+        }
+    }
+}
+
+static int check(int argc, char *argv[])
+{
+    size_t rounds = (argc > 0) ? strtoul(argv[0], NULL, 10) : 20000;
+    if (argc > 1)
+    {
+        rng_state = strtoull(argv[1], NULL, 0) | 1;
+    }
+    printf("seed 0x%llx\n", (unsigned long long)rng_state);
+
+    // texts end at the end of the mapping, just before a page that isn't
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t room = (CHECK_TEXT + page - 1) / page * page;
+    uint8_t *map = (uint8_t*)mmap(NULL, room + page, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((map == MAP_FAILED) || (mprotect(map + room, page, PROT_NONE) != 0))
+    {
+        perror("mmap");
+        return 2;
+    }
+    for (size_t n=0; n<rounds; n++)
+    {
+        check_round(map + room);
+    }
+    check_db(map + room, rounds / 10);
+    check_hex(rounds * 10);
+    munmap(map, room + page);
+
+    size_t failures = 0;
+    printf("%-16s %10s %10s\n", "engine", "runs", "mismatches");
+    for (size_t i=0; i<ncheck_results; i++)
+    {
+        printf("%-16s %10zu %10zu\n", check_results[i].engine,
+               check_results[i].runs, check_results[i].failures);
+        failures += check_results[i].failures;
+    }
+    return failures ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if ((argc > 1) && (strcmp(argv[1], "check") == 0))
+    {
+        return check(argc - 2, argv + 2);
+    }
+    size_t mb = (argc > 1) ? strtoul(argv[1], NULL, 10) : 64;
+    size_t len = (mb ? mb : 64) << 20;
+
+    uint8_t *random = (uint8_t*)malloc(len);
+    uint8_t *zeros = (uint8_t*)calloc(1, len);
+    uint8_t *repeated = (uint8_t*)malloc(len);
+    if (!random || !zeros || !repeated)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 2;
+    }
+    fill_random(random, len);
+    fill_random(repeated, 4096);
+    for (size_t i=4096; i<len; i+=4096)
+    {
+        memcpy(repeated + i, repeated, (len - i < 4096) ? len - i : 4096);
+    }
+
+    const struct corpus corpora[] = {
+        { "random", random, len, random_pattern },
+        { "zeros", zeros, len, zeros_pattern },
+        { "repeated", repeated, len, repeated_pattern },
+        { "adversarial", zeros, len, adversarial_pattern },
+        { "periodic", zeros, len, periodic_pattern },
+    };
+
+    printf("%-12s %-16s %6s %9s %10s\n",
+           "corpus", "engine", "patlen", "GB/s", "matches");
+    for (size_t i=0; i<sizeof(corpora)/sizeof(corpora[0]); i++)
+    {
+        bench_corpus(&corpora[i]);
+    }
+    bench_output(random, len);
+
+    free(repeated);
+    free(zeros);
+    free(random);
+    return 0;
+}
@@ -0,0 +1,366 @@
+#!/bin/sh
+# Check that mgrep prints the same thing however each file is read:
+# mapped, with --direct, --window, from a pipe, compressed with -z, on
+# any number of -j workers, which split big files into chunks, and with
+# --uring, which only reads small files, and only given several.  The
+# serial, mapped run is the reference every other way must match,
+# searching through a --serve with --client among them.
+#
+# Usage: bench/modes.sh [MGREP]
+
+MGREP=${1:-./mgrep}
+case $MGREP in
+    */*) MGREP=$(cd "$(dirname "$MGREP")" && pwd)/$(basename "$MGREP") ;;
+esac
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/mgrep-modes.XXXXXX") || exit 2
+trap 'rm -rf "$TMP"' EXIT
+FAILED=0
+
+# plant FILE OFFSET HEX: write the bytes HEX spells into FILE at OFFSET.
+plant()
+{
+    for byte in $(printf '%s' "$3" | sed 's/../0x& /g')
+    do
+        printf "\\$(printf '%03o' "$byte")"
+    done | dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+# Run mgrep with each of the remaining arguments' ways of reading FILE,
+# and compare what they print with the mapped search's output.  OPTS is
+# the rest of the command line, without the file.
+compare()
+{
+    file=$1
+    opts=$2
+    shift 2
+    $MGREP $opts "$file" >"$TMP/want" 2>&1
+    for mode in "$@"
+    do
+        case $mode in
+            pipe)
+                $MGREP $opts - <"$file" 2>&1 |
+                    sed "s|(standard input)|$file|" >"$TMP/got"
+                ;;
+            gzip)
+                [ -f "$file.gz" ] || gzip -1 -c "$file" >"$file.gz"
+                $MGREP -z $opts "$file.gz" 2>&1 |
+                    sed "s|$file.gz|$file|" >"$TMP/got"
+                ;;
+            *)
+                $MGREP $mode $opts "$file" >"$TMP/got" 2>&1
+                ;;
+        esac
+        if ! cmp -s "$TMP/want" "$TMP/got"
+        then
+            echo "FAIL: mgrep $mode $opts differs from mapped"
+            diff "$TMP/want" "$TMP/got" | head -10
+            FAILED=1
+        fi
+    done
+}
+
+# by_file: put each file's share of several files' output together, in
+# the order the files are named, keeping what's in each share in order;
+# rings print files in whatever order their reads finish.
+by_file()
+{
+    awk '/^---- .* ----$/ { group = substr($0, 6, length($0) - 10) }
+         {
+             key = group
+             if (key == "")
+             {
+                 key = $0
+                 sub(/:.*/, "", key)
+             }
+             print key "\t" NR "\t" $0
+         }' | sort -t "$(printf '\t')" -k1,1 -k2,2n | cut -f3-
+}
+
+# compare_files OPTS MODE...: like compare, for all of $FILES at once.
+compare_files()
+{
+    opts=$1
+    shift
+    $MGREP $opts $FILES 2>&1 | by_file >"$TMP/want"
+    for mode in "$@"
+    do
+        $MGREP $mode $opts $FILES 2>&1 | by_file >"$TMP/got"
+        if ! cmp -s "$TMP/want" "$TMP/got"
+        then
+            echo "FAIL: mgrep $mode $opts FILES... differs from mapped"
+            diff "$TMP/want" "$TMP/got" | head -10
+            FAILED=1
+        fi
+    done
+}
+
+# small files, which --uring reads whole given more than one: matches
+# at their ends and across page boundaries
+FILES=
+for size in 0 1 4 4096 8191 65537 1048575 1048576
+do
+    head -c $size /dev/zero >"$TMP/small$size.bin"
+    FILES="$FILES $TMP/small$size.bin"
+done
+printf '\336' >"$TMP/small1.bin"
+plant "$TMP/small4.bin" 0 deadbeef
+plant "$TMP/small4096.bin" 4094 deadbeef
+plant "$TMP/small8191.bin" 4090 deadbeefdeadbeef
+plant "$TMP/small8191.bin" 8187 deadbeef
+for at in 4094 8190 32766 65533
+do
+    plant "$TMP/small65537.bin" $at deadbeef
+done
+plant "$TMP/small1048575.bin" 1048571 deadbeef
+plant "$TMP/small1048576.bin" 524286 deadbeef
+plant "$TMP/small1048576.bin" 1048572 deadbeef
+for opts in "-o -e deadbeef -e efde -e de" \
+            "-b 20 -a 20 deadbeef" \
+            "-b 5000 -a 5000 deadbeef" \
+            "-o --range 4090:8192 deadbeef" \
+            "-b 8 -a 8 --range 4094:65535 deadbeef" \
+            "-o -m 2 dead" \
+            "-l beef" \
+            "-n deadbeef"
+do
+    compare_files "$opts" --uring "--uring -j 2" "--uring -j 8"
+done
+
+# a 1M file, just big enough for a FILE.mgi, is searched through it with
+# --uring too.  The index is built before a match goes in, with the
+# file's time put back after, so a search that uses it misses the match.
+INDEXED="$TMP/indexed.bin"
+head -c 1048576 /dev/zero >"$INDEXED"
+$MGREP --index "$INDEXED"
+touch -r "$INDEXED" "$TMP/indexed.time"
+plant "$INDEXED" 70000 deadbeef
+touch -r "$TMP/indexed.time" "$INDEXED"
+SMALL=$FILES
+FILES="$INDEXED $TMP/small4.bin"
+compare_files "-o deadbeef" --uring
+compare_files "-o --no-index deadbeef" --uring
+FILES=$SMALL
+
+# --range, with context reaching past both of its ends
+MED="$TMP/med.bin"
+dd if=/dev/zero of="$MED" bs=1048576 count=20 2>/dev/null
+for at in 4000 4090 16777200 16777210 16777230 20000000
+do
+    plant "$MED" $at deadbeef
+done
+for opts in "-b 16 -a 16 --range 16777200:16777220" \
+            "-b 64 -a 64 --range 4090:16777300" \
+            "-b 4096 --range 16777210:" \
+            "-a 100 --range :4094" \
+            "-o --range 4000:16777214"
+do
+    compare "$MED" "$opts deadbeef" --direct "--window 1M" pipe "-j 2"
+done
+
+# matches on and around the seams between -j's 16M chunks: one across
+# the first, a run of a periodic pattern across the second, one ending
+# right on the third
+CHUNK=16777216
+SEAMS="$TMP/seams.bin"
+dd if=/dev/zero of="$SEAMS" bs=1048576 count=49 2>/dev/null
+plant "$SEAMS" $((CHUNK - 3)) deadbeefcafe
+plant "$SEAMS" $((2 * CHUNK - 21)) \
+    6162616261626162616261626162616261626162616261626162616261626162
+plant "$SEAMS" $((3 * CHUNK - 5)) 0102030405
+for opts in "-o -e deadbeefcafe -e 6162616261 -e 0102030405" \
+            "-b 20 -a 20 -e deadbeefcafe -e 626162 -e 0102030405" \
+            "-n 616261" \
+            "-o --overlap 61626162" \
+            "-o -m 3 6162" \
+            "-l 0102030405"
+do
+    compare "$SEAMS" "$opts" "-j 1" "-j 2" "-j 8" --direct "--window 1M" \
+        pipe gzip
+done
+
+# --overlap on a run of zeros straddling a chunk seam finds every start,
+# however the file is read; nested patterns are refused
+ZEROS="$TMP/zeros.bin"
+dd if=/dev/zero of="$ZEROS" bs=1048576 count=17 2>/dev/null
+compare "$ZEROS" "-n --overlap 000000" --direct pipe "-j 2"
+got=$($MGREP -n --overlap 000000 "$ZEROS")
+if [ "$got" != $((17 * 1048576 - 2)) ]
+then
+    echo "FAIL: --overlap found $got matches of 000000 in 17M zeros"
+    FAILED=1
+fi
+if $MGREP -o --overlap -e 00 -e 0000 "$ZEROS" >/dev/null 2>&1 ||
+    [ $? -ne 64 ]
+then
+    echo "FAIL: --overlap with nested patterns wasn't refused"
+    FAILED=1
+fi
+
+# expect NAME WANT COMMAND...: COMMAND prints WANT, with a line "exit
+# STATUS" after, or NAME fails
+expect()
+{
+    name=$1
+    want=$2
+    shift 2
+    got=$("$@" 2>&1; echo "exit $?")
+    if [ "$got" != "$(printf '%b' "$want")" ]
+    then
+        echo "FAIL: $name: mgrep printed"
+        printf '%s\n' "$got" | head -10
+        FAILED=1
+    fi
+}
+
+# --checkpoint on a growing file: a match split between two appends is
+# found once it is whole, a rerun with nothing new finds nothing, and a
+# file truncated, or replaced, is searched from the start
+LOG="$TMP/log"
+CP="$TMP/checkpoint"
+head -c 1000 /dev/zero >"$LOG"
+plant "$LOG" 1000 dead
+expect "checkpoint, half a match" "exit 1" \
+    $MGREP -o --checkpoint "$CP" deadbeef "$LOG"
+plant "$LOG" 1002 beef
+head -c 10 /dev/zero >>"$LOG"
+plant "$LOG" 1014 deadbeef
+expect "checkpoint, the rest of it" "1000\n1014\nexit 0" \
+    $MGREP -o --checkpoint "$CP" deadbeef "$LOG"
+expect "checkpoint, nothing new" "exit 1" \
+    $MGREP -o --checkpoint "$CP" deadbeef "$LOG"
+: >"$LOG"
+head -c 20 /dev/zero >"$LOG"
+plant "$LOG" 20 deadbeef
+expect "checkpoint, truncated" \
+    "Truncated $LOG, searching it from the start\n20\nexit 0" \
+    $MGREP -o --checkpoint "$CP" deadbeef "$LOG"
+head -c 2000 /dev/zero >"$LOG.new"
+plant "$LOG.new" 4 deadbeef
+mv "$LOG.new" "$LOG"
+expect "checkpoint, replaced" "4\nexit 0" \
+    $MGREP -o --checkpoint "$CP" deadbeef "$LOG"
+
+# --follow: the same split match, written while mgrep waits for more
+head -c 100 /dev/zero >"$LOG"
+$MGREP -o --follow deadbeef "$LOG" >"$TMP/follow" 2>&1 &
+FOLLOWER=$!
+sleep 0.3
+plant "$LOG" 100 dead
+sleep 0.3
+plant "$LOG" 102 beefdeadbeef
+i=0
+while [ "$(wc -l <"$TMP/follow")" -lt 2 ] && [ $i -lt 50 ]
+do
+    sleep 0.1
+    i=$((i + 1))
+done
+kill $FOLLOWER
+wait $FOLLOWER
+echo "exit $?" >>"$TMP/follow"
+if [ "$(cat "$TMP/follow")" != "$(printf '100\n104\nexit 0')" ]
+then
+    echo "FAIL: --follow printed"
+    head -10 "$TMP/follow"
+    FAILED=1
+fi
+
+# --serve: what --client prints, and its exit status, against the same
+# search run directly
+SOCK="$TMP/sock"
+$MGREP -j 2 --cache-size 4M --serve "$SOCK" 2>"$TMP/serve.err" &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null; rm -rf "$TMP"' EXIT
+i=0
+while [ ! -S "$SOCK" ] && [ $i -lt 50 ]
+do
+    sleep 0.1
+    i=$((i + 1))
+done
+
+# compare_client NAME OPTS...: the client's output and status, as NAME
+compare_client()
+{
+    name=$1
+    shift
+    $MGREP "$@" >"$TMP/want.$name" 2>&1
+    echo "exit $?" >>"$TMP/want.$name"
+    $MGREP --client "$SOCK" "$@" >"$TMP/got.$name" 2>&1
+    echo "exit $?" >>"$TMP/got.$name"
+    if ! cmp -s "$TMP/want.$name" "$TMP/got.$name"
+    then
+        echo "FAIL: mgrep --client $* differs from mgrep"
+        diff "$TMP/want.$name" "$TMP/got.$name" | head -10
+        FAILED=1
+    fi
+}
+
+compare_client dump deadbeef $FILES
+compare_client files -o -e deadbeef -e efde $FILES
+compare_client context -b 20 -a 20 deadbeef $FILES
+compare_client range -o --range 4090:16777300 deadbeef "$MED"
+compare_client chunks -n -e deadbeefcafe -e 626162 "$SEAMS"
+compare_client max -o -m 2 dead $FILES
+compare_client none -l cafebabe $FILES
+compare_client bad -o zz "$MED"
+compare_client missing -o deadbeef "$TMP/missing"
+cd "$TMP"
+compare_client relative -o deadbeef small4096.bin
+cd "$OLDPWD"
+
+# several at once, sharing compiled patterns and mapped files
+n=0
+CLIENTS=
+for opts in "-o deadbeef" "-n deadbeef" "-o -e deadbeef -e efde" \
+            "-l beef" "-o deadbeef" "-n deadbeef"
+do
+    n=$((n + 1))
+    compare_client "busy$n" $opts $FILES "$MED" &
+    CLIENTS="$CLIENTS $!"
+done
+wait $CLIENTS
+for k in $(seq $n)
+do
+    if ! cmp -s "$TMP/want.busy$k" "$TMP/got.busy$k"
+    then
+        echo "FAIL: concurrent --client request $k differs from mgrep"
+        FAILED=1
+    fi
+done
+
+# a pattern db compiled again between requests is read again
+$MGREP --compile "$TMP/db" -e deadbeef -e cafe
+compare_client db1 -o --patterns-db "$TMP/db" "$SEAMS"
+$MGREP --compile "$TMP/db" 0102030405
+compare_client db2 -o --patterns-db "$TMP/db" "$SEAMS"
+if cmp -s "$TMP/got.db1" "$TMP/got.db2"
+then
+    echo "FAIL: --client searched with the old --patterns-db"
+    FAILED=1
+fi
+
+# a second server on the same socket is refused, and the first goes on
+$MGREP --serve "$SOCK" >"$TMP/second" 2>&1
+status=$?
+if [ $status -ne 2 ] || ! grep -q "Already serving" "$TMP/second"
+then
+    echo "FAIL: a second --serve on a live socket exited $status:"
+    cat "$TMP/second"
+    FAILED=1
+fi
+compare_client after -o deadbeef $FILES
+
+kill $SERVER
+wait $SERVER
+status=$?
+if [ $status -ne 0 ] || [ -e "$SOCK" ]
+then
+    echo "FAIL: --serve exited $status on SIGTERM:"
+    cat "$TMP/serve.err"
+    FAILED=1
+fi
+
+if [ $FAILED -eq 0 ]
+then
+    echo "modes: all match"
+fi
+exit $FAILED
@@ -5,8 +5,11 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "boyer_moore.h"
+#include "fold.h"
+#include "stats.h"
 
 #define max(a, b) ((a < b) ? b : a)
 
@@ -31,6 +34,18 @@ void make_delta1(int *delta1, const uint8_t *pat, int32_t patlen)
     }
 }
 
+// delta1 for a lower case pat searched without regard to ASCII case: an
+// upper case letter shifts as far as its lower case twin.
+void make_delta1_folded(int *delta1, const uint8_t *pat, int32_t patlen)
+{
+    int c;
+    make_delta1(delta1, pat, patlen);
+    for (c='A'; c <= 'Z'; c++)
+    {
+        delta1[c] = delta1[c | 0x20];
+    }
+}
+
 // true if the suffix of word starting from word[pos] is a prefix
 // of word
 static int is_prefix(const uint8_t *word, int wordlen, int pos)
@@ -121,25 +136,190 @@ void make_delta2(int *delta2, const uint8_t *pat, int32_t patlen)
     }
 }
 
-size_t bm_search(const uint8_t *string, size_t stringlen,
-                 const uint8_t *pat, size_t patlen,
-                 int *delta1, int *delta2)
+// Table entry i, of width bytes.
+__attribute__((always_inline))
+static inline int entry(const void *table, size_t i, int width)
+{
+    switch (width)
+    {
+        case 1:
+            return ((const uint8_t*)table)[i];
+        case 2:
+            return ((const uint16_t*)table)[i];
+        default:
+            return ((const int*)table)[i];
+    }
+}
+
+// Every search, and the counting versions.  Inlined with constant width,
+// fold and st, so the plain ones pay nothing for any of them.
+__attribute__((always_inline))
+static inline size_t search(const uint8_t *string, size_t stringlen,
+                            const uint8_t *pat, size_t patlen,
+                            const void *delta1, const void *delta2,
+                            int width, int fold, struct engine_stats *st)
 {
     size_t i = patlen-1;
     while (i < stringlen)
     {
-        int j = patlen-1;
-        while (j >= 0 && (string[i] == pat[j]))
+        // compare string[k] with pat[j], right to left, stopping at pat[0]
+        // rather than running j below it
+        size_t j = patlen-1;
+        size_t k = i;
+        while ((fold ? fold_byte(string[k]) : string[k]) == pat[j])
         {
-            --i;
+            if (j == 0)
+            {
+                if (st)
+                {
+                    st->windows++;
+                    st->verifies++;
+                }
+                return k;
+            }
+            --k;
             --j;
         }
-        if (j < 0)
+        if (st)
         {
-            return i + 1;
+            st->windows++;
+            st->verifies += (j < patlen-1);
         }
 
-        i += max(delta1[string[i]], delta2[j]);
+        // from the mismatch; never less than patlen - j, so i moves on
+        size_t shift = (size_t)max(entry(delta1, string[k], width),
+                                   entry(delta2, j, width));
+        if (st)
+        {
+            st->shifted += shift - (patlen-1 - j);
+        }
+        i = k + shift;
     }
     return NOT_FOUND;
 }
+
+size_t bm_search(const uint8_t *string, size_t stringlen,
+                 const uint8_t *pat, size_t patlen,
+                 const int *delta1, const int *delta2)
+{
+    return search(string, stringlen, pat, patlen, delta1, delta2, 4, 0,
+                  NULL);
+}
+
+// bm_search for a lower case pat, folding the case of string as it goes.
+// delta1 comes from make_delta1_folded; delta2 is unchanged, since it
+// only depends on pat.
+size_t bm_search_folded(const uint8_t *string, size_t stringlen,
+                        const uint8_t *pat, size_t patlen,
+                        const int *delta1, const int *delta2)
+{
+    return search(string, stringlen, pat, patlen, delta1, delta2, 4, 1,
+                  NULL);
+}
+
+#define BM_ALIGN 64
+
+// Copy n full width entries to dest, width bytes each.
+static void narrow(void *dest, const int *src, size_t n, int width)
+{
+    for (size_t i=0; i<n; i++)
+    {
+        switch (width)
+        {
+            case 1:
+                ((uint8_t*)dest)[i] = (uint8_t)src[i];
+                break;
+            case 2:
+                ((uint16_t*)dest)[i] = (uint16_t)src[i];
+                break;
+            default:
+                ((int*)dest)[i] = src[i];
+                break;
+        }
+    }
+}
+
+struct bm *bm_create(const uint8_t *pat, size_t patlen, int fold)
+{
+    int width = (patlen <= 128) ? 1 : (patlen <= 32768) ? 2 : 4;
+    size_t head = (sizeof(struct bm) + 7) & ~(size_t)7;
+    size_t tables = (ALPHABET_LEN + patlen) * (size_t)width;
+    size_t size = (head + tables + patlen + BM_ALIGN - 1) &
+                  ~(size_t)(BM_ALIGN - 1);
+    void *mem = NULL;
+    int *delta1 = (int*)malloc(ALPHABET_LEN * sizeof(int));
+    int *delta2 = (int*)malloc(patlen * sizeof(int));
+    if (!delta1 || !delta2 || (posix_memalign(&mem, BM_ALIGN, size) != 0))
+    {
+        free(delta1);
+        free(delta2);
+        return NULL;
+    }
+    if (fold)
+    {
+        make_delta1_folded(delta1, pat, (int32_t)patlen);
+    }
+    else
+    {
+        make_delta1(delta1, pat, (int32_t)patlen);
+    }
+    make_delta2(delta2, pat, (int32_t)patlen);
+
+    struct bm *b = (struct bm*)mem;
+    uint8_t *p = (uint8_t*)mem + head;
+    narrow(p, delta1, ALPHABET_LEN, width);
+    b->delta1 = p;
+    p += ALPHABET_LEN * (size_t)width;
+    narrow(p, delta2, patlen, width);
+    b->delta2 = p;
+    p += patlen * (size_t)width;
+    memcpy(p, pat, patlen);
+    b->pat = p;
+    b->patlen = patlen;
+    b->width = width;
+    b->fold = fold;
+    free(delta1);
+    free(delta2);
+    return b;
+}
+
+void bm_free(struct bm *b)
+{
+    free(b);
+}
+
+// search() for b, with its width and fold made constant.
+#define BM_DISPATCH(b, string, stringlen, st)                             \
+    switch (((b)->width << 1) | ((b)->fold != 0))                         \
+    {                                                                     \
+        case 2:                                                           \
+            return search(string, stringlen, (b)->pat, (b)->patlen,       \
+                          (b)->delta1, (b)->delta2, 1, 0, st);            \
+        case 3:                                                           \
+            return search(string, stringlen, (b)->pat, (b)->patlen,       \
+                          (b)->delta1, (b)->delta2, 1, 1, st);            \
+        case 4:                                                           \
+            return search(string, stringlen, (b)->pat, (b)->patlen,       \
+                          (b)->delta1, (b)->delta2, 2, 0, st);            \
+        case 5:                                                           \
+            return search(string, stringlen, (b)->pat, (b)->patlen,       \
+                          (b)->delta1, (b)->delta2, 2, 1, st);            \
+        case 8:                                                           \
+            return search(string, stringlen, (b)->pat, (b)->patlen,       \
+                          (b)->delta1, (b)->delta2, 4, 0, st);            \
+        default:                                                          \
+            return search(string, stringlen, (b)->pat, (b)->patlen,       \
+                          (b)->delta1, (b)->delta2, 4, 1, st);            \
+    }
+
+size_t bm_find(const struct bm *b, const uint8_t *string, size_t stringlen)
+{
+    BM_DISPATCH(b, string, stringlen, NULL)
+}
+
+size_t bm_find_stats(const struct bm *b, const uint8_t *string,
+                     size_t stringlen, struct engine_stats *st)
+{
+    st->counted |= ENGINE_VERIFIES | ENGINE_SHIFTS;
+    BM_DISPATCH(b, string, stringlen, st)
+}
@@ -1,15 +1,54 @@
 #ifndef BOYER_MOORE_H
 #define BOYER_MOORE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define NOT_FOUND ((size_t)-1)
 #define ALPHABET_LEN 256
 
+// Everything a search for one pattern reads, in one cache line aligned
+// allocation: this header, then delta1, delta2 and the pattern.  The
+// tables take the narrowest entries that hold every shift (2 * patlen at
+// most): 8 bits up to 128 byte patterns, 16 bits up to 32K.  Built once
+// and only read after that, so any number of threads can share one.
+struct bm
+{
+    const uint8_t *pat;     // these point past the header
+    const void *delta1;
+    const void *delta2;
+    size_t patlen;
+    int width;              // bytes per table entry: 1, 2 or 4
+    int fold;               // pat is lower case; ignore ASCII case
+};
+
+// Returns NULL on allocation failure.
+struct bm *bm_create(const uint8_t *pat, size_t patlen, int fold);
+
+void bm_free(struct bm *b);
+
+// Offset of the first occurrence of b's pattern in string, or NOT_FOUND.
+size_t bm_find(const struct bm *b, const uint8_t *string, size_t stringlen);
+
+// bm_find, adding what it did to *st.
+struct engine_stats;
+size_t bm_find_stats(const struct bm *b, const uint8_t *string,
+                     size_t stringlen, struct engine_stats *st);
+
+// The tables on their own, full width, for callers that keep them.
+
 void make_delta1(int *delta1, const uint8_t *pat, int32_t patlen);
 
+void make_delta1_folded(int *delta1, const uint8_t *pat, int32_t patlen);
+
 void make_delta2(int *delta2, const uint8_t *pat, int32_t patlen);
 
 size_t bm_search(const uint8_t *string, size_t stringlen,
                  const uint8_t *pat, size_t patlen,
-                 int *delta1, int *delta2);
+                 const int *delta1, const int *delta2);
+
+size_t bm_search_folded(const uint8_t *string, size_t stringlen,
+                        const uint8_t *pat, size_t patlen,
+                        const int *delta1, const int *delta2);
 
-#endif // BOYER_MOORE_H
\ No newline at end of file
+#endif // BOYER_MOORE_H
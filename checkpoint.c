@@ -0,0 +1,196 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+
+#define CP_HEADER "mgrep checkpoint 1\n"
+
+static struct checkpoint_entry *find(const struct checkpoint *cp,
+                                     const char *name)
+{
+    for (size_t i=0; i<cp->n; i++)
+    {
+        if (strcmp(cp->entries[i].name, name) == 0)
+        {
+            return &cp->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static int add(struct checkpoint *cp, const char *name, dev_t dev,
+               ino_t ino, size_t pos)
+{
+    struct checkpoint_entry *e = find(cp, name);
+    if (!e)
+    {
+        if (cp->n == cp->alloc)
+        {
+            size_t alloc = cp->alloc ? 2 * cp->alloc : 16;
+            struct checkpoint_entry *entries = (struct checkpoint_entry*)
+                realloc(cp->entries, alloc * sizeof(*entries));
+            if (!entries)
+            {
+                return -1;
+            }
+            cp->entries = entries;
+            cp->alloc = alloc;
+        }
+        e = &cp->entries[cp->n];
+        e->name = strdup(name);
+        if (!e->name)
+        {
+            return -1;
+        }
+        cp->n++;
+    }
+    e->dev = dev;
+    e->ino = ino;
+    e->pos = pos;
+    return 0;
+}
+
+int cp_load(struct checkpoint *cp, const char *path)
+{
+    memset(cp, 0, sizeof(*cp));
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+
+    char *line = NULL;
+    size_t alloc = 0;
+    ssize_t len;
+    int ret = 0;
+    int first = 1;
+    while ((len = getline(&line, &alloc, f)) != -1)
+    {
+        if ((len > 0) && (line[len - 1] == '\n'))
+        {
+            line[--len] = '\0';
+        }
+        if (first)
+        {
+            first = 0;
+            if (strncmp(line, CP_HEADER, strlen(CP_HEADER) - 1) != 0)
+            {
+                errno = EINVAL;
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+
+        uintmax_t pos, dev, ino;
+        int name = 0;
+        if ((sscanf(line, "%ju %ju %ju %n", &pos, &dev, &ino, &name) != 3) ||
+            (name == 0) || (line[name] == '\0'))
+        {
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+        if (add(cp, line + name, (dev_t)dev, (ino_t)ino, (size_t)pos) != 0)
+        {
+            ret = -1;
+            break;
+        }
+    }
+    if ((ret == 0) && ferror(f))
+    {
+        ret = -1;
+    }
+    free(line);
+    fclose(f);
+    if (ret != 0)
+    {
+        int err = errno;
+        cp_free(cp);
+        errno = err;
+    }
+    return ret;
+}
+
+size_t cp_get(const struct checkpoint *cp, const char *name,
+              const struct stat *st)
+{
+    const struct checkpoint_entry *e = find(cp, name);
+    if (!e || (e->dev != st->st_dev) || (e->ino != st->st_ino))
+    {
+        return 0;
+    }
+    return e->pos;
+}
+
+int cp_set(struct checkpoint *cp, const char *name, const struct stat *st,
+           size_t pos)
+{
+    if (strchr(name, '\n'))
+    {
+        return 0;
+    }
+    return add(cp, name, st->st_dev, st->st_ino, pos);
+}
+
+int cp_save(const struct checkpoint *cp, const char *path)
+{
+    // a crash mid-write leaves the old one
+    size_t len = strlen(path);
+    char *tmp = (char*)malloc(len + sizeof(".tmp"));
+    if (!tmp)
+    {
+        return -1;
+    }
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".tmp", sizeof(".tmp"));
+
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+    {
+        free(tmp);
+        return -1;
+    }
+    fputs(CP_HEADER, f);
+    for (size_t i=0; i<cp->n; i++)
+    {
+        const struct checkpoint_entry *e = &cp->entries[i];
+        fprintf(f, "%ju %ju %ju %s\n", (uintmax_t)e->pos, (uintmax_t)e->dev,
+                (uintmax_t)e->ino, e->name);
+    }
+    int ret = 0;
+    if ((fflush(f) != 0) || ferror(f) || (fsync(fileno(f)) != 0))
+    {
+        ret = -1;
+    }
+    if ((fclose(f) != 0) && (ret == 0))
+    {
+        ret = -1;
+    }
+    if ((ret == 0) && (rename(tmp, path) != 0))
+    {
+        ret = -1;
+    }
+    if (ret != 0)
+    {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+    }
+    free(tmp);
+    return ret;
+}
+
+void cp_free(struct checkpoint *cp)
+{
+    for (size_t i=0; i<cp->n; i++)
+    {
+        free(cp->entries[i].name);
+    }
+    free(cp->entries);
+    memset(cp, 0, sizeof(*cp));
+}
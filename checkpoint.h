@@ -0,0 +1,48 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stddef.h>
+
+#include <sys/stat.h>
+
+// Where searches of growing files left off, for --checkpoint: per file
+// name, the file (device and inode, so that one replaced since starts
+// over) and the offset to search it from next.  Kept as a text file of
+// lines "OFFSET DEV INODE NAME", rewritten whole, by renaming a new copy
+// over it, each time it is saved.
+
+struct checkpoint_entry
+{
+    char *name;
+    dev_t dev;
+    ino_t ino;
+    size_t pos;
+};
+
+struct checkpoint
+{
+    struct checkpoint_entry *entries;
+    size_t n;
+    size_t alloc;
+};
+
+// Read path into cp.  A missing file is an empty checkpoint.  Returns
+// 0, or -1 with errno set; EINVAL means path isn't a checkpoint.
+int cp_load(struct checkpoint *cp, const char *path);
+
+// Where to search the file st describes, known as name, from: 0 unless
+// it is the file cp last saw under that name.
+size_t cp_get(const struct checkpoint *cp, const char *name,
+              const struct stat *st);
+
+// Remember pos for name.  Names with a newline in them can't be saved,
+// and are left out.  Returns 0, or -1 if out of memory.
+int cp_set(struct checkpoint *cp, const char *name, const struct stat *st,
+           size_t pos);
+
+// Write cp to path.  Returns 0, or -1 with errno set.
+int cp_save(const struct checkpoint *cp, const char *path);
+
+void cp_free(struct checkpoint *cp);
+
+#endif // CHECKPOINT_H
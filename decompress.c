@@ -0,0 +1,743 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "decompress.h"
+
+// Compressed input is read this much at a time.
+#define DC_IN_SIZE ((size_t)1 << 20)
+
+// zstd frames bigger than this, decompressed, are left to the serial
+// decoder rather than buffered whole for the reader.
+#define DC_FRAME_MAX ((size_t)64 << 20)
+
+#define ZSTD_SKIPPABLE_MASK 0xfffffff0U
+#define ZSTD_SKIPPABLE_START 0x184d2a50U
+
+static uint32_t le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+           ((uint32_t)p[3] << 24);
+}
+
+enum dc_format dc_detect(const uint8_t *head, size_t len)
+{
+    if ((len >= 2) && (head[0] == 0x1f) && (head[1] == 0x8b))
+    {
+        return DC_GZIP;
+    }
+    if (len >= 4)
+    {
+        uint32_t magic = le32(head);
+        if ((magic == 0xfd2fb528U) ||
+            ((magic & ZSTD_SKIPPABLE_MASK) == ZSTD_SKIPPABLE_START))
+        {
+            return DC_ZSTD;
+        }
+        if (magic == 0x184d2204U)
+        {
+            return DC_LZ4;
+        }
+    }
+    return DC_NONE;
+}
+
+int dc_supported(enum dc_format format)
+{
+    switch (format)
+    {
+        case DC_NONE:
+            return 1;
+        case DC_GZIP:
+#ifdef HAVE_ZLIB
+            return 1;
+#else
+            return 0;
+#endif
+        case DC_ZSTD:
+#ifdef HAVE_ZSTD
+            return 1;
+#else
+            return 0;
+#endif
+        case DC_LZ4:
+#ifdef HAVE_LZ4
+            return 1;
+#else
+            return 0;
+#endif
+    }
+    return 0;
+}
+
+#ifdef HAVE_ZSTD
+enum frame_status
+{
+    FRAME_OK,
+    FRAME_CORRUPT,
+    FRAME_NOMEM,
+    FRAME_BIG           // over DC_FRAME_MAX; decompress it serially
+};
+
+// One zstd frame, decompressed on the pool.  Slots are reused, with their
+// context and output buffer, for frame after frame.
+struct frame_job
+{
+    const uint8_t *src;
+    size_t src_len;
+    uint8_t *out;
+    size_t out_len;
+    size_t cap;
+    size_t pos;         // how much of out the reader has taken
+    enum frame_status status;
+    int waited;
+    ZSTD_DCtx *dctx;
+    struct pool_group group;
+};
+#endif
+
+struct decoder
+{
+    int fd;
+    enum dc_format format;
+    int eof;            // nothing more to read from fd
+    int done;           // the end of the decompressed data
+    int in_frame;       // part way through a gzip member or a frame
+    uint8_t *inbuf;
+    const uint8_t *in;  // compressed input not yet decompressed
+    size_t in_len;
+#ifdef HAVE_ZLIB
+    z_stream z;
+    int z_ready;
+    int member_end;     // look for another gzip member
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *zstd;
+
+    // frames a window at a time on the pool, out of the mapped file
+    struct pool *pool;
+    uint8_t *map;
+    size_t map_len;
+    struct frame_job *ring;
+    size_t window;
+    size_t next;        // map offset of the next frame to start
+    size_t serial_at;   // map offset to go serial at, or SIZE_MAX
+    size_t submitted;
+    size_t taken;
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_dctx *lz4;
+#endif
+};
+
+// Read more compressed input, if all of it has been used.  Returns 1 if
+// there is some, 0 at the end of fd, or -1 with errno set.
+static int fill(struct decoder *d)
+{
+    if (d->in_len > 0)
+    {
+        return 1;
+    }
+    for (;;)
+    {
+        if (d->eof)
+        {
+            return 0;
+        }
+        ssize_t n = read(d->fd, d->inbuf, DC_IN_SIZE);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0)
+        {
+            d->eof = 1;
+            return 0;
+        }
+        d->in = d->inbuf;
+        d->in_len = (size_t)n;
+        return 1;
+    }
+}
+
+#ifdef HAVE_ZSTD
+static int grow(struct frame_job *f, size_t cap)
+{
+    uint8_t *out = (uint8_t*)realloc(f->out, cap);
+    if (!out)
+    {
+        f->status = FRAME_NOMEM;
+        return 0;
+    }
+    f->out = out;
+    f->cap = cap;
+    return 1;
+}
+
+static void frame_job_run(void *arg)
+{
+    struct frame_job *f = (struct frame_job*)arg;
+    f->out_len = 0;
+    f->pos = 0;
+    f->status = FRAME_OK;
+    if ((le32(f->src) & ZSTD_SKIPPABLE_MASK) == ZSTD_SKIPPABLE_START)
+    {
+        return;
+    }
+
+    unsigned long long size = ZSTD_getFrameContentSize(f->src, f->src_len);
+    if (size != ZSTD_CONTENTSIZE_UNKNOWN)
+    {
+        if ((size > f->cap) && !grow(f, (size_t)size))
+        {
+            return;
+        }
+        size_t n = ZSTD_decompressDCtx(f->dctx, f->out, f->cap, f->src,
+                                       f->src_len);
+        if (ZSTD_isError(n) || (n != size))
+        {
+            f->status = FRAME_CORRUPT;
+            return;
+        }
+        f->out_len = n;
+        return;
+    }
+
+    // no size in the header: stream it, growing out as it fills
+    if ((f->cap == 0) && !grow(f, DC_IN_SIZE))
+    {
+        return;
+    }
+    ZSTD_DCtx_reset(f->dctx, ZSTD_reset_session_only);
+    ZSTD_inBuffer in = { f->src, f->src_len, 0 };
+    ZSTD_outBuffer out = { f->out, f->cap, 0 };
+    for (;;)
+    {
+        size_t ret = ZSTD_decompressStream(f->dctx, &out, &in);
+        if (ZSTD_isError(ret))
+        {
+            f->status = FRAME_CORRUPT;
+            return;
+        }
+        if (ret == 0)
+        {
+            f->out_len = out.pos;
+            return;
+        }
+        if (out.pos < out.size)
+        {
+            if (in.pos == in.size)
+            {
+                // all of the frame read, but not all of it decompressed
+                f->status = FRAME_CORRUPT;
+                return;
+            }
+            continue;
+        }
+        if (2 * f->cap > DC_FRAME_MAX)
+        {
+            f->status = FRAME_BIG;
+            return;
+        }
+        if (!grow(f, 2 * f->cap))
+        {
+            return;
+        }
+        out.dst = f->out;
+        out.size = f->cap;
+    }
+}
+
+// Start frames until the window is full.  A frame that can't be found
+// or is too big to hold is where the serial decoder takes over.
+static void top_up(struct decoder *d)
+{
+    while ((d->submitted - d->taken < d->window) &&
+           (d->next < d->map_len) && (d->next != d->serial_at))
+    {
+        const uint8_t *src = d->map + d->next;
+        size_t left = d->map_len - d->next;
+        size_t len = ZSTD_findFrameCompressedSize(src, left);
+        unsigned long long size = 0;
+        if (!ZSTD_isError(len) && (len >= 4) &&
+            ((le32(src) & ZSTD_SKIPPABLE_MASK) != ZSTD_SKIPPABLE_START))
+        {
+            size = ZSTD_getFrameContentSize(src, len);
+        }
+        if (ZSTD_isError(len) || (len < 4) ||
+            (size == ZSTD_CONTENTSIZE_ERROR) ||
+            ((size != ZSTD_CONTENTSIZE_UNKNOWN) && (size > DC_FRAME_MAX)))
+        {
+            d->serial_at = d->next;
+            return;
+        }
+
+        struct frame_job *f = &d->ring[d->submitted % d->window];
+        f->src = src;
+        f->src_len = len;
+        f->waited = 0;
+        d->next += len;
+        d->submitted++;
+        if (pool_submit_group(d->pool, &f->group, frame_job_run, f) != 0)
+        {
+            frame_job_run(f);
+        }
+    }
+}
+
+// Wait for the frames in flight and go on serially from map offset at.
+static void go_serial(struct decoder *d, size_t at)
+{
+    for (; d->taken < d->submitted; d->taken++)
+    {
+        struct frame_job *f = &d->ring[d->taken % d->window];
+        pool_wait_group(d->pool, &f->group);
+    }
+    for (size_t i=0; i<d->window; i++)
+    {
+        ZSTD_freeDCtx(d->ring[i].dctx);
+        free(d->ring[i].out);
+    }
+    free(d->ring);
+    d->ring = NULL;
+    ZSTD_DCtx_reset(d->zstd, ZSTD_reset_session_only);
+    d->in = d->map + at;
+    d->in_len = d->map_len - at;
+    d->eof = 1;
+}
+
+// Hand out the frames in order.  Returns what was copied, or -1 with
+// errno set.  Leaves d->ring NULL if the rest is to be decompressed
+// serially.
+static ssize_t read_frames(struct decoder *d, uint8_t *buf, size_t len)
+{
+    size_t got = 0;
+    while ((got < len) && d->ring)
+    {
+        top_up(d);
+        if (d->taken == d->submitted)
+        {
+            if (d->next < d->map_len)
+            {
+                go_serial(d, d->next);
+            }
+            else
+            {
+                d->done = 1;
+                break;
+            }
+            continue;
+        }
+
+        struct frame_job *f = &d->ring[d->taken % d->window];
+        if (!f->waited)
+        {
+            pool_wait_group(d->pool, &f->group);
+            f->waited = 1;
+        }
+        if (f->status != FRAME_OK)
+        {
+            if (got > 0)
+            {
+                // the error is for the next call
+                break;
+            }
+            if (f->status == FRAME_BIG)
+            {
+                go_serial(d, (size_t)(f->src - d->map));
+                continue;
+            }
+            errno = (f->status == FRAME_NOMEM) ? ENOMEM : EBADMSG;
+            return -1;
+        }
+        size_t n = f->out_len - f->pos;
+        if (n > len - got)
+        {
+            n = len - got;
+        }
+        memcpy(buf + got, f->out + f->pos, n);
+        f->pos += n;
+        got += n;
+        if (f->pos == f->out_len)
+        {
+            d->taken++;
+        }
+    }
+    return (ssize_t)got;
+}
+
+// Set up read_frames() if fd is a regular file of several frames and
+// there is a pool to decompress them on.  Otherwise, or on error, leaves
+// the file to the serial decoder.
+static void start_frames(struct decoder *d, const struct stat *st,
+                         struct pool *pool, int jobs)
+{
+    if (!pool || (jobs < 2) || !S_ISREG(st->st_mode) || (st->st_size <= 0))
+    {
+        return;
+    }
+    size_t map_len = (size_t)st->st_size;
+    void *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, d->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return;
+    }
+    size_t first = ZSTD_findFrameCompressedSize(map, map_len);
+    if (ZSTD_isError(first) || (first >= map_len))
+    {
+        munmap(map, map_len);
+        return;
+    }
+    madvise(map, map_len, MADV_SEQUENTIAL);
+
+    size_t window = 2 * (size_t)jobs;
+    d->ring = (struct frame_job*)calloc(window, sizeof(struct frame_job));
+    if (!d->ring)
+    {
+        munmap(map, map_len);
+        return;
+    }
+    for (size_t i=0; i<window; i++)
+    {
+        d->ring[i].dctx = ZSTD_createDCtx();
+        if (!d->ring[i].dctx)
+        {
+            for (size_t j=0; j<i; j++)
+            {
+                ZSTD_freeDCtx(d->ring[j].dctx);
+            }
+            free(d->ring);
+            d->ring = NULL;
+            munmap(map, map_len);
+            return;
+        }
+    }
+    d->pool = pool;
+    d->map = (uint8_t*)map;
+    d->map_len = map_len;
+    d->window = window;
+    d->next = 0;
+    d->serial_at = SIZE_MAX;
+    d->submitted = 0;
+    d->taken = 0;
+}
+#endif // HAVE_ZSTD
+
+struct decoder *dc_open(int fd, const struct stat *st, struct pool *pool,
+                        int jobs)
+{
+    struct decoder *d = (struct decoder*)calloc(1, sizeof(struct decoder));
+    if (!d)
+    {
+        return NULL;
+    }
+    d->fd = fd;
+    d->inbuf = (uint8_t*)calloc(1, DC_IN_SIZE);
+    if (!d->inbuf)
+    {
+        free(d);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // enough to tell the format by, even off a pipe
+    d->in = d->inbuf;
+    while ((d->in_len < DC_MAGIC_LEN) && !d->eof)
+    {
+        ssize_t n = read(fd, d->inbuf + d->in_len, DC_IN_SIZE - d->in_len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            dc_close(d);
+            return NULL;
+        }
+        d->eof = (n == 0);
+        d->in_len += (size_t)n;
+    }
+    d->format = dc_detect(d->inbuf, d->in_len);
+    if (!dc_supported(d->format))
+    {
+        dc_close(d);
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    int ok = 1;
+    d->in_frame = (d->format != DC_NONE);
+    switch (d->format)
+    {
+        case DC_NONE:
+            break;
+        case DC_GZIP:
+#ifdef HAVE_ZLIB
+            // 16: gzip, not zlib
+            ok = (inflateInit2(&d->z, 16 + MAX_WBITS) == Z_OK);
+            d->z_ready = ok;
+#endif
+            break;
+        case DC_ZSTD:
+#ifdef HAVE_ZSTD
+            d->zstd = ZSTD_createDCtx();
+            ok = (d->zstd != NULL);
+            if (ok)
+            {
+                start_frames(d, st, pool, jobs);
+            }
+#endif
+            break;
+        case DC_LZ4:
+#ifdef HAVE_LZ4
+            ok = !LZ4F_isError(LZ4F_createDecompressionContext(&d->lz4,
+                                                               LZ4F_VERSION));
+#endif
+            break;
+    }
+    if (!ok)
+    {
+        dc_close(d);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return d;
+}
+
+enum dc_format dc_format(const struct decoder *d)
+{
+    return d->format;
+}
+
+// Decompress some of d->in into out, setting *produced.  Returns 0, or
+// -1 if the input is corrupt.
+static int step(struct decoder *d, uint8_t *out, size_t len,
+                size_t *produced)
+{
+    size_t used = 0;
+    *produced = 0;
+    switch (d->format)
+    {
+        case DC_NONE:
+            break;
+        case DC_GZIP:
+#ifdef HAVE_ZLIB
+            if (d->member_end)
+            {
+                if (d->in_len == 0)
+                {
+                    return 0;
+                }
+                if (d->in[0] != 0x1f)
+                {
+                    // trailing garbage, which gzip ignores too
+                    d->in_len = 0;
+                    d->done = 1;
+                    return 0;
+                }
+                inflateReset(&d->z);
+                d->member_end = 0;
+                d->in_frame = 1;
+            }
+            d->z.next_in = (Bytef*)d->in;
+            d->z.avail_in = (uInt)((d->in_len < UINT32_MAX) ? d->in_len
+                                                            : UINT32_MAX);
+            d->z.next_out = out;
+            d->z.avail_out = (uInt)((len < UINT32_MAX) ? len : UINT32_MAX);
+            {
+                uInt in_was = d->z.avail_in;
+                uInt out_was = d->z.avail_out;
+                int ret = inflate(&d->z, Z_NO_FLUSH);
+                if ((ret != Z_OK) && (ret != Z_STREAM_END) &&
+                    (ret != Z_BUF_ERROR))
+                {
+                    return -1;
+                }
+                used = in_was - d->z.avail_in;
+                *produced = out_was - d->z.avail_out;
+                if (ret == Z_STREAM_END)
+                {
+                    d->member_end = 1;
+                    d->in_frame = 0;
+                }
+            }
+#endif
+            break;
+        case DC_ZSTD:
+#ifdef HAVE_ZSTD
+            {
+                ZSTD_inBuffer in = { d->in, d->in_len, 0 };
+                ZSTD_outBuffer o = { out, len, 0 };
+                size_t ret = ZSTD_decompressStream(d->zstd, &o, &in);
+                if (ZSTD_isError(ret))
+                {
+                    return -1;
+                }
+                used = in.pos;
+                *produced = o.pos;
+                if (used || o.pos)
+                {
+                    // 0 is the end of a frame
+                    d->in_frame = (ret != 0);
+                }
+            }
+#endif
+            break;
+        case DC_LZ4:
+#ifdef HAVE_LZ4
+            {
+                size_t in_size = d->in_len;
+                size_t out_size = len;
+                size_t ret = LZ4F_decompress(d->lz4, out, &out_size, d->in,
+                                             &in_size, NULL);
+                if (LZ4F_isError(ret))
+                {
+                    return -1;
+                }
+                used = in_size;
+                *produced = out_size;
+                if (used || out_size)
+                {
+                    d->in_frame = (ret != 0);
+                }
+            }
+#endif
+            break;
+    }
+    d->in += used;
+    d->in_len -= used;
+    return 0;
+}
+
+ssize_t dc_read(struct decoder *d, void *buf, size_t len)
+{
+    uint8_t *out = (uint8_t*)buf;
+    if (d->format == DC_NONE)
+    {
+        if (d->in_len > 0)
+        {
+            size_t n = (d->in_len < len) ? d->in_len : len;
+            memcpy(out, d->in, n);
+            d->in += n;
+            d->in_len -= n;
+            return (ssize_t)n;
+        }
+        if (d->eof)
+        {
+            return 0;
+        }
+        return read(d->fd, buf, len);
+    }
+
+    size_t got = 0;
+#ifdef HAVE_ZSTD
+    if (d->ring)
+    {
+        ssize_t n = read_frames(d, out, len);
+        if ((n < 0) || d->ring || d->done)
+        {
+            return n;
+        }
+        got = (size_t)n;
+    }
+#endif
+    while ((got < len) && !d->done)
+    {
+        size_t produced;
+        if (step(d, out + got, len - got, &produced) != 0)
+        {
+            if (got > 0)
+            {
+                // the error is for the next call
+                break;
+            }
+            errno = EBADMSG;
+            return -1;
+        }
+        got += produced;
+        if ((produced > 0) || (d->in_len > 0))
+        {
+            continue;
+        }
+
+        // the decoder wants more input
+        if ((got > 0) && !d->eof)
+        {
+            // rather than wait for a pipe
+            break;
+        }
+        int more = fill(d);
+        if (more < 0)
+        {
+            if (got > 0)
+            {
+                break;
+            }
+            return -1;
+        }
+        if (more == 0)
+        {
+            if (d->in_frame)
+            {
+                if (got > 0)
+                {
+                    break;
+                }
+                errno = EBADMSG;    // cut short
+                return -1;
+            }
+            d->done = 1;
+        }
+    }
+    return (ssize_t)got;
+}
+
+void dc_close(struct decoder *d)
+{
+    if (!d)
+    {
+        return;
+    }
+#ifdef HAVE_ZLIB
+    if (d->z_ready)
+    {
+        inflateEnd(&d->z);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (d->ring)
+    {
+        go_serial(d, d->map_len);
+    }
+    if (d->map)
+    {
+        munmap(d->map, d->map_len);
+    }
+    ZSTD_freeDCtx(d->zstd);
+#endif
+#ifdef HAVE_LZ4
+    if (d->lz4)
+    {
+        LZ4F_freeDecompressionContext(d->lz4);
+    }
+#endif
+    free(d->inbuf);
+    free(d);
+}
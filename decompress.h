@@ -0,0 +1,59 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "pool.h"
+
+// Reading gzip, zstd and lz4 input as the bytes it decompresses to, for
+// -z.  Each format is only there when mgrep is built with its library
+// (-DHAVE_ZLIB, -DHAVE_ZSTD, -DHAVE_LZ4; see the Makefile).
+//
+// A zstd file of several frames, as written by pzstd, seekable-format
+// tools or just cat, is decompressed a frame per job on the pool, a
+// window of frames ahead of the reader, into buffers that are reused from
+// frame to frame.  Everything else is decompressed in order as it is
+// read.
+
+enum dc_format
+{
+    DC_NONE,            // not compressed, or not in a format we know
+    DC_GZIP,
+    DC_ZSTD,
+    DC_LZ4
+};
+
+// Bytes dc_detect() wants to see.
+#define DC_MAGIC_LEN 4
+
+// The format of data starting with head.
+enum dc_format dc_detect(const uint8_t *head, size_t len);
+
+// Non-zero if this build can decompress format.
+int dc_supported(enum dc_format format);
+
+struct decoder;
+
+// Read fd from where it is, which for a regular file (per st) should be
+// the start.  Input that isn't compressed is passed through unchanged.
+// pool, if not NULL, is for decompressing zstd frames jobs at a time.
+// Returns NULL with errno set; ENOTSUP means the input is in a format
+// this build can't decompress.
+struct decoder *dc_open(int fd, const struct stat *st, struct pool *pool,
+                        int jobs);
+
+enum dc_format dc_format(const struct decoder *d);
+
+// As read(2): up to len decompressed bytes into buf, 0 at the end, or -1
+// with errno set.  EBADMSG means the compressed data is corrupt or cut
+// short.
+ssize_t dc_read(struct decoder *d, void *buf, size_t len);
+
+// Also waits for any frames still being decompressed.  Doesn't close fd.
+void dc_close(struct decoder *d);
+
+#endif // DECOMPRESS_H
@@ -0,0 +1,20 @@
+#ifndef FOLD_H
+#define FOLD_H
+
+#include <stdint.h>
+
+// ASCII case folding for -i.  Patterns are folded to lower case up
+// front; input bytes are folded as they are compared.  Only A-Z and a-z
+// are affected, so binary data around text is left alone.
+
+static inline int fold_is_alpha(uint8_t c)
+{
+    return (uint8_t)((c | 0x20) - 'a') < 26;
+}
+
+static inline uint8_t fold_byte(uint8_t c)
+{
+    return ((uint8_t)(c - 'A') < 26) ? (uint8_t)(c | 0x20) : c;
+}
+
+#endif // FOLD_H
@@ -0,0 +1,60 @@
+// libFuzzer target: db_open on any file.  Whatever it accepts must be
+// safe to search: every match inside the text, of a pattern it has.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "boyer_moore.h"
+#include "pattern_db.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static char path[] = "/tmp/mgrep-fuzz-db-XXXXXX";
+    static int made = 0;
+    if (!made)
+    {
+        int fd = mkstemp(path);
+        if (fd < 0)
+        {
+            abort();
+        }
+        close(fd);
+        made = 1;
+    }
+    FILE *f = fopen(path, "wb");
+    if (!f)
+    {
+        abort();
+    }
+    fwrite(data, 1, size, f);
+    fclose(f);
+
+    struct pattern_db db;
+    if (db_open(&db, path) != 0)
+    {
+        return 0;
+    }
+    if (db.has_ac)
+    {
+        // the input is as good a text as any
+        size_t last = 0;
+        size_t next;
+        size_t which = 0;
+        while ((last < size) &&
+               ((next = ac_search(&db.ac, data + last, size - last, &which))
+                != NOT_FOUND))
+        {
+            if ((which >= db.npats) || (next > size - last) ||
+                (db.ac.patlen[which] == 0) ||
+                (db.ac.patlen[which] > size - last - next))
+            {
+                abort();
+            }
+            last += next + db.ac.patlen[which];
+        }
+    }
+    db_close(&db);
+    return 0;
+}
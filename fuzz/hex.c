@@ -0,0 +1,44 @@
+// libFuzzer target: hex_decode and hex_decode_masked on any string.
+// Either may refuse it, but what they return must be consistent: the
+// same length, the masked form agreeing with the plain one where it has
+// no wildcards, and pattern bytes with the free bits cleared.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "patterns.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    char *word = (char*)malloc(size + 1);
+    if (!word)
+    {
+        return 0;
+    }
+    memcpy(word, data, size);
+    word[size] = '\0';
+
+    size_t len = 0;
+    uint8_t *plain = hex_decode(word, &len);
+    size_t masked_len = 0;
+    uint8_t *mask = NULL;
+    uint8_t *masked = hex_decode_masked(word, &masked_len, &mask);
+    if (plain && (!masked || (masked_len != len) || mask ||
+                  (memcmp(plain, masked, len) != 0)))
+    {
+        abort();
+    }
+    for (size_t i=0; masked && mask && (i<masked_len); i++)
+    {
+        if (masked[i] & ~mask[i])
+        {
+            abort();
+        }
+    }
+    free(plain);
+    free(masked);
+    free(mask);
+    free(word);
+    return 0;
+}
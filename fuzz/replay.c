@@ -0,0 +1,46 @@
+// A main() for the fuzz targets without libFuzzer: run each file named
+// on the command line through LLVMFuzzerTestOneInput, to replay a corpus
+// or a crash with any compiler.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int main(int argc, char *argv[])
+{
+    for (int i=1; i<argc; i++)
+    {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f)
+        {
+            perror(argv[i]);
+            return 2;
+        }
+        uint8_t *data = NULL;
+        size_t size = 0;
+        size_t alloc = 0;
+        size_t n;
+        do
+        {
+            if (size == alloc)
+            {
+                alloc = alloc ? 2 * alloc : 4096;
+                uint8_t *more = (uint8_t*)realloc(data, alloc);
+                if (!more)
+                {
+                    fprintf(stderr, "Out of memory\n");
+                    return 2;
+                }
+                data = more;
+            }
+            n = fread(data + size, 1, alloc - size, f);
+            size += n;
+        } while (n > 0);
+        fclose(f);
+        LLVMFuzzerTestOneInput(data, size);
+        free(data);
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+// libFuzzer target: the scan API.  The input is a flags byte, then
+// patterns separated by newlines up to a NUL, then the data to search.
+// mgrep_scan must report matches in order, without overlaps, inside the
+// data and of patterns it has, and a stream fed the same data in pieces
+// (of sizes taken from the data) must report exactly the same ones.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libmgrep.h"
+
+#define FUZZ_PATTERNS 16
+#define FUZZ_HITS 4096
+
+struct hits
+{
+    size_t n;
+    uint64_t offset[FUZZ_HITS];
+    size_t pattern[FUZZ_HITS];
+    size_t len[FUZZ_HITS];
+};
+
+static int collect(void *arg, uint64_t offset, size_t pattern, size_t len)
+{
+    struct hits *h = (struct hits*)arg;
+    if (h->n == FUZZ_HITS)
+    {
+        return 1;
+    }
+    h->offset[h->n] = offset;
+    h->pattern[h->n] = pattern;
+    h->len[h->n++] = len;
+    return 0;
+}
+
+static struct hits scanned;
+static struct hits streamed;
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    const uint8_t *nul = (size > 1) ? memchr(data + 1, 0, size - 1) : NULL;
+    if (!nul)
+    {
+        return 0;
+    }
+    int flags = data[0] & (MGREP_LITERAL | MGREP_IGNORE_CASE | MGREP_WIDE);
+    size_t text_len = (size_t)(nul - data) - 1;
+    char *text = (char*)malloc(text_len + 1);
+    if (!text)
+    {
+        return 0;
+    }
+    memcpy(text, data + 1, text_len);
+    text[text_len] = '\0';
+    const char *pats[FUZZ_PATTERNS];
+    size_t npats = 0;
+    for (char *p = text; p && (npats < FUZZ_PATTERNS); )
+    {
+        pats[npats++] = p;
+        p = strchr(p, '\n');
+        if (p)
+        {
+            *p++ = '\0';
+        }
+    }
+    const uint8_t *buf = nul + 1;
+    size_t len = size - (size_t)(buf - data);
+
+    struct mgrep *g = mgrep_compile(pats, npats, flags);
+    if (!g)
+    {
+        free(text);
+        return 0;
+    }
+    scanned.n = 0;
+    mgrep_scan(g, buf, len, collect, &scanned);
+    uint64_t end = 0;
+    for (size_t i=0; i<scanned.n; i++)
+    {
+        if ((scanned.offset[i] < end) || (scanned.len[i] == 0) ||
+            (scanned.len[i] > len) ||
+            (scanned.offset[i] > len - scanned.len[i]) ||
+            (scanned.pattern[i] >= mgrep_patterns(g)))
+        {
+            abort();
+        }
+        end = scanned.offset[i] + scanned.len[i];
+    }
+
+    streamed.n = 0;
+    struct mgrep_stream *st = mgrep_stream_open(g, collect, &streamed);
+    if (st)
+    {
+        size_t off = 0;
+        for (size_t k=0; off < len; k++)
+        {
+            size_t piece = 1 + data[k % size] % 64;
+            piece = (piece < len - off) ? piece : len - off;
+            mgrep_stream_feed(st, buf + off, piece);
+            off += piece;
+        }
+        mgrep_stream_close(st);
+        if ((scanned.n < FUZZ_HITS) &&
+            ((streamed.n != scanned.n) ||
+             (memcmp(streamed.offset, scanned.offset,
+                     scanned.n * sizeof(uint64_t)) != 0) ||
+             (memcmp(streamed.pattern, scanned.pattern,
+                     scanned.n * sizeof(size_t)) != 0)))
+        {
+            abort();
+        }
+    }
+    mgrep_free(g);
+    free(text);
+    return 0;
+}
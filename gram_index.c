@@ -0,0 +1,551 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fold.h"
+#include "gram_index.h"
+
+#define GI_ENDIAN 0x01020304
+#define GI_MAP_BYTES (((size_t)1 << GI_BITS) / 8)
+
+// Blocks indexed by one task.
+#define GI_CHUNK_BLOCKS 256
+
+// Grams of a pattern looked up, spread along it; more than this only
+// makes the lookup slower.
+#define GI_GRAMS 32
+
+// Beyond this many patterns, looking them all up costs more than it is
+// likely to save.
+#define GI_MAX_PATTERNS 256
+
+struct gi_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t block;         // GI_BLOCK
+    uint32_t bits;          // GI_BITS
+    uint64_t size;          // of the whole index
+
+    // the file indexed
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+
+    uint64_t nblocks;
+    uint64_t offsets;       // uint64_t[nblocks + 1], from the start
+};
+
+static inline uint32_t gi_hash(uint32_t gram)
+{
+    return (gram * 0x9e3779b1u) >> (32 - GI_BITS);
+}
+
+char *gi_path(const char *file_name)
+{
+    size_t len = strlen(file_name);
+    char *path = (char*)malloc(len + sizeof(GI_SUFFIX));
+    if (path)
+    {
+        memcpy(path, file_name, len);
+        memcpy(path + len, GI_SUFFIX, sizeof(GI_SUFFIX));
+    }
+    return path;
+}
+
+// GI_CHUNK_BLOCKS blocks of the file, indexed as one task.
+struct gi_chunk
+{
+    const uint8_t *data;
+    size_t size;            // of the whole file
+    size_t first;           // block number
+    size_t nblocks;
+    uint8_t *out;           // the blocks' entries, one after another
+    size_t *lens;
+    int here;               // not queued; run by the writer
+    struct pool_group group;
+};
+
+// Write block b's entry to out, returning its length.
+static size_t gi_index_block(const struct gi_chunk *c, size_t b,
+                             uint8_t *out)
+{
+    uint8_t map[GI_MAP_BYTES];
+    memset(map, 0, sizeof(map));
+    size_t start = b * GI_BLOCK;
+    size_t end = (c->size - start > GI_BLOCK) ? start + GI_BLOCK : c->size;
+    if (c->size - start >= 3)
+    {
+        // grams starting in the block, the last ones running into the
+        // next
+        uint32_t gram = ((uint32_t)c->data[start] << 8) | c->data[start + 1];
+        for (size_t i=start; (i < end) && (i + 2 < c->size); i++)
+        {
+            gram = ((gram << 8) | c->data[i + 2]) & 0xffffff;
+            uint32_t h = gi_hash(gram);
+            map[h >> 3] |= (uint8_t)(1 << (h & 7));
+        }
+    }
+
+    size_t count = 0;
+    for (size_t i=0; i<GI_MAP_BYTES; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, map + i, 8);
+        count += (size_t)__builtin_popcountll(word);
+    }
+    if (2 * count >= GI_MAP_BYTES)
+    {
+        memcpy(out, map, GI_MAP_BYTES);
+        return GI_MAP_BYTES;
+    }
+    uint16_t *list = (uint16_t*)out;
+    size_t n = 0;
+    for (size_t i=0; i<GI_MAP_BYTES; i++)
+    {
+        for (uint8_t bits = map[i]; bits; bits &= (uint8_t)(bits - 1))
+        {
+            list[n++] = (uint16_t)(8 * i + (size_t)__builtin_ctz(bits));
+        }
+    }
+    return 2 * n;
+}
+
+static void gi_chunk_run(void *arg)
+{
+    struct gi_chunk *c = (struct gi_chunk*)arg;
+    size_t used = 0;
+    for (size_t i=0; i<c->nblocks; i++)
+    {
+        c->lens[i] = gi_index_block(c, c->first + i, c->out + used);
+        used += c->lens[i];
+    }
+}
+
+int gi_build(const char *file_name, const char *index_name,
+             struct pool *pool, int jobs)
+{
+    struct gi_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, GI_MAGIC, sizeof(GI_MAGIC));
+    h.version = GI_VERSION;
+    h.endian = GI_ENDIAN;
+    h.block = (uint32_t)GI_BLOCK;
+    h.bits = GI_BITS;
+
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    uint64_t *offsets = NULL;
+    struct gi_chunk *ring = NULL;
+    size_t window = pool ? 2 * (size_t)jobs : 1;
+    size_t nchunks = 0;
+    size_t submitted = 0;
+    size_t k = 0;
+    char *tmp = NULL;
+    FILE *f = NULL;
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        goto error;
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+        errno = EINVAL;
+        goto error;
+    }
+    size = (size_t)st.st_size;
+    h.file_size = size;
+    h.mtime_sec = (int64_t)st.st_mtim.tv_sec;
+    h.mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+    h.nblocks = (size + GI_BLOCK - 1) / GI_BLOCK;
+    if (size > 0)
+    {
+        data = (const uint8_t*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd,
+                                    0);
+        if (data == MAP_FAILED)
+        {
+            data = NULL;
+            goto error;
+        }
+        madvise((void*)data, size, MADV_SEQUENTIAL);
+    }
+
+    nchunks = (h.nblocks + GI_CHUNK_BLOCKS - 1) / GI_CHUNK_BLOCKS;
+    if (window > nchunks)
+    {
+        window = nchunks ? nchunks : 1;
+    }
+    offsets = (uint64_t*)malloc((h.nblocks + 1) * sizeof(uint64_t));
+    ring = (struct gi_chunk*)calloc(window, sizeof(struct gi_chunk));
+    // built beside index_name and renamed over it, so a search that has
+    // the old index mapped keeps its pages, and a failed build leaves no
+    // half-written index
+    size_t name_len = strlen(index_name);
+    tmp = (char*)malloc(name_len + sizeof(".tmp"));
+    if (!offsets || !ring || !tmp)
+    {
+        goto error;
+    }
+    memcpy(tmp, index_name, name_len);
+    memcpy(tmp + name_len, ".tmp", sizeof(".tmp"));
+    if (!(f = fopen(tmp, "wb")))
+    {
+        goto error;
+    }
+    for (size_t i=0; i<window; i++)
+    {
+        ring[i].out = (uint8_t*)malloc(GI_CHUNK_BLOCKS * GI_MAP_BYTES);
+        ring[i].lens = (size_t*)malloc(GI_CHUNK_BLOCKS * sizeof(size_t));
+        if (!ring[i].out || !ring[i].lens)
+        {
+            goto error;
+        }
+    }
+
+    // header first, rewritten with the offsets at the end
+    if (fwrite(&h, sizeof(h), 1, f) != 1)
+    {
+        goto error;
+    }
+    uint64_t off = sizeof(h);
+
+    // as for a search: up to two chunks per worker in flight, written out
+    // in order
+    for (k=0; k<nchunks; k++)
+    {
+        for (; (submitted < nchunks) && (submitted < k + window); submitted++)
+        {
+            struct gi_chunk *c = &ring[submitted % window];
+            c->data = data;
+            c->size = size;
+            c->first = submitted * GI_CHUNK_BLOCKS;
+            c->nblocks = h.nblocks - c->first;
+            if (c->nblocks > GI_CHUNK_BLOCKS)
+            {
+                c->nblocks = GI_CHUNK_BLOCKS;
+            }
+            c->here = !pool || (pool_submit_group(pool, &c->group,
+                                                  gi_chunk_run, c) != 0);
+        }
+
+        struct gi_chunk *c = &ring[k % window];
+        if (c->here)
+        {
+            gi_chunk_run(c);
+        }
+        else
+        {
+            pool_wait_group(pool, &c->group);
+        }
+        size_t used = 0;
+        for (size_t i=0; i<c->nblocks; i++)
+        {
+            offsets[c->first + i] = off + used;
+            used += c->lens[i];
+        }
+        if (fwrite(c->out, 1, used, f) != used)
+        {
+            goto error;
+        }
+        off += used;
+    }
+    offsets[h.nblocks] = off;
+
+    static const uint8_t zeros[8];
+    size_t pad = (8 - off % 8) % 8;
+    h.offsets = off + pad;
+    h.size = h.offsets + (h.nblocks + 1) * sizeof(uint64_t);
+    if ((fwrite(zeros, 1, pad, f) != pad) ||
+        (fwrite(offsets, sizeof(uint64_t), h.nblocks + 1, f) !=
+         h.nblocks + 1) ||
+        (fseek(f, 0, SEEK_SET) != 0) ||
+        (fwrite(&h, sizeof(h), 1, f) != 1) ||
+        (fflush(f) != 0) || (fsync(fileno(f)) != 0))
+    {
+        goto error;
+    }
+    FILE *done = f;
+    f = NULL;
+    if ((fclose(done) != 0) || (rename(tmp, index_name) != 0))
+    {
+        goto error;
+    }
+
+    for (size_t i=0; i<window; i++)
+    {
+        free(ring[i].out);
+        free(ring[i].lens);
+    }
+    free(ring);
+    free(offsets);
+    if (data)
+    {
+        munmap((void*)data, size);
+    }
+    close(fd);
+    free(tmp);
+    return 0;
+
+error:
+    {
+        int saved = errno;
+        // let any chunks still in flight finish before freeing them
+        for (; k < submitted; k++)
+        {
+            if (!ring[k % window].here)
+            {
+                pool_wait_group(pool, &ring[k % window].group);
+            }
+        }
+        if (f)
+        {
+            fclose(f);
+        }
+        if (tmp)
+        {
+            unlink(tmp);
+        }
+        free(tmp);
+        if (ring)
+        {
+            for (size_t i=0; i<window; i++)
+            {
+                free(ring[i].out);
+                free(ring[i].lens);
+            }
+        }
+        free(ring);
+        free(offsets);
+        if (data)
+        {
+            munmap((void*)data, size);
+        }
+        close(fd);
+        errno = saved ? saved : EIO;
+    }
+    return -1;
+}
+
+int gi_open(struct gram_index *gi, const char *index_name,
+            const struct stat *st)
+{
+    memset(gi, 0, sizeof(*gi));
+    int fd = open(index_name, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct stat ist;
+    if (fstat(fd, &ist) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)ist.st_size < sizeof(struct gi_header))
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    gi->size = (size_t)ist.st_size;
+    gi->map = mmap(NULL, gi->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (gi->map == MAP_FAILED)
+    {
+        gi->map = NULL;
+        return -1;
+    }
+
+    const uint8_t *base = (const uint8_t*)gi->map;
+    const struct gi_header *h = (const struct gi_header*)base;
+    uint64_t n = h->nblocks;
+    if ((memcmp(h->magic, GI_MAGIC, sizeof(GI_MAGIC)) != 0) ||
+        (h->version != GI_VERSION) || (h->endian != GI_ENDIAN) ||
+        (h->block != GI_BLOCK) || (h->bits != GI_BITS) ||
+        (h->size != gi->size) ||
+        (h->file_size != (uint64_t)st->st_size) ||
+        (h->mtime_sec != (int64_t)st->st_mtim.tv_sec) ||
+        (h->mtime_nsec != (int64_t)st->st_mtim.tv_nsec) ||
+        (n != (h->file_size + GI_BLOCK - 1) / GI_BLOCK) ||
+        (h->offsets % 8 != 0) || (h->offsets > gi->size) ||
+        (gi->size - h->offsets != (n + 1) * sizeof(uint64_t)))
+    {
+        goto invalid;
+    }
+    gi->nblocks = (size_t)n;
+    gi->offsets = (const uint64_t*)(base + h->offsets);
+    if ((gi->offsets[0] != sizeof(struct gi_header)) ||
+        (gi->offsets[n] > h->offsets))
+    {
+        goto invalid;
+    }
+    for (size_t i=0; i<n; i++)
+    {
+        uint64_t len = gi->offsets[i + 1] - gi->offsets[i];
+        if ((gi->offsets[i + 1] < gi->offsets[i]) ||
+            ((len != GI_MAP_BYTES) &&
+             ((len % 2 != 0) || (len > GI_MAP_BYTES))))
+        {
+            goto invalid;
+        }
+    }
+    return 0;
+
+invalid:
+    gi_close(gi);
+    errno = EINVAL;
+    return -1;
+}
+
+void gi_close(struct gram_index *gi)
+{
+    if (gi->map)
+    {
+        munmap(gi->map, gi->size);
+    }
+    memset(gi, 0, sizeof(*gi));
+}
+
+// Non-zero if a gram hashing to h starts in block b.
+static int gi_has(const struct gram_index *gi, size_t b, uint32_t h)
+{
+    const uint8_t *entry = (const uint8_t*)gi->map + gi->offsets[b];
+    size_t len = (size_t)(gi->offsets[b + 1] - gi->offsets[b]);
+    if (len == GI_MAP_BYTES)
+    {
+        return (entry[h >> 3] >> (h & 7)) & 1;
+    }
+    // entries start at even offsets, so the list is aligned
+    const uint16_t *list = (const uint16_t*)entry;
+    size_t lo = 0;
+    size_t hi = len / 2;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (list[mid] < h)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return (lo < len / 2) && (list[lo] == h);
+}
+
+// The hashes of the gram at pat[0..2], in every case it could appear in
+// with -i.  Returns how many.
+static size_t gi_gram_hashes(const uint8_t *pat, int fold, uint32_t h[8])
+{
+    size_t n = 1;
+    uint32_t grams[8] = { 0 };
+    for (int i=0; i<3; i++)
+    {
+        size_t have = n;
+        for (size_t j=0; j<have; j++)
+        {
+            if (fold && fold_is_alpha(pat[i]))
+            {
+                grams[n++] = (grams[j] << 8) | (pat[i] & 0xdf);
+            }
+            grams[j] = (grams[j] << 8) | pat[i];
+        }
+    }
+    for (size_t j=0; j<n; j++)
+    {
+        h[j] = gi_hash(grams[j]);
+    }
+    return n;
+}
+
+uint8_t *gi_candidates(const struct gram_index *gi, const struct matcher *m)
+{
+    size_t n = gi->nblocks;
+    if ((n == 0) || (m->npats > GI_MAX_PATTERNS))
+    {
+        return NULL;
+    }
+    uint8_t *cand = (uint8_t*)calloc(n, 1);
+    uint8_t *present = (uint8_t*)malloc(n + 1);
+    uint8_t *could = (uint8_t*)malloc(n);
+    if (!cand || !present || !could)
+    {
+        goto none;
+    }
+
+    for (size_t i=0; i<m->npats; i++)
+    {
+        const struct pattern *p = &m->pats[i];
+        if ((p->len < 3) || (p->len > GI_BLOCK))
+        {
+            goto none;
+        }
+        memset(could, 1, n);
+        size_t step = (p->len - 2 + GI_GRAMS - 1) / GI_GRAMS;
+        size_t grams = 0;
+        for (size_t k=0; k + 3 <= p->len; k += step)
+        {
+            if (p->mask &&
+                ((p->mask[k] != 0xff) || (p->mask[k + 1] != 0xff) ||
+                 (p->mask[k + 2] != 0xff)))
+            {
+                continue;
+            }
+            uint32_t h[8];
+            size_t nh = gi_gram_hashes(p->bytes + k, m->fold, h);
+            for (size_t b=0; b<n; b++)
+            {
+                present[b] = 0;
+                for (size_t j=0; (j < nh) && !present[b]; j++)
+                {
+                    present[b] = (uint8_t)gi_has(gi, b, h[j]);
+                }
+            }
+            present[n] = 0;
+            for (size_t b=0; b<n; b++)
+            {
+                could[b] &= present[b] | present[b + 1];
+            }
+            grams++;
+        }
+        if (grams == 0)
+        {
+            goto none;
+        }
+        for (size_t b=0; b<n; b++)
+        {
+            cand[b] |= could[b];
+        }
+    }
+
+    free(present);
+    free(could);
+    if (memchr(cand, 0, n))
+    {
+        return cand;
+    }
+    // nothing to skip
+    free(cand);
+    return NULL;
+
+none:
+    free(cand);
+    free(present);
+    free(could);
+    return NULL;
+}
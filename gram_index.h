@@ -0,0 +1,63 @@
+#ifndef GRAM_INDEX_H
+#define GRAM_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/stat.h>
+
+#include "matcher.h"
+#include "pool.h"
+
+// A sidecar index of a file that doesn't change, written by --index next
+// to it as FILE.mgi and used by every later search of FILE to skip the
+// blocks that can't hold a match.  For each GI_BLOCK bytes it records
+// which 3-byte grams start there, hashed into 1 << GI_BITS buckets:
+// a bitmap, or the sorted bucket numbers when there are few, as in runs
+// of one value.  A match starting in block i has all its grams in blocks
+// i and i+1.
+//
+// The index names the size and modification time of the file it was
+// built from, and is ignored once those change.  Like a pattern db, it
+// is native byte order.
+#define GI_MAGIC "MGREPGI"
+#define GI_VERSION 1
+#define GI_SUFFIX ".mgi"
+#define GI_BLOCK ((size_t)64 << 10)
+#define GI_BITS 16
+
+// Searches don't look for an index of a file smaller than this.
+#define GI_MIN_SIZE ((size_t)1 << 20)
+
+struct gram_index
+{
+    void *map;
+    size_t size;
+    size_t nblocks;
+    const uint64_t *offsets;    // block i is [offsets[i], offsets[i + 1])
+};
+
+// file_name with GI_SUFFIX, in memory from malloc(), or NULL.
+char *gi_path(const char *file_name);
+
+// Index file_name into index_name, jobs blocks of blocks at a time on
+// pool, if it isn't NULL.  The index is written to index_name.tmp and
+// renamed into place.  Returns 0, or -1 with errno set.
+int gi_build(const char *file_name, const char *index_name,
+             struct pool *pool, int jobs);
+
+// Map index_name, if it was built from a file that still looks like st.
+// Returns 0, or -1 with errno set; EINVAL means it is not an index this
+// build can use, or is out of date.
+int gi_open(struct gram_index *gi, const char *index_name,
+            const struct stat *st);
+
+void gi_close(struct gram_index *gi);
+
+// One byte per block, non-zero where a match of m could start, in memory
+// from malloc().  NULL if the index can't rule any block out for m
+// (patterns under 3 bytes, or masked throughout), or on allocation
+// failure.
+uint8_t *gi_candidates(const struct gram_index *gi, const struct matcher *m);
+
+#endif // GRAM_INDEX_H
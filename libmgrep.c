@@ -0,0 +1,285 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "boyer_moore.h"
+#include "libmgrep.h"
+#include "matcher.h"
+#include "pattern_db.h"
+#include "patterns.h"
+
+struct mgrep
+{
+    struct pattern_list list;   // compiled here, or
+    struct pattern_db db;       // loaded, if from_db
+    int from_db;
+    struct matcher m;
+};
+
+struct mgrep_stream
+{
+    const struct mgrep *g;
+    mgrep_match_fn fn;
+    void *arg;
+    uint64_t offset;        // bytes fed so far
+    uint64_t matches;
+    int stopped;
+
+    // The last bytes fed, from where the next match could start, and at
+    // most maxlen - 1 of them, since anything earlier would have ended by
+    // now.  Room for as much again, to join them with the next buffer.
+    uint8_t *carry;
+    size_t carry_len;
+};
+
+struct mgrep *mgrep_compile(const char *const *patterns, size_t npatterns,
+                            int flags)
+{
+    if (npatterns == 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct mgrep *g = (struct mgrep*)calloc(1, sizeof(*g));
+    if (!g)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (size_t i=0; i<npatterns; i++)
+    {
+        if (pattern_list_add(&g->list, patterns[i]) != 0)
+        {
+            pattern_list_free(&g->list);
+            free(g);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    int pflags = ((flags & MGREP_LITERAL) ? PATTERN_LITERAL : 0) |
+                 ((flags & MGREP_IGNORE_CASE) ? PATTERN_FOLD : 0) |
+                 ((flags & MGREP_WIDE) ? PATTERN_WIDE : 0);
+    const char *bad = NULL;
+    enum pattern_error err = pattern_list_compile(&g->list, pflags, &bad);
+    if ((err == PATTERN_OK) &&
+        (matcher_init(&g->m, g->list.pats, g->list.len,
+                      (flags & MGREP_IGNORE_CASE) != 0) != 0))
+    {
+        err = PATTERN_NOMEM;
+    }
+    if (err != PATTERN_OK)
+    {
+        pattern_list_free(&g->list);
+        free(g);
+        errno = (err == PATTERN_NOMEM) ? ENOMEM : EINVAL;
+        return NULL;
+    }
+    return g;
+}
+
+struct mgrep *mgrep_load(const char *db_file)
+{
+    struct mgrep *g = (struct mgrep*)calloc(1, sizeof(*g));
+    if (!g)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (db_open(&g->db, db_file) != 0)
+    {
+        int err = errno;
+        free(g);
+        errno = err;
+        return NULL;
+    }
+    g->from_db = 1;
+    if (matcher_init_ac(&g->m, g->db.pats, g->db.npats, g->db.fold,
+                        g->db.has_ac ? &g->db.ac : NULL) != 0)
+    {
+        db_close(&g->db);
+        free(g);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return g;
+}
+
+int mgrep_save(const struct mgrep *g, const char *db_file)
+{
+    return db_write(db_file, &g->m);
+}
+
+void mgrep_free(struct mgrep *g)
+{
+    if (!g)
+    {
+        return;
+    }
+    matcher_free(&g->m);
+    if (g->from_db)
+    {
+        db_close(&g->db);
+    }
+    pattern_list_free(&g->list);
+    free(g);
+}
+
+size_t mgrep_patterns(const struct mgrep *g)
+{
+    return g->m.npats;
+}
+
+const char *mgrep_pattern_text(const struct mgrep *g, size_t i)
+{
+    return (i < g->m.npats) ? g->m.pats[i].text : NULL;
+}
+
+size_t mgrep_scan(const struct mgrep *g, const void *buf, size_t len,
+                  mgrep_match_fn fn, void *arg)
+{
+    const uint8_t *data = (const uint8_t*)buf;
+    size_t last = 0;
+    size_t next;
+    size_t which = 0;
+    size_t found = 0;
+    while ((next = matcher_search(&g->m, data + last, len - last,
+                                  &which)) != NOT_FOUND)
+    {
+        found++;
+        if (fn(arg, last + next, which, g->m.pats[which].len))
+        {
+            break;
+        }
+        last += next + matcher_skip(&g->m, which);
+    }
+    return found;
+}
+
+struct mgrep_stream *mgrep_stream_open(const struct mgrep *g,
+                                       mgrep_match_fn fn, void *arg)
+{
+    struct mgrep_stream *st =
+        (struct mgrep_stream*)calloc(1, sizeof(*st));
+    size_t keep = g->m.maxlen - 1;
+    if (st)
+    {
+        st->carry = (uint8_t*)malloc(2 * keep + 1);
+    }
+    if (!st || !st->carry)
+    {
+        free(st);
+        errno = ENOMEM;
+        return NULL;
+    }
+    st->g = g;
+    st->fn = fn;
+    st->arg = arg;
+    return st;
+}
+
+// Report matches in data, which is at stream offset base, from *pos on.
+// Stops before any match starting at or after limit.  Returns non-zero
+// if the callback stopped the search.
+static int stream_matches(struct mgrep_stream *st, const uint8_t *data,
+                          size_t len, uint64_t base, size_t limit,
+                          size_t *pos)
+{
+    const struct matcher *m = &st->g->m;
+    size_t which = 0;
+    size_t next;
+    while ((next = matcher_search(m, data + *pos, len - *pos,
+                                  &which)) != NOT_FOUND)
+    {
+        size_t at = *pos + next;
+        if (at >= limit)
+        {
+            break;
+        }
+        size_t patlen = m->pats[which].len;
+        *pos = at + matcher_skip(m, which);
+        st->matches++;
+        if (st->fn(st->arg, base + at, which, patlen))
+        {
+            st->stopped = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Every match found is final: anything that ends sooner, or is longer
+// and ends at the same place, lies in what has been seen too.  So the
+// only state between calls is the bytes a match could still start in.
+int mgrep_stream_feed(struct mgrep_stream *st, const void *buf, size_t len)
+{
+    const uint8_t *data = (const uint8_t*)buf;
+    size_t keep = st->g->m.maxlen - 1;
+    size_t pos = 0;     // in data, where the search resumes
+
+    if (st->stopped)
+    {
+        return 1;
+    }
+
+    if (st->carry_len > 0)
+    {
+        // Join the carried bytes with the start of data: enough of it
+        // for every match that starts in the carried bytes to end.
+        size_t head = (len < keep) ? len : keep;
+        size_t joint_len = st->carry_len + head;
+        uint64_t base = st->offset - st->carry_len;
+        size_t jpos = 0;
+        memcpy(st->carry + st->carry_len, data, head);
+        if (head < keep)
+        {
+            // all of data fits; search it here and carry what is left
+            if (stream_matches(st, st->carry, joint_len, base, joint_len,
+                               &jpos))
+            {
+                return 1;
+            }
+            size_t from = (joint_len - jpos > keep) ? joint_len - keep : jpos;
+            st->carry_len = joint_len - from;
+            memmove(st->carry, st->carry + from, st->carry_len);
+            st->offset += len;
+            return 0;
+        }
+        if (stream_matches(st, st->carry, joint_len, base, st->carry_len,
+                           &jpos))
+        {
+            return 1;
+        }
+        pos = (jpos > st->carry_len) ? jpos - st->carry_len : 0;
+    }
+
+    if (stream_matches(st, data, len, st->offset, len, &pos))
+    {
+        return 1;
+    }
+    size_t from = (len - pos > keep) ? len - keep : pos;
+    st->carry_len = len - from;
+    memcpy(st->carry, data + from, st->carry_len);
+    st->offset += len;
+    return 0;
+}
+
+uint64_t mgrep_stream_offset(const struct mgrep_stream *st)
+{
+    return st->offset;
+}
+
+uint64_t mgrep_stream_matches(const struct mgrep_stream *st)
+{
+    return st->matches;
+}
+
+void mgrep_stream_close(struct mgrep_stream *st)
+{
+    if (st)
+    {
+        free(st->carry);
+        free(st);
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef LIBMGREP_H
+#define LIBMGREP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// In-process searching with the same patterns, engines and match rules
+// as the mgrep command: build a struct mgrep once, then scan buffers
+// with it, or feed it a stream a piece at a time.  A struct mgrep is
+// read-only once built, so any number of threads may share it; each
+// stream belongs to one thread at a time.
+
+#if defined(__GNUC__)
+#define MGREP_API __attribute__((visibility("default")))
+#else
+#define MGREP_API
+#endif
+
+// Flags for mgrep_compile.
+#define MGREP_LITERAL 1     // patterns are bytes, not HEXPATTERN (-H)
+#define MGREP_IGNORE_CASE 2 // match ASCII letters in either case (-i)
+#define MGREP_WIDE 4        // also match the UTF-16LE forms (-w)
+
+struct mgrep;
+struct mgrep_stream;
+
+// Called for each match, in order.  offset counts from the start of the
+// buffer or stream, pattern is the index of the pattern that matched
+// (UTF-16LE forms from MGREP_WIDE come after all the others), and len is
+// its length in bytes.  Return non-zero to stop the search.
+typedef int (*mgrep_match_fn)(void *arg, uint64_t offset, size_t pattern,
+                              size_t len);
+
+// Compile npatterns NUL-terminated patterns.  Returns NULL with errno
+// set: EINVAL for a pattern mgrep would refuse, ENOMEM.
+MGREP_API struct mgrep *mgrep_compile(const char *const *patterns,
+                                      size_t npatterns, int flags);
+
+// Load patterns compiled with mgrep --compile, or mgrep_save.  Returns
+// NULL with errno set.
+MGREP_API struct mgrep *mgrep_load(const char *db_file);
+
+// Save g for mgrep_load or mgrep --patterns-db.  Returns 0, or -1 with
+// errno set.
+MGREP_API int mgrep_save(const struct mgrep *g, const char *db_file);
+
+MGREP_API void mgrep_free(struct mgrep *g);
+
+// Number of patterns in g, including UTF-16LE forms, and the text of
+// one, as given.
+MGREP_API size_t mgrep_patterns(const struct mgrep *g);
+MGREP_API const char *mgrep_pattern_text(const struct mgrep *g, size_t i);
+
+// Report every match in buf, without overlaps.  Returns the number of
+// matches reported.
+MGREP_API size_t mgrep_scan(const struct mgrep *g, const void *buf,
+                            size_t len, mgrep_match_fn fn, void *arg);
+
+// Start a stream.  Buffers fed to it are searched as if they had been
+// joined; matches across them are found.  Returns NULL if out of memory.
+MGREP_API struct mgrep_stream *mgrep_stream_open(const struct mgrep *g,
+                                                 mgrep_match_fn fn,
+                                                 void *arg);
+
+// Search the next len bytes of the stream.  Matches are reported as soon
+// as they are known, which may be during a later call.  Returns 0, or 1
+// if fn stopped the search (further data is ignored).
+MGREP_API int mgrep_stream_feed(struct mgrep_stream *st, const void *buf,
+                                size_t len);
+
+// Bytes fed to the stream so far, and matches reported.
+MGREP_API uint64_t mgrep_stream_offset(const struct mgrep_stream *st);
+MGREP_API uint64_t mgrep_stream_matches(const struct mgrep_stream *st);
+
+// End the stream and free it.
+MGREP_API void mgrep_stream_close(struct mgrep_stream *st);
+
+#endif // LIBMGREP_H
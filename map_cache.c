@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "map_cache.h"
+
+void mc_init(struct map_cache *c, size_t budget)
+{
+    memset(c, 0, sizeof(*c));
+    pthread_mutex_init(&c->lock, NULL);
+    c->budget = budget;
+}
+
+static void unmap(struct map_entry *e)
+{
+    munmap((void*)e->data, e->len);
+    free(e);
+}
+
+void mc_free(struct map_cache *c)
+{
+    struct map_entry *e = c->entries;
+    while (e)
+    {
+        struct map_entry *next = e->next;
+        unmap(e);
+        e = next;
+    }
+    c->entries = NULL;
+    pthread_mutex_destroy(&c->lock);
+}
+
+static int same_file(const struct map_entry *e, const struct stat *st)
+{
+    return (e->dev == st->st_dev) && (e->ino == st->st_ino);
+}
+
+static int unchanged(const struct map_entry *e, const struct stat *st)
+{
+    return (e->len == (size_t)st->st_size) &&
+           (e->mtime.tv_sec == st->st_mtim.tv_sec) &&
+           (e->mtime.tv_nsec == st->st_mtim.tv_nsec);
+}
+
+// Take *link's entry out of the list, unmapping it unless it is held.
+static void drop(struct map_cache *c, struct map_entry **link)
+{
+    struct map_entry *e = *link;
+    *link = e->next;
+    c->mapped -= e->len;
+    if (e->refs > 0)
+    {
+        e->stale = 1;
+    }
+    else
+    {
+        unmap(e);
+    }
+}
+
+// Unmap the least recently used entries that nobody holds until the
+// rest fit the budget, or only held ones are left.
+static void evict(struct map_cache *c)
+{
+    while (c->mapped > c->budget)
+    {
+        struct map_entry **lru = NULL;
+        for (struct map_entry **link = &c->entries; *link;
+             link = &(*link)->next)
+        {
+            if (((*link)->refs == 0) &&
+                (!lru || ((*link)->used < (*lru)->used)))
+            {
+                lru = link;
+            }
+        }
+        if (!lru)
+        {
+            break;
+        }
+        drop(c, lru);
+    }
+}
+
+const struct map_entry *mc_lookup(struct map_cache *c, const struct stat *st)
+{
+    struct map_entry *found = NULL;
+    pthread_mutex_lock(&c->lock);
+    for (struct map_entry **link = &c->entries; *link; link = &(*link)->next)
+    {
+        if (same_file(*link, st))
+        {
+            if (unchanged(*link, st))
+            {
+                found = *link;
+                found->refs++;
+                found->used = ++c->clock;
+            }
+            else
+            {
+                drop(c, link);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return found;
+}
+
+const struct map_entry *mc_insert(struct map_cache *c, const struct stat *st,
+                                  const uint8_t *data, size_t len)
+{
+    struct map_entry *e = (struct map_entry*)calloc(1, sizeof(*e));
+    if (!e)
+    {
+        return NULL;
+    }
+    e->data = data;
+    e->len = len;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime = st->st_mtim;
+    e->refs = 1;
+
+    pthread_mutex_lock(&c->lock);
+    for (struct map_entry **link = &c->entries; *link; link = &(*link)->next)
+    {
+        if (same_file(*link, st))
+        {
+            if (unchanged(*link, st))
+            {
+                // mapped by another search while we mapped it
+                struct map_entry *theirs = *link;
+                theirs->refs++;
+                theirs->used = ++c->clock;
+                pthread_mutex_unlock(&c->lock);
+                unmap(e);
+                return theirs;
+            }
+            drop(c, link);
+            break;
+        }
+    }
+    e->used = ++c->clock;
+    e->next = c->entries;
+    c->entries = e;
+    c->mapped += len;
+
+    evict(c);
+    pthread_mutex_unlock(&c->lock);
+    return e;
+}
+
+void mc_release(struct map_cache *c, const struct map_entry *entry)
+{
+    struct map_entry *e = (struct map_entry*)entry;
+    pthread_mutex_lock(&c->lock);
+    int gone = (--e->refs == 0) && e->stale;
+    if (!gone)
+    {
+        // it may have been what kept the cache over budget
+        evict(c);
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (gone)
+    {
+        unmap(e);
+    }
+}
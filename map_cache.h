@@ -0,0 +1,58 @@
+#ifndef MAP_CACHE_H
+#define MAP_CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/stat.h>
+
+// Whole-file mappings kept between searches, for --serve.  A file stays
+// mapped, its pages faulted in, for as long as it looks the same (inode,
+// size and modification time); once the mappings add up to more than
+// the budget, the least recently used ones that no search is using are
+// unmapped.
+
+struct map_entry
+{
+    const uint8_t *data;
+    size_t len;
+
+    // the rest belongs to the cache
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    size_t refs;
+    uint64_t used;              // clock of the last lookup
+    int stale;                  // out of the list; unmap at the last release
+    struct map_entry *next;
+};
+
+struct map_cache
+{
+    pthread_mutex_t lock;
+    struct map_entry *entries;
+    size_t mapped;              // bytes, in the list
+    size_t budget;
+    uint64_t clock;
+};
+
+void mc_init(struct map_cache *c, size_t budget);
+
+// Unmaps everything; nothing may still be held.
+void mc_free(struct map_cache *c);
+
+// The mapping of the file st describes, held until mc_release(), or
+// NULL if it isn't mapped (or has changed since).
+const struct map_entry *mc_lookup(struct map_cache *c, const struct stat *st);
+
+// Hand data, a mapping of all len bytes of the file st describes, to the
+// cache, and hold it.  If another search got there first, data is
+// unmapped and theirs is returned.  NULL if out of memory, in which case
+// data is still the caller's.
+const struct map_entry *mc_insert(struct map_cache *c, const struct stat *st,
+                                  const uint8_t *data, size_t len);
+
+void mc_release(struct map_cache *c, const struct map_entry *e);
+
+#endif // MAP_CACHE_H
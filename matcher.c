@@ -0,0 +1,321 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "boyer_moore.h"
+#include "matcher.h"
+#include "rare_byte.h"
+#include "two_way.h"
+
+static int init_single(struct matcher *m)
+{
+    const struct pattern *p = &m->pats[0];
+    m->bm = bm_create(p->bytes, p->len, m->fold);
+    if (!m->bm)
+    {
+        return -1;
+    }
+
+    m->engine = "boyer-moore";
+    if (p->len <= SIMD_MAX_PATLEN)
+    {
+        const char *name = NULL;
+        simd_search_fn simd = simd_search_select(&name, m->fold);
+        if (simd)
+        {
+            // compiled for this length, if it is a common one
+            simd_search_fn fixed = m->fold ? NULL
+                                           : simd_search_fixed(name, p->len);
+            m->simd = fixed ? fixed : simd;
+            m->simd_counted = simd_search_counted(name);
+            m->engine = name;
+            return 0;
+        }
+    }
+    if (m->fold)
+    {
+        return 0;
+    }
+
+    // Boyer-Moore rescans most of a periodic pattern after every shift;
+    // Two-Way remembers what already matched, so it stays linear.
+    m->tw = (struct two_way*)malloc(sizeof(*m->tw));
+    if (!m->tw)
+    {
+        return -1;
+    }
+    tw_init(m->tw, p->bytes, p->len);
+    if (tw_periodic(m->tw, p->len))
+    {
+        m->engine = "two-way";
+    }
+    else
+    {
+        free(m->tw);
+        m->tw = NULL;
+    }
+    return 0;
+}
+
+static int init_masked(struct matcher *m)
+{
+    const struct pattern *p = &m->pats[0];
+    m->sa = sa_create(p->bytes, p->mask, p->len);
+    if (!m->sa)
+    {
+        return -1;
+    }
+    m->engine = "shift-and";
+    if (m->sa->anchorlen)
+    {
+        // the anchor is exact, so any exact engine can find it
+        const char *name = NULL;
+        if (m->sa->anchorlen <= SIMD_MAX_PATLEN)
+        {
+            m->sa->simd = simd_search_select(&name, 0);
+        }
+        m->engine = m->sa->simd ? "anchored-simd" : "anchored-boyer-moore";
+    }
+    return 0;
+}
+
+static int init_multi(struct matcher *m)
+{
+    const uint8_t **bytes =
+        (const uint8_t**)malloc(m->npats * sizeof(uint8_t*));
+    m->lens = (size_t*)malloc(m->npats * sizeof(size_t));
+    if (!bytes || !m->lens)
+    {
+        free(bytes);
+        return -1;
+    }
+    for (size_t i=0; i<m->npats; i++)
+    {
+        bytes[i] = m->pats[i].bytes;
+        m->lens[i] = m->pats[i].len;
+    }
+    m->ac = ac_create(bytes, m->lens, m->npats, m->fold);
+    free(bytes);
+    m->engine = "aho-corasick";
+    return m->ac ? 0 : -1;
+}
+
+int matcher_init(struct matcher *m, const struct pattern *pats, size_t npats,
+                 int fold)
+{
+    return matcher_init_ac(m, pats, npats, fold, NULL);
+}
+
+int matcher_init_ac(struct matcher *m, const struct pattern *pats,
+                    size_t npats, int fold, struct ac *ac)
+{
+    memset(m, 0, sizeof(*m));
+    m->fold = fold;
+    m->pats = pats;
+    m->npats = npats;
+    m->minlen = pats[0].len;
+    for (size_t i=0; i<npats; i++)
+    {
+        if (pats[i].len < m->minlen)
+        {
+            m->minlen = pats[i].len;
+        }
+        if (pats[i].len > m->maxlen)
+        {
+            m->maxlen = pats[i].len;
+        }
+    }
+
+    int ret;
+    if ((npats > 1) && ac)
+    {
+        m->ac = ac;
+        m->ac_borrowed = 1;
+        m->engine = "aho-corasick";
+        ret = 0;
+    }
+    else if (npats > 1)
+    {
+        ret = init_multi(m);
+    }
+    else if (pats[0].mask)
+    {
+        ret = init_masked(m);
+    }
+    else
+    {
+        ret = init_single(m);
+    }
+    if (ret != 0)
+    {
+        matcher_free(m);
+    }
+    return ret;
+}
+
+// Smallest shift at which p could match again over itself: its period,
+// from the longest border (as in Knuth-Morris-Pratt).  A masked byte
+// agrees with another if they are equal in the bits both masks keep.
+static int pattern_period(const struct pattern *p, size_t *period)
+{
+    if (p->mask)
+    {
+        size_t q;
+        for (q=1; q<p->len; q++)
+        {
+            size_t i;
+            for (i=0; i+q<p->len; i++)
+            {
+                if ((p->bytes[i] ^ p->bytes[i + q]) &
+                    p->mask[i] & p->mask[i + q])
+                {
+                    break;
+                }
+            }
+            if (i + q == p->len)
+            {
+                break;
+            }
+        }
+        *period = q;
+        return 0;
+    }
+
+    // border[i] is the longest proper border of bytes[0..i]
+    size_t *border = (size_t*)malloc(p->len * sizeof(size_t));
+    if (!border)
+    {
+        return -1;
+    }
+    border[0] = 0;
+    size_t k = 0;
+    for (size_t i=1; i<p->len; i++)
+    {
+        while ((k > 0) && (p->bytes[i] != p->bytes[k]))
+        {
+            k = border[k - 1];
+        }
+        if (p->bytes[i] == p->bytes[k])
+        {
+            k++;
+        }
+        border[i] = k;
+    }
+    *period = p->len - border[p->len - 1];
+    free(border);
+    return 0;
+}
+
+int matcher_set_overlap(struct matcher *m)
+{
+    if (m->npats > 1)
+    {
+        return -1;
+    }
+    return pattern_period(&m->pats[0], &m->period);
+}
+
+void matcher_free(struct matcher *m)
+{
+    if (!m->ac_borrowed)
+    {
+        ac_free(m->ac);
+    }
+    free(m->lens);
+    sa_free(m->sa);
+    free(m->tw);
+    bm_free(m->bm);
+    m->ac = NULL;
+    m->lens = NULL;
+    m->sa = NULL;
+    m->tw = NULL;
+    m->bm = NULL;
+}
+
+int matcher_anchor_rare(struct matcher *m, const uint64_t freq[256])
+{
+    if ((m->npats != 1) || m->pats[0].mask || m->fold)
+    {
+        return 0;
+    }
+    const uint8_t *pat = m->pats[0].bytes;
+    size_t patlen = m->pats[0].len;
+    uint64_t total = 1;
+    for (int c=0; c<256; c++)
+    {
+        total += freq[c];
+    }
+    size_t anchor = rb_pick(pat, patlen, freq);
+    double rare = (double)freq[pat[anchor]] / total;
+
+    // What the current engine looks at first: both ends for the vector
+    // filter, the last byte for Boyer-Moore.  Every memchr() hit costs a
+    // call and a compare, so the anchor has to be rare, and clearly
+    // rarer than that.
+    double last = (double)freq[pat[patlen - 1]] / total;
+    double first = (double)freq[pat[0]] / total;
+    double now = m->simd ? first * last : last;
+    if ((rare > 1.0 / 512) || (rare * 4 > now))
+    {
+        return 0;
+    }
+    m->rare = 1;
+    m->anchor = anchor;
+    m->engine = "rare-byte";
+    return 1;
+}
+
+size_t matcher_search(const struct matcher *m,
+                      const uint8_t *string, size_t stringlen,
+                      size_t *which)
+{
+    if (m->ac)
+    {
+        return ac_search(m->ac, string, stringlen, which);
+    }
+    *which = 0;
+    if (m->sa)
+    {
+        return sa_search(m->sa, string, stringlen);
+    }
+    if (m->rare)
+    {
+        return rb_search(string, stringlen, m->pats[0].bytes, m->pats[0].len,
+                         m->anchor, NULL);
+    }
+    if (m->simd)
+    {
+        return m->simd(string, stringlen, m->pats[0].bytes, m->pats[0].len);
+    }
+    if (m->tw)
+    {
+        return tw_search(m->tw, string, stringlen,
+                         m->pats[0].bytes, m->pats[0].len);
+    }
+    return bm_find(m->bm, string, stringlen);
+}
+
+size_t matcher_search_stats(const struct matcher *m,
+                            const uint8_t *string, size_t stringlen,
+                            size_t *which, struct engine_stats *st)
+{
+    if (m->rare)
+    {
+        *which = 0;
+        st->counted |= ENGINE_VERIFIES;
+        return rb_search(string, stringlen, m->pats[0].bytes, m->pats[0].len,
+                         m->anchor, &st->verifies);
+    }
+    if (m->ac || m->sa || m->tw)
+    {
+        return matcher_search(m, string, stringlen, which);
+    }
+    *which = 0;
+    if (m->simd)
+    {
+        st->counted |= ENGINE_VERIFIES;
+        return m->simd_counted(string, stringlen, m->pats[0].bytes,
+                               m->pats[0].len, m->fold, &st->verifies);
+    }
+    return bm_find_stats(m->bm, string, stringlen, st);
+}
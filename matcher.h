@@ -0,0 +1,105 @@
+#ifndef MATCHER_H
+#define MATCHER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aho_corasick.h"
+#include "boyer_moore.h"
+#include "shift_and.h"
+#include "simd_search.h"
+#include "stats.h"
+#include "two_way.h"
+
+// Patterns up to this long use the vector filter when the CPU has one;
+// longer ones skip far enough that Boyer-Moore wins.
+#define SIMD_MAX_PATLEN 16
+
+struct pattern
+{
+    uint8_t *bytes;
+    uint8_t *mask;          // bits of each byte that must match, or NULL
+                            // if they all must
+    size_t len;
+    const char *text;       // as given by the user, for output
+};
+
+// A compiled set of patterns, and the search engine chosen for them.
+struct matcher
+{
+    const struct pattern *pats; // not owned
+    size_t npats;
+    size_t minlen;
+    size_t maxlen;
+    int fold;               // ignore ASCII case
+
+    // one pattern
+    struct bm *bm;
+    simd_search_fn simd;    // NULL to use Boyer-Moore
+    simd_count_fn simd_counted; // simd, counting for --stats
+    struct two_way *tw;     // instead of Boyer-Moore, for periodic patterns
+    int rare;               // instead of all of those, search for
+    size_t anchor;          // pats[0].bytes[anchor] with memchr
+
+    // one pattern with wildcards or masks
+    struct shift_and *sa;
+
+    // several patterns
+    struct ac *ac;
+    int ac_borrowed;        // ac belongs to the caller
+    size_t *lens;
+
+    size_t period;          // with overlap, how far past a match to
+                            // search next; 0 to skip the whole match
+
+    const char *engine;     // name of the engine in use
+};
+
+// Build the tables for pats and pick an engine.  Returns 0 on success.
+// Only a lone pattern may have a mask.  With fold, matches ignore ASCII
+// case, and patterns without a mask must be lower case; a mask does its
+// own folding (0xdf on letters).
+int matcher_init(struct matcher *m, const struct pattern *pats, size_t npats,
+                 int fold);
+
+// matcher_init, but with several patterns, search them with ac, which
+// must have been built for them and stays the caller's.
+int matcher_init_ac(struct matcher *m, const struct pattern *pats,
+                    size_t npats, int fold, struct ac *ac);
+
+void matcher_free(struct matcher *m);
+
+// Find overlapping matches too: after a match, search again from the
+// next offset the pattern could match at, rather than from its end.
+// Only for a single pattern: with several, one search can't tell which
+// hits around the last one it already reported.  Returns 0 on success,
+// or -1 with several patterns or out of memory.
+int matcher_set_overlap(struct matcher *m);
+
+// Switch a lone pattern without a mask or case folding to searching for
+// its rarest byte by freq (see rare_byte.h), if that byte is rare enough
+// to beat what the current engine keys on.  Meant for a copy of a
+// matcher, made for one file from a sample of it.  Returns non-zero if
+// it switched.
+int matcher_anchor_rare(struct matcher *m, const uint64_t freq[256]);
+
+// How far past the start of a match of pattern which to search next.
+static inline size_t matcher_skip(const struct matcher *m, size_t which)
+{
+    return m->period ? m->period : m->pats[which].len;
+}
+
+// Offset of the first match in string, or NOT_FOUND.  Sets *which to the
+// index of the pattern that matched.  With several patterns, the match
+// that ends first wins, and of those the longest.
+size_t matcher_search(const struct matcher *m,
+                      const uint8_t *string, size_t stringlen,
+                      size_t *which);
+
+// matcher_search, adding what the engine did to *st.  Only Boyer-Moore,
+// the vector filters and rare-byte count anything.
+size_t matcher_search_stats(const struct matcher *m,
+                            const uint8_t *string, size_t stringlen,
+                            size_t *which, struct engine_stats *st);
+
+#endif // MATCHER_H
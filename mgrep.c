@@ -9,8 +9,12 @@
  * Copyright (c) 2011 Joe Hildebrand.  All Rights Reserved.
  */
 
-#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -18,142 +22,2852 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/inotify.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "boyer_moore.h"
+#include "checkpoint.h"
+#include "decompress.h"
+#include "gram_index.h"
+#include "map_cache.h"
+#include "matcher.h"
+#include "output.h"
+#include "pattern_db.h"
+#include "patterns.h"
+#include "pool.h"
+#include "rare_byte.h"
+#include "serve.h"
+#include "stats.h"
+#include "uring.h"
+#include "walk.h"
 
 void usage()
 {
-    fprintf(stderr, "Usage: mgrep [OPTION]... HEXPATTERN FILE...\n");
+    fprintf(stderr, "Usage: mgrep [OPTION]... HEXPATTERN [FILE]...\n");
+    fprintf(stderr, "       mgrep [OPTION]... -e HEXPATTERN... [FILE]...\n");
+    fprintf(stderr, "       mgrep [OPTION]... -f PATTERNFILE [FILE]...\n");
+    fprintf(stderr, "       mgrep [OPTION]... --patterns-db DB [FILE]...\n");
+    fprintf(stderr, "       mgrep [-j NUM] --index FILE...\n");
+    fprintf(stderr, "       mgrep [-j NUM] [--cache-size SIZE] --serve SOCKET\n");
+    fprintf(stderr, "       mgrep --client SOCKET [OPTION]... HEXPATTERN FILE...\n");
     fprintf(stderr, "Search for the sequence of bytes represented by HEXPATERN\n");
-    fprintf(stderr, "in one or more large binary FILEs.\n\n");
+    fprintf(stderr, "in one or more large binary FILEs.  With no FILE, or when\n");
+    fprintf(stderr, "FILE is -, read standard input.  In HEXPATTERN, ? matches\n");
+    fprintf(stderr, "any hex digit, and a /MASK suffix as long as the pattern\n");
+    fprintf(stderr, "picks the bits that must match (4d5a??00, 4d5a/fff0).\n\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, " -a NUM   Output NUM bytes after the found pattern\n");
     fprintf(stderr, " -b NUM   Output NUM bytes before the found pattern\n");
     fprintf(stderr, " -c       Highlight the found pattern in color\n");
+    fprintf(stderr, " -e PAT   Search for PAT; may be given more than once\n");
+    fprintf(stderr, " -f FILE  Search for each pattern in FILE, one per line.\n");
+    fprintf(stderr, "          Blank lines and lines starting with # are ignored\n");
     fprintf(stderr, " -H       Do not convert HEXPATTERN from hex\n");
+    fprintf(stderr, " --overlap\n");
+    fprintf(stderr, "          Also report matches that overlap earlier ones.  Only\n");
+    fprintf(stderr, "          for a single pattern\n");
+    fprintf(stderr, " --rare-byte\n");
+    fprintf(stderr, "          For a single pattern, look first for the byte of it\n");
+    fprintf(stderr, "          that is rarest in a sample of each file\n");
+    fprintf(stderr, " --compile DB\n");
+    fprintf(stderr, "          Save the patterns, compiled, to DB and exit\n");
+    fprintf(stderr, " --patterns-db DB\n");
+    fprintf(stderr, "          Search for the patterns compiled into DB\n");
+    fprintf(stderr, " --index  Write an index of each FILE to FILE.mgi, instead\n");
+    fprintf(stderr, "          of searching.  Later searches of FILE use it to\n");
+    fprintf(stderr, "          skip the parts that can't match, until FILE changes\n");
+    fprintf(stderr, " --no-index\n");
+    fprintf(stderr, "          Search all of each FILE, even with a FILE.mgi\n");
+    fprintf(stderr, " -i, --ignore-case\n");
+    fprintf(stderr, "          Match ASCII letters in either case\n");
+    fprintf(stderr, " -w, --wide\n");
+    fprintf(stderr, "          Also search for each pattern as UTF-16LE, in the\n");
+    fprintf(stderr, "          same pass\n");
+    fprintf(stderr, " -z, --decompress\n");
+    fprintf(stderr, "          Search gzip, zstd and lz4 FILEs as what they\n");
+    fprintf(stderr, "          decompress to; offsets are in the decompressed data\n");
+    fprintf(stderr, " --direct Read files with O_DIRECT instead of mapping them\n");
+    fprintf(stderr, " --window SIZE\n");
+    fprintf(stderr, "          Map files larger than SIZE (e.g. 1G) one SIZE window\n");
+    fprintf(stderr, "          at a time, reading ahead and unmapping behind\n");
+    fprintf(stderr, " --noreuse\n");
+    fprintf(stderr, "          Ask the kernel not to keep searched pages cached\n");
+    fprintf(stderr, " --populate\n");
+    fprintf(stderr, "          Fault each mapping in whole when it is made\n");
+    fprintf(stderr, " --hugepages\n");
+    fprintf(stderr, "          Ask for transparent huge pages for mappings, where\n");
+    fprintf(stderr, "          the filesystem has them\n");
+    fprintf(stderr, " --prefetch SIZE\n");
+    fprintf(stderr, "          Fault mapped files in SIZE bytes ahead of the search\n");
+    fprintf(stderr, " --uring  Open, stat and read many small files in batches\n");
+    fprintf(stderr, "          with io_uring (Linux); larger files are mapped\n");
+    fprintf(stderr, " -l, --files-with-matches\n");
+    fprintf(stderr, "          Only print the names of files that match, stopping\n");
+    fprintf(stderr, "          each file's search at its first match\n");
+    fprintf(stderr, " -m, --max-count NUM\n");
+    fprintf(stderr, "          Stop searching each file after NUM matches\n");
+    fprintf(stderr, " --max-total NUM\n");
+    fprintf(stderr, "          Stop searching altogether after NUM matches\n");
+    fprintf(stderr, " --range START:END\n");
+    fprintf(stderr, "          Only search bytes START to END of each file (e.g.\n");
+    fprintf(stderr, "          1G:2G, or :64K); either may be left out.  -b\n");
+    fprintf(stderr, "          and -a context stops at the ends of the range\n");
+    fprintf(stderr, " --follow Search each FILE, then keep searching what is\n");
+    fprintf(stderr, "          appended to it, until interrupted\n");
+    fprintf(stderr, " --checkpoint STATE\n");
+    fprintf(stderr, "          Search each FILE from where the last search with\n");
+    fprintf(stderr, "          this STATE file stopped, and record where this one\n");
+    fprintf(stderr, "          stops.  A FILE that was replaced or truncated\n");
+    fprintf(stderr, "          since is searched from the start\n");
+    fprintf(stderr, " -n, --count\n");
+    fprintf(stderr, "          Only print the number of matches in each file\n");
+    fprintf(stderr, " -o, --offsets\n");
+    fprintf(stderr, "          Only print the offset of each match, one per line\n");
+    fprintf(stderr, " --format FORMAT\n");
+    fprintf(stderr, "          Print each match and its context as dump (the\n");
+    fprintf(stderr, "          default), jsonl (a JSON object per line, bytes in\n");
+    fprintf(stderr, "          hex) or bin (raw records; see output.h)\n");
+    fprintf(stderr, " -r, --recursive\n");
+    fprintf(stderr, "          Search the files under each FILE that is a directory,\n");
+    fprintf(stderr, "          without following symbolic links.  With -j, the\n");
+    fprintf(stderr, "          directories are listed in parallel too\n");
+    fprintf(stderr, " --include GLOB, --exclude GLOB\n");
+    fprintf(stderr, "          With -r, only search files whose names match an\n");
+    fprintf(stderr, "          --include GLOB, and skip those matching --exclude\n");
+    fprintf(stderr, " --exclude-dir GLOB\n");
+    fprintf(stderr, "          With -r, skip directories whose names match GLOB\n");
+    fprintf(stderr, " --min-size SIZE, --max-size SIZE\n");
+    fprintf(stderr, "          With -r, skip files smaller or larger than SIZE\n");
+    fprintf(stderr, " --stats  Print to stderr, per file and in total, bytes\n");
+    fprintf(stderr, "          searched and how fast, what the engine checked and\n");
+    fprintf(stderr, "          skipped, page faults, and time searching and printing;\n");
+    fprintf(stderr, "          with -j, also bytes of large files scanned per NUMA node\n");
+    fprintf(stderr, " --serve SOCKET\n");
+    fprintf(stderr, "          Answer searches from --client on the Unix socket\n");
+    fprintf(stderr, "          SOCKET, keeping files mapped and patterns compiled\n");
+    fprintf(stderr, "          between them, several at a time; -j NUM searches\n");
+    fprintf(stderr, "          their big files on NUM threads\n");
+    fprintf(stderr, " --cache-size SIZE\n");
+    fprintf(stderr, "          With --serve, unmap the least recently searched\n");
+    fprintf(stderr, "          files beyond SIZE (default 16G)\n");
+    fprintf(stderr, " --client SOCKET\n");
+    fprintf(stderr, "          As the first option: have the --serve at SOCKET run\n");
+    fprintf(stderr, "          the search.  -a, -b, -c, -e, -H, -i, -l, -m, -n, -o,\n");
+    fprintf(stderr, "          -w, -z, --format, --max-total, --no-index, --overlap,\n");
+    fprintf(stderr, "          --patterns-db, --range and --rare-byte are passed on\n");
+    fprintf(stderr, " -j NUM   Search on NUM threads: several files at a time, or\n");
+    fprintf(stderr, "          large files in pieces.  Output for each file stays\n");
+    fprintf(stderr, "          together, in completion order\n");
 
     exit(64);
 }
 
 
-uint8_t hchar(char c)
+// Parse a byte count with an optional K, M, G or T suffix (powers of
+// 1024).  Returns 0 on error.
+static size_t parse_size(const char *str)
 {
-    if ((c >= '0') && (c <= '9'))
+    char *end = NULL;
+    unsigned long long n = strtoull(str, &end, 10);
+    int shift = 0;
+    switch (*end)
     {
-        return c - '0';
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+        case 't': case 'T': shift = 40; end++; break;
     }
-    if ((c >= 'a') && (c <= 'f'))
+    if ((end == str) || (*end != '\0') ||
+        (n > ((unsigned long long)SIZE_MAX >> shift)))
     {
-        return c - 'a' + 10;
+        return 0;
+    }
+    return (size_t)(n << shift);
+}
+
+// Parse a match count for -m and --max-total.  Returns 0 on error.
+static int parse_count(const char *str, size_t *n)
+{
+    char *end = NULL;
+    unsigned long long v = strtoull(str, &end, 10);
+    if ((end == str) || (*end != '\0') || (v == 0) ||
+        (v > (unsigned long long)SIZE_MAX) || (str[0] == '-'))
+    {
+        return 0;
+    }
+    *n = (size_t)v;
+    return 1;
+}
+
+// Parse --range START:END, either of which may be left out, as byte
+// counts.  Returns 0 on error.
+static int parse_range(const char *str, size_t *start, size_t *end)
+{
+    const char *colon = strchr(str, ':');
+    if (!colon)
+    {
+        return 0;
+    }
+    char first[64];
+    size_t len = (size_t)(colon - str);
+    if (len >= sizeof(first))
+    {
+        return 0;
+    }
+    memcpy(first, str, len);
+    first[len] = '\0';
+
+    *start = 0;
+    *end = SIZE_MAX;
+    if ((first[0] != '\0') && (strcmp(first, "0") != 0) &&
+        ((*start = parse_size(first)) == 0))
+    {
+        return 0;
+    }
+    if ((colon[1] != '\0') && ((*end = parse_size(colon + 1)) == 0))
+    {
+        return 0;
+    }
+    return *start < *end;
+}
+
+enum output_mode
+{
+    OUTPUT_DUMP,        // hex dump with context
+    OUTPUT_COUNT,       // [name:]count, once per file
+    OUTPUT_OFFSETS,     // [name:]offset[:pattern], once per match
+    OUTPUT_FILES        // name, once per file with a match
+};
+
+// Everything a worker needs to search a file; shared read-only.
+struct search
+{
+    const struct matcher *m;
+    size_t before;
+    size_t after;
+    int color;
+    int direct;         // stream every file with O_DIRECT reads
+    size_t window;      // map files this many bytes at a time, or 0
+    int noreuse;        // tell the kernel not to keep our pages cached
+    int populate;       // fault mappings in when they are made
+    int hugepages;      // ask for transparent huge pages
+    size_t prefetch;    // fault this much of a mapping in ahead of the
+                        // search, or 0
+    int rare_byte;      // anchor on each file's rarest pattern byte
+    int decompress;     // search compressed files decompressed
+    int use_index;      // skip blocks by each file's FILE.mgi, if current
+    const uint8_t *blocks;  // from that: where a match could start, by
+    size_t nblocks;         // GI_BLOCK, or NULL to search everything
+    enum output_mode mode;
+    enum output_format format;  // of each match, for OUTPUT_DUMP
+    int show_names;     // prefix OUTPUT_COUNT and OUTPUT_OFFSETS lines
+    size_t stop_after;  // stop each file after this many matches, or 0
+    size_t max_total;   // stop everything after this many matches, or 0
+    size_t *total;      // matches so far, for max_total; atomic
+    size_t range_start; // only search these bytes of each file
+    size_t range_end;
+    struct pool *pool;  // NULL to search each file on the calling thread
+    int jobs;
+    struct stats_total *stats;  // --stats, or NULL
+    struct map_cache *maps;     // --serve: mappings kept between searches,
+                                // or NULL to unmap each file when done
+    const char *dir;            // --serve: the client's directory, which
+                                // relative FILEs are in, or NULL
+};
+
+// --stats over all files.
+struct stats_total
+{
+    pthread_mutex_t lock;
+    struct file_stats sum;
+    struct node_stats *nodes;   // one per pool node, or NULL
+};
+
+// Where this thread's errors go: stderr, or a --serve client's.
+static pthread_key_t report_key;
+static pthread_once_t report_once = PTHREAD_ONCE_INIT;
+
+static void report_key_init(void)
+{
+    pthread_key_create(&report_key, NULL);
+}
+
+static FILE *report_stream(void)
+{
+    pthread_once(&report_once, report_key_init);
+    FILE *f = (FILE*)pthread_getspecific(report_key);
+    return f ? f : stderr;
+}
+
+// Print "<what> error <file_name>: <strerror>" without interleaving
+// with other threads' output.
+static void report_error(const char *what, const char *file_name)
+{
+    int err = errno;
+    // one call, so it is one write even when stderr shares a pipe with
+    // the workers' stdout
+    fprintf(report_stream(), "%s error %s: %s\n", what, file_name,
+            strerror(err));
+}
+
+// Print one match, preceded by the file's header if it is the first.
+// With several patterns, say which one matched.
+static void emit_match(const struct search *s, const char *file_name,
+                       struct outbuf *out, const uint8_t *data,
+                       size_t data_offset, size_t data_len,
+                       size_t offset, size_t which, size_t *found,
+                       struct file_stats *stats)
+{
+    const struct pattern *p = &s->m->pats[which];
+    if (s->max_total &&
+        (__atomic_fetch_add(s->total, 1, __ATOMIC_RELAXED) >= s->max_total))
+    {
+        return;     // some other file printed the last one
+    }
+    uint64_t start = stats ? stats_now() : 0;
+    switch (s->mode)
+    {
+        case OUTPUT_DUMP:
+            if (s->format == FORMAT_JSONL)
+            {
+                print_match_json(out, file_name, which + 1, data,
+                                 data_offset, data_len, offset, p->len,
+                                 s->before, s->after);
+                break;
+            }
+            if (s->format == FORMAT_BIN)
+            {
+                print_match_bin(out, file_name, which + 1, data,
+                                data_offset, data_len, offset, p->len,
+                                s->before, s->after);
+                break;
+            }
+            if (*found == 0)
+            {
+                outbuf_printf(out, "---- %s ----\n", file_name);
+            }
+            if (s->m->npats > 1)
+            {
+                outbuf_printf(out, "pattern %zu: %s\n", which + 1, p->text);
+            }
+            print_match(out, data, data_offset, data_len, offset, p->len,
+                        s->before, s->after, s->color);
+            break;
+        case OUTPUT_OFFSETS:
+            if (s->show_names)
+            {
+                outbuf_printf(out, "%s:", file_name);
+            }
+            if (s->m->npats > 1)
+            {
+                outbuf_printf(out, "%zu:%zu\n", offset, which + 1);
+            }
+            else
+            {
+                outbuf_printf(out, "%zu\n", offset);
+            }
+            break;
+        case OUTPUT_COUNT:
+        case OUTPUT_FILES:
+            break;
+    }
+    (*found)++;
+    if (stats)
+    {
+        stats->output_ns += stats_now() - start;
+    }
+}
+
+// matcher_search, counting what the engine does if stats is set.
+static inline size_t engine_next(const struct search *s,
+                                 const uint8_t *string, size_t stringlen,
+                                 size_t *which, struct engine_stats *stats)
+{
+    if (stats)
+    {
+        return matcher_search_stats(s->m, string, stringlen, which, stats);
+    }
+    return matcher_search(s->m, string, stringlen, which);
+}
+
+// Where the first match in string is, which is at file offset offset,
+// searching only the runs of blocks the index left in.
+static size_t search_blocks(const struct search *s, const uint8_t *string,
+                            size_t offset, size_t stringlen, size_t *which,
+                            struct engine_stats *stats)
+{
+    size_t pos = 0;
+    while (pos < stringlen)
+    {
+        size_t b = (offset + pos) / GI_BLOCK;
+        if (b >= s->nblocks)
+        {
+            // past what was indexed
+            size_t next = engine_next(s, string + pos, stringlen - pos,
+                                      which, stats);
+            return (next == NOT_FOUND) ? NOT_FOUND : pos + next;
+        }
+        size_t e = b;
+        while ((e < s->nblocks) && (s->blocks[e] == s->blocks[b]))
+        {
+            e++;
+        }
+        size_t run_end = e * GI_BLOCK - offset;
+        if (s->blocks[b])
+        {
+            // matches starting in the run, which may end past it
+            size_t scan_end = ((run_end < stringlen) &&
+                               (stringlen - run_end > s->m->maxlen - 1))
+                ? run_end + s->m->maxlen - 1 : stringlen;
+            size_t next = engine_next(s, string + pos, scan_end - pos,
+                                      which, stats);
+            if (next != NOT_FOUND)
+            {
+                return pos + next;
+            }
+        }
+        pos = run_end;
+    }
+    return NOT_FOUND;
+}
+
+// The next match in string, which is at file offset offset.
+static inline size_t search_next(const struct search *s,
+                                 const uint8_t *string, size_t offset,
+                                 size_t stringlen, size_t *which,
+                                 struct engine_stats *stats)
+{
+    if (s->blocks)
+    {
+        return search_blocks(s, string, offset, stringlen, which, stats);
+    }
+    return engine_next(s, string, stringlen, which, stats);
+}
+
+// Start counting a file for --stats.
+static void stats_begin(struct file_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->files = 1;
+    stats->elapsed_ns = stats_now();
+    stats_faults(&stats->minor_faults, &stats->major_faults);
+}
+
+// Finish counting a file, print its line to stderr and add it to the
+// totals.
+static void stats_end(const struct search *s, const char *file_name,
+                      struct file_stats *stats, size_t found)
+{
+    uint64_t minor, major;
+    stats_faults(&minor, &major);
+    stats->elapsed_ns = stats_now() - stats->elapsed_ns;
+    stats->minor_faults = minor - stats->minor_faults;
+    stats->major_faults = major - stats->major_faults;
+    stats->matches = found;
+
+    char line[512];
+    stats_format(line, sizeof(line), file_name, stats);
+    fprintf(stderr, "stats %s\n", line);
+
+    pthread_mutex_lock(&s->stats->lock);
+    stats_add(&s->stats->sum, stats);
+    pthread_mutex_unlock(&s->stats->lock);
+}
+
+// Print the per-file summary, if the output mode has one.
+static void finish_file(const struct search *s, const char *file_name,
+                        struct outbuf *out, size_t found)
+{
+    if (s->mode == OUTPUT_COUNT)
+    {
+        if (s->show_names)
+        {
+            outbuf_printf(out, "%s:", file_name);
+        }
+        outbuf_printf(out, "%zu\n", found);
+    }
+    else if ((s->mode == OUTPUT_FILES) && (found > 0))
+    {
+        outbuf_printf(out, "%s\n", file_name);
+    }
+}
+
+// True once --max-total matches have been printed, over all files.
+static int total_done(const struct search *s)
+{
+    return s->max_total &&
+           (__atomic_load_n(s->total, __ATOMIC_RELAXED) >= s->max_total);
+}
+
+// True once a file has all the matches it needs.
+static int file_done(const struct search *s, size_t found)
+{
+    return (s->stop_after && (found >= s->stop_after)) || total_done(s);
+}
+
+// mmap len bytes of fd from off, with --populate and --hugepages.
+static const uint8_t *map_file(const struct search *s, int fd, size_t len,
+                               off_t off)
+{
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (s->populate && !s->hugepages)
+    {
+        flags |= MAP_POPULATE;
+    }
+#endif
+    void *data = mmap(0, len, PROT_READ, flags, fd, off);
+#ifdef MADV_HUGEPAGE
+    if ((data != MAP_FAILED) && s->hugepages)
+    {
+        // before any faults, or they get small pages; filesystems that
+        // can't do huge pages ignore it
+        madvise(data, len, MADV_HUGEPAGE);
+#ifdef MADV_POPULATE_READ
+        if (s->populate)
+        {
+            madvise(data, len, MADV_POPULATE_READ);
+        }
+#endif
+    }
+#endif
+    return (const uint8_t*)data;
+}
+
+// Fault in [off, off + len) of a mapping of map_len bytes in one go,
+// rather than a page at a time as the search reaches it.
+static void prefetch_range(const uint8_t *map, size_t map_len, size_t off,
+                           size_t len)
+{
+    // on any worker
+    static size_t page_size = 0;
+    size_t page = __atomic_load_n(&page_size, __ATOMIC_RELAXED);
+    if (page == 0)
+    {
+        page = (size_t)sysconf(_SC_PAGESIZE);
+        __atomic_store_n(&page_size, page, __ATOMIC_RELAXED);
+    }
+    if (off >= map_len)
+    {
+        return;
+    }
+    if (len > map_len - off)
+    {
+        len = map_len - off;
+    }
+    len += off % page;
+    off -= off % page;
+#ifdef MADV_POPULATE_READ
+    if (madvise((void*)(map + off), len, MADV_POPULATE_READ) == 0)
+    {
+        return;
+    }
+#endif
+    // older kernels: at least start reading it
+    madvise((void*)(map + off), len, MADV_WILLNEED);
+}
+
+// Size of the pieces a large file is cut into for parallel scanning.
+#define CHUNK_SIZE ((size_t)16 << 20)
+
+struct hit
+{
+    size_t offset;
+    size_t which;
+};
+
+// A piece of a file scanned on the worker pool.  The scan covers
+// [start, end + maxlen - 1) so that matches starting before end are seen
+// whole, and records the greedy non-overlapping matches it would find if
+// no earlier match ran into start.
+struct chunk_job
+{
+    const struct search *s;
+    const uint8_t *file;
+    size_t file_size;
+    size_t base;        // file offset of file[0]
+    size_t start;
+    size_t end;
+    int node;           // of the pool, whose workers should scan it
+    struct hit *matches;
+    size_t nmatches;
+    size_t alloc;
+    int failed;         // out of memory; the merge rescans it serially
+    int cancelled;      // the file is done; atomic
+    struct pool_group group;
+
+    // --stats; faults are only counted here for chunks run on a thread
+    // other than the one searching the file, which counts its own
+    pthread_t owner;
+    struct engine_stats engine;
+    uint64_t minor_faults;
+    uint64_t major_faults;
+    int ran_on;         // node
+    uint64_t busy_ns;
+};
+
+static size_t chunk_scan_end(const struct chunk_job *c)
+{
+    size_t end = c->end + c->s->m->maxlen - 1;
+    return (end < c->file_size) ? end : c->file_size;
+}
+
+static void chunk_job_run(void *arg)
+{
+    struct chunk_job *c = (struct chunk_job*)arg;
+    const struct search *s = c->s;
+    size_t scan_end = chunk_scan_end(c);
+    size_t last = c->start;
+    size_t next = 0;
+    size_t which = 0;
+    struct engine_stats *engine = s->stats ? &c->engine : NULL;
+    int count_faults = s->stats && !pthread_equal(pthread_self(), c->owner);
+    uint64_t minor = 0;
+    uint64_t major = 0;
+    uint64_t started = 0;
+    if (count_faults)
+    {
+        stats_faults(&minor, &major);
+    }
+    if (s->stats)
+    {
+        c->ran_on = pool_self_node(s->pool);
+        started = stats_now();
+    }
+    // Across nodes, fault the chunk in from here too, so that pages not
+    // yet cached are allocated on this node, which scans them again next
+    // time the file is searched.
+    if (s->prefetch || (pool_nodes(s->pool) > 1))
+    {
+        prefetch_range(c->file, c->file_size, c->start, scan_end - c->start);
+    }
+    while ((next = search_next(s, c->file + last, c->base + last,
+                               scan_end - last, &which,
+                               engine)) != NOT_FOUND)
+    {
+        if ((last + next >= c->end) ||
+            __atomic_load_n(&c->cancelled, __ATOMIC_RELAXED) || total_done(s))
+        {
+            break;
+        }
+        if (c->nmatches == c->alloc)
+        {
+            size_t alloc = c->alloc ? 2 * c->alloc : 1024;
+            struct hit *m =
+                (struct hit*)realloc(c->matches, alloc * sizeof(struct hit));
+            if (!m)
+            {
+                c->failed = 1;
+                break;
+            }
+            c->matches = m;
+            c->alloc = alloc;
+        }
+        c->matches[c->nmatches].offset = last + next;
+        c->matches[c->nmatches].which = which;
+        c->nmatches++;
+        last += next + matcher_skip(s->m, which);
+    }
+    if (count_faults)
+    {
+        uint64_t minor_end, major_end;
+        stats_faults(&minor_end, &major_end);
+        c->minor_faults = minor_end - minor;
+        c->major_faults = major_end - major;
+    }
+    if (s->stats)
+    {
+        c->busy_ns = stats_now() - started;
+    }
+}
+
+// Print a scanned chunk's matches.  *resume is where the serial loop
+// would search next; matches the chunk found before it were swallowed by
+// the previous chunk's last match.  In that case search serially from
+// *resume until we land on a match the chunk also found, after which the
+// two agree.  Periodic patterns over periodic data may never resync, in
+// which case this degrades to scanning the chunk serially.
+static void chunk_merge(struct chunk_job *c, const char *file_name,
+                        struct outbuf *out, size_t *resume, size_t *found,
+                        struct file_stats *stats)
+{
+    const struct search *s = c->s;
+    if (stats)
+    {
+        stats_add_engine(&stats->engine, &c->engine);
+        stats->minor_faults -= c->minor_faults;
+        stats->major_faults -= c->major_faults;
+    }
+    if (s->stats && s->stats->nodes)
+    {
+        pthread_mutex_lock(&s->stats->lock);
+        struct node_stats *n = &s->stats->nodes[c->ran_on];
+        n->chunks++;
+        n->bytes += c->end - c->start;
+        n->busy_ns += c->busy_ns;
+        pthread_mutex_unlock(&s->stats->lock);
+    }
+    size_t pos = (*resume > c->start) ? *resume : c->start;
+    size_t i = 0;
+    int synced = !c->failed &&
+                 ((c->nmatches == 0) || (c->matches[0].offset >= pos));
+
+    while (!synced && !file_done(s, *found))
+    {
+        size_t scan_end = chunk_scan_end(c);
+        size_t which = 0;
+        size_t next = search_next(s, c->file + pos, c->base + pos,
+                                  scan_end - pos, &which,
+                                  stats ? &stats->engine : NULL);
+        if ((next == NOT_FOUND) || (pos + next >= c->end))
+        {
+            break;
+        }
+        size_t at = pos + next;
+        if (!c->failed)
+        {
+            while ((i < c->nmatches) && (c->matches[i].offset < at))
+            {
+                i++;
+            }
+            if ((i < c->nmatches) && (c->matches[i].offset == at) &&
+                (c->matches[i].which == which))
+            {
+                synced = 1;
+                break;
+            }
+        }
+        emit_match(s, file_name, out, c->file, c->base, c->file_size,
+                   c->base + at, which, found, stats);
+        pos = at + matcher_skip(s->m, which);
+    }
+
+    if (synced)
+    {
+        for (; (i < c->nmatches) && !file_done(s, *found); i++)
+        {
+            const struct hit *h = &c->matches[i];
+            emit_match(s, file_name, out, c->file, c->base, c->file_size,
+                       c->base + h->offset, h->which, found, stats);
+            pos = h->offset + matcher_skip(s->m, h->which);
+        }
+    }
+    *resume = pos;
+}
+
+// Scan a mapped file as CHUNK_SIZE pieces on the pool, keeping up to two
+// chunks per worker in flight, and print the matches in file order.  The
+// ring's slots are reused, with their match buffers, so a file costs a
+// window of allocations rather than one per chunk.  Chunks go to the
+// pool's NUMA nodes in turn by file offset, so each search of a file
+// scans a piece on the node it scanned it on, and faulted it in on,
+// before.
+// Returns the number of matches, or NOT_FOUND on allocation failure
+// before anything was printed.
+static size_t search_chunked(const struct search *s, const char *file_name,
+                             struct outbuf *out, const uint8_t *file,
+                             size_t base, size_t file_size,
+                             struct file_stats *stats)
+{
+    size_t nchunks = (file_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    size_t window = 2 * (size_t)s->jobs;
+    if (window > nchunks)
+    {
+        window = nchunks;
+    }
+    struct chunk_job *ring =
+        (struct chunk_job*)calloc(window, sizeof(struct chunk_job));
+    if (!ring)
+    {
+        return NOT_FOUND;
+    }
+
+    size_t nodes = (size_t)pool_nodes(s->pool);
+    size_t submitted = 0;
+    size_t resume = 0;
+    size_t found = 0;
+    for (size_t k=0; k<nchunks; k++)
+    {
+        // top up the window
+        for (; (submitted < nchunks) && (submitted < k + window); submitted++)
+        {
+            // a slot keeps its match buffer from the chunk it last held
+            struct chunk_job *c = &ring[submitted % window];
+            struct hit *matches = c->matches;
+            size_t alloc = c->alloc;
+            memset(c, 0, sizeof(*c));
+            c->matches = matches;
+            c->alloc = alloc;
+            c->s = s;
+            c->file = file;
+            c->file_size = file_size;
+            c->base = base;
+            c->owner = pthread_self();
+            c->start = submitted * CHUNK_SIZE;
+            c->end = c->start + CHUNK_SIZE;
+            if (c->end > file_size)
+            {
+                c->end = file_size;
+            }
+            c->node = (int)(((base + c->start) / CHUNK_SIZE) % nodes);
+            if (pool_submit_node(s->pool, &c->group, c->node,
+                                 chunk_job_run, c) != 0)
+            {
+                c->failed = 1;
+            }
+        }
+
+        struct chunk_job *c = &ring[k % window];
+        pool_wait_group(s->pool, &c->group);
+        chunk_merge(c, file_name, out, &resume, &found, stats);
+
+        if (file_done(s, found))
+        {
+            // stop the chunks still in flight, then drop them
+            for (size_t j = k + 1; j < submitted; j++)
+            {
+                __atomic_store_n(&ring[j % window].cancelled, 1,
+                                 __ATOMIC_RELAXED);
+            }
+            for (k++; k < submitted; k++)
+            {
+                c = &ring[k % window];
+                pool_wait_group(s->pool, &c->group);
+            }
+            break;
+        }
+    }
+    for (size_t j=0; j<window; j++)
+    {
+        free(ring[j].matches);
+    }
+    free(ring);
+    return found;
+}
+
+// Search file_size bytes in memory, which are at file offset base.  With
+// prefetch (only for mappings), search them that many bytes at a time,
+// faulting in the next piece before searching this one.  Returns the
+// number of matches.
+static size_t search_mapped(const struct search *s, const char *file_name,
+                            struct outbuf *out, const uint8_t *file,
+                            size_t base, size_t file_size, size_t prefetch,
+                            struct file_stats *stats)
+{
+    size_t found = NOT_FOUND;
+    if (s->pool && (file_size > CHUNK_SIZE) && (s->m->maxlen < CHUNK_SIZE))
+    {
+        found = search_chunked(s, file_name, out, file, base, file_size,
+                               stats);
+    }
+    if (found == NOT_FOUND)
+    {
+        size_t last = 0;
+        size_t next = 0;
+        size_t which = 0;
+        size_t piece = prefetch ? prefetch : file_size;
+        size_t end = (piece < file_size) ? piece : file_size;
+        found = 0;
+        if (prefetch)
+        {
+            prefetch_range(file, file_size, 0, end);
+        }
+        for (;;)
+        {
+            // matches starting before end are this piece's
+            size_t scan_end = file_size - end > s->m->maxlen - 1
+                ? end + s->m->maxlen - 1 : file_size;
+            if (prefetch)
+            {
+                prefetch_range(file, file_size, end, piece);
+            }
+            while (!file_done(s, found) &&
+                   ((next = search_next(s, file + last, base + last,
+                                        scan_end - last, &which,
+                                        stats ? &stats->engine : NULL))
+                    != NOT_FOUND) &&
+                   (last + next < end))
+            {
+                emit_match(s, file_name, out, file, base, file_size,
+                           base + last + next, which, &found, stats);
+                last += next + matcher_skip(s->m, which);
+            }
+            if ((end == file_size) || file_done(s, found))
+            {
+                break;
+            }
+            if (last < end)
+            {
+                last = end;
+            }
+            end = (file_size - end > piece) ? end + piece : file_size;
+        }
+    }
+    return found;
+}
+
+// Streaming reads are STREAM_BLOCK bytes into STREAM_ALIGN aligned
+// memory, which is what O_DIRECT needs.
+#define STREAM_BLOCK ((size_t)4 << 20)
+#define STREAM_ALIGN ((size_t)4096)
+
+// Search what is in the stream buffer, from *pos on.  Matches whose
+// trailing context has not been read yet are left for the next call,
+// unless at_eof.
+static void stream_scan(const struct search *s, const char *file_name,
+                        struct outbuf *out, const uint8_t *data,
+                        size_t base, size_t avail, int at_eof,
+                        size_t *pos, size_t *found, struct file_stats *stats)
+{
+    size_t context = (s->mode == OUTPUT_DUMP) ? s->after : 0;
+
+    // -b context stops at the start of --range, as it does at the end
+    // and as it does when the range is mapped
+    size_t clip = (s->range_start > base) ? s->range_start - base : 0;
+    clip = (clip < avail) ? clip : avail;
+    while (!file_done(s, *found) && (*pos < base + avail))
+    {
+        size_t rel = *pos - base;
+        size_t which = 0;
+        size_t next = search_next(s, data + rel, *pos, avail - rel, &which,
+                                  stats ? &stats->engine : NULL);
+        if (next == NOT_FOUND)
+        {
+            // a match not read yet could start in the last maxlen - 1 bytes
+            if (avail - rel > s->m->maxlen - 1)
+            {
+                *pos = base + avail - (s->m->maxlen - 1);
+            }
+            return;
+        }
+
+        size_t at = *pos + next;
+        size_t len = s->m->pats[which].len;
+        if (!at_eof && (at + len + context > base + avail))
+        {
+            *pos = at;
+            return;
+        }
+        emit_match(s, file_name, out, data + clip, base + clip,
+                   avail - clip, at, which, found, stats);
+        *pos = at + matcher_skip(s->m, which);
+    }
+}
+
+// Search a pipe, device or anything else that can only be read in order,
+// through dec if it isn't NULL.  The buffer carries the last bytes of each
+// block over to the next, so matches spanning blocks are found and -b
+// context can be printed.  Returns the number of matches.
+static size_t search_stream(const struct search *s, const char *file_name,
+                            struct outbuf *out, int fd, struct decoder *dec,
+                            size_t *errors, struct file_stats *stats)
+{
+    size_t before = (s->mode == OUTPUT_DUMP) ? s->before : 0;
+    size_t after = (s->mode == OUTPUT_DUMP) ? s->after : 0;
+    size_t carry_room = before + s->m->maxlen + after;
+    carry_room = (carry_room + STREAM_ALIGN - 1) & ~(STREAM_ALIGN - 1);
+
+    void *mem = NULL;
+    if (posix_memalign(&mem, STREAM_ALIGN, carry_room + STREAM_BLOCK) != 0)
+    {
+        report_error("Buffer", file_name);
+        (*errors)++;
+        return 0;
+    }
+
+    // New data is always read to block, right after the carried bytes,
+    // so that reads stay aligned.  data..data + avail is contiguous and
+    // starts at file offset base.
+    uint8_t *block = (uint8_t*)mem + carry_room;
+    uint8_t *data = block;
+    size_t base = 0;
+    size_t avail = 0;
+    size_t filled = 0;
+    size_t pos = s->range_start;
+    size_t found = 0;
+
+    if (pos > 0)
+    {
+        // get to --range: seek if we can (aligned, for O_DIRECT; the
+        // search starts at pos anyway), else read up to it
+        size_t aligned = pos - pos % STREAM_ALIGN;
+        if (!dec && (lseek(fd, (off_t)aligned, SEEK_SET) == (off_t)aligned))
+        {
+            base = aligned;
+        }
+        while (base < aligned)
+        {
+            size_t want = aligned - base;
+            want = (want < STREAM_BLOCK) ? want : STREAM_BLOCK;
+            ssize_t n = dec ? dc_read(dec, block, want)
+                            : read(fd, block, want);
+            if ((n < 0) && (errno == EINTR))
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                if (n < 0)
+                {
+                    report_error("Read", file_name);
+                    (*errors)++;
+                }
+                free(mem);
+                return 0;
+            }
+            base += (size_t)n;
+        }
+    }
+
+    while (!file_done(s, found))
+    {
+        ssize_t n = dec ? dc_read(dec, block + filled, STREAM_BLOCK - filled)
+                        : read(fd, block + filled, STREAM_BLOCK - filled);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+#ifdef O_DIRECT
+            if ((errno == EINVAL) && (fcntl(fd, F_GETFL) & O_DIRECT))
+            {
+                // not supported here after all
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                continue;
+            }
+#endif
+            report_error("Read", file_name);
+            (*errors)++;
+            break;
+        }
+        if (n == 0)
+        {
+            stream_scan(s, file_name, out, data, base, avail, 1,
+                        &pos, &found, stats);
+            break;
+        }
+
+        filled += (size_t)n;
+        avail += (size_t)n;
+        if (stats)
+        {
+            stats->bytes += (size_t)n;
+        }
+        if (avail >= s->range_end - base)
+        {
+            // the end of --range counts as the end of the file
+            avail = s->range_end - base;
+            stream_scan(s, file_name, out, data, base, avail, 1,
+                        &pos, &found, stats);
+            break;
+        }
+        stream_scan(s, file_name, out, data, base, avail, 0, &pos, &found,
+                    stats);
+
+        if ((filled == STREAM_BLOCK) && !file_done(s, found))
+        {
+            // keep what a later match or its context might need
+            size_t keep = (pos - base > before) ? pos - before : base;
+            size_t carry = base + avail - keep;
+            outbuf_drop_refs(out);
+            memmove(block - carry, data + (keep - base), carry);
+            data = block - carry;
+            base = keep;
+            avail = carry;
+            filled = 0;
+        }
+    }
+
+    outbuf_drop_refs(out);
+    free(mem);
+    return found;
+}
+
+// Smallest window worth mapping, on top of the bytes carried between
+// windows.
+#define WINDOW_MIN ((size_t)1 << 20)
+
+// Search a regular file by mapping window bytes of it at a time.  Each
+// window is read ahead as a whole, the next one is prefetched, and the
+// pages behind are unmapped (and with --noreuse dropped from the page
+// cache) so that a big scan doesn't evict everyone else's pages.
+// Matches and context straddling windows are handled as in
+// search_stream, by starting each window far enough back.
+static size_t search_windowed(const struct search *s, const char *file_name,
+                              struct outbuf *out, int fd, size_t file_size,
+                              size_t *errors, struct file_stats *stats)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t before = (s->mode == OUTPUT_DUMP) ? s->before : 0;
+    size_t after = (s->mode == OUTPUT_DUMP) ? s->after : 0;
+    size_t window = before + s->m->maxlen + after + WINDOW_MIN;
+    if (window < s->window)
+    {
+        window = s->window;
+    }
+    window = (window + page - 1) / page * page;
+
+    // file_size is where --range ends
+    size_t pos = s->range_start;
+    size_t found = 0;
+    if (pos >= file_size)
+    {
+        return 0;
+    }
+    for (;;)
+    {
+        size_t keep = (pos > before) ? pos - before : 0;
+        size_t map_off = keep - keep % page;
+        size_t map_len = file_size - map_off;
+        if (map_len > window)
+        {
+            map_len = window;
+        }
+        int at_eof = (map_off + map_len == file_size);
+
+        const uint8_t *data = map_file(s, fd, map_len, (off_t)map_off);
+        if (data == MAP_FAILED)
+        {
+            report_error("Mmap", file_name);
+            (*errors)++;
+            break;
+        }
+        madvise((void*)data, map_len, MADV_SEQUENTIAL);
+        madvise((void*)data, map_len, MADV_WILLNEED);
+#ifdef POSIX_FADV_WILLNEED
+        if (!at_eof)
+        {
+            posix_fadvise(fd, (off_t)(map_off + map_len), (off_t)window,
+                          POSIX_FADV_WILLNEED);
+        }
+#endif
+
+        stream_scan(s, file_name, out, data, map_off, map_len, at_eof,
+                    &pos, &found, stats);
+        outbuf_drop_refs(out);
+
+        madvise((void*)data, map_len, MADV_DONTNEED);
+        if (munmap((void*)data, map_len) != 0)
+        {
+            report_error("Unmap", file_name);
+            (*errors)++;
+        }
+#ifdef POSIX_FADV_DONTNEED
+        if (s->noreuse)
+        {
+            posix_fadvise(fd, (off_t)map_off, (off_t)map_len,
+                          POSIX_FADV_DONTNEED);
+        }
+#endif
+        if (at_eof || file_done(s, found))
+        {
+            break;
+        }
+    }
+    return found;
+}
+
+// For --rare-byte, the search to use on one file: s, or *fs searching
+// with *fm, a copy of s->m anchored on the pattern byte rarest in sample.
+// Without a sample (streams, windows), guess from typical files.
+static const struct search *rare_search(const struct search *s,
+                                        const uint8_t *sample, size_t len,
+                                        struct search *fs, struct matcher *fm)
+{
+    if (!s->rare_byte)
+    {
+        return s;
+    }
+    uint64_t freq[256];
+    if (sample)
+    {
+        rb_histogram(freq, sample, (len < RB_SAMPLE) ? len : RB_SAMPLE);
+    }
+    else
+    {
+        rb_default_freq(freq);
+    }
+    *fm = *s->m;
+    if (!matcher_anchor_rare(fm, freq))
+    {
+        return s;
+    }
+    *fs = *s;
+    fs->m = fm;
+    return fs;
+}
+
+// For a file with a current sidecar index, *fs: a copy of s that skips
+// the blocks the index rules out, with *blocks to free afterwards.
+// Otherwise s.
+static const struct search *index_search(const struct search *s,
+                                         const char *file_name,
+                                         const struct stat *st,
+                                         struct search *fs, uint8_t **blocks)
+{
+    *blocks = NULL;
+    if (!s->use_index || !S_ISREG(st->st_mode) ||
+        ((size_t)st->st_size < GI_MIN_SIZE))
+    {
+        return s;
+    }
+    char *path = gi_path(file_name);
+    struct gram_index gi;
+    if (!path || (gi_open(&gi, path, st) != 0))
+    {
+        // none, or out of date
+        free(path);
+        return s;
+    }
+    free(path);
+    *blocks = gi_candidates(&gi, s->m);
+    size_t nblocks = gi.nblocks;
+    gi_close(&gi);
+    if (!*blocks)
+    {
+        return s;
+    }
+    *fs = *s;
+    fs->blocks = *blocks;
+    fs->nblocks = nblocks;
+    return fs;
+}
+
+// For -z, a decoder for fd if it is compressed, or if it is a pipe or
+// device, which can only be looked at by reading it.  NULL for a regular
+// file that isn't compressed, to be searched as usual, or with *failed
+// set on error.
+static struct decoder *open_decoder(const struct search *s, int fd,
+                                    const struct stat *st,
+                                    const char *file_name, int *failed)
+{
+    *failed = 0;
+    if (S_ISREG(st->st_mode) && (st->st_size > 0))
+    {
+        uint8_t head[DC_MAGIC_LEN];
+        ssize_t n = pread(fd, head, sizeof(head), 0);
+        if ((n <= 0) || (dc_detect(head, (size_t)n) == DC_NONE))
+        {
+            return NULL;
+        }
+    }
+#ifdef O_DIRECT
+    if (s->direct)
+    {
+        // the decoder's reads aren't aligned
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    }
+#endif
+    struct decoder *dec = dc_open(fd, st, s->pool, s->jobs);
+    if (!dec)
+    {
+        report_error("Decompress", file_name);
+        *failed = 1;
+    }
+    return dec;
+}
+
+// name, relative to cwd unless it is absolute, in memory from malloc().
+static char *resolve_path(const char *cwd, const char *name)
+{
+    size_t cwd_len = (name[0] == '/') ? 0 : strlen(cwd);
+    size_t name_len = strlen(name);
+    char *path = (char*)malloc(cwd_len + name_len + 2);
+    if (path)
+    {
+        memcpy(path, cwd, cwd_len);
+        if (cwd_len > 0)
+        {
+            path[cwd_len++] = '/';
+        }
+        memcpy(path + cwd_len, name, name_len + 1);
+    }
+    return path;
+}
+
+// Search one file, printing matches to out.  Adds the number of matches
+// found and errors encountered to *count and *errors.  "-" is stdin.
+// The file is at path, which is file_name as the user gave it.
+static void search_path(const struct search *s, const char *path,
+                        const char *file_name, struct outbuf *out,
+                        size_t *count, size_t *errors)
+{
+    if (total_done(s))
+    {
+        return;
+    }
+    int is_stdin = (strcmp(file_name, "-") == 0);
+    int flags = O_RDONLY;
+#ifdef O_DIRECT
+    if (s->direct)
+    {
+        flags |= O_DIRECT;
+    }
+#endif
+    int fd = is_stdin ? STDIN_FILENO : open(path, flags);
+#ifdef O_DIRECT
+    if ((fd < 0) && (errno == EINVAL) && s->direct)
+    {
+        // filesystem doesn't do O_DIRECT
+        fd = open(path, O_RDONLY);
+    }
+#endif
+    if (is_stdin)
+    {
+        file_name = "(standard input)";
+    }
+    if (fd < 0)
+    {
+        report_error("Open", file_name);
+        (*errors)++;
+        return;
+    }
+
+    // Get the file size, to make mmap search the whole thing
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+    {
+        report_error("Stat", file_name);
+        (*errors)++;
+        if (!is_stdin)
+        {
+            close(fd); // ignore error
+        }
+        return;
+    }
+
+    size_t file_size = (size_t)file_stat.st_size;
+    size_t range_start = (s->range_start < file_size) ? s->range_start
+                                                       : file_size;
+    size_t range_end = (s->range_end < file_size) ? s->range_end : file_size;
+    size_t found = 0;
+    int failed = 0;
+    struct search rare_s;
+    struct matcher rare_m;
+    struct search index_s;
+    uint8_t *blocks = NULL;
+    struct file_stats file_stats;
+    struct file_stats *stats = NULL;
+    if (s->stats && !S_ISDIR(file_stat.st_mode))
+    {
+        stats = &file_stats;
+        stats_begin(stats);
+    }
+#ifdef POSIX_FADV_NOREUSE
+    if (s->noreuse)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+    }
+#endif
+    struct decoder *dec = NULL;
+    if (s->decompress && !S_ISDIR(file_stat.st_mode))
+    {
+        // searched as a stream of what it decompresses to, if it is
+        // compressed
+        dec = open_decoder(s, fd, &file_stat, file_name, &failed);
+        if (failed)
+        {
+            (*errors)++;
+        }
+    }
+    if (!is_stdin && !dec && !failed)
+    {
+        s = index_search(s, path, &file_stat, &index_s, &blocks);
+    }
+    if (S_ISDIR(file_stat.st_mode))
+    {
+        if (!is_stdin)
+        {
+            close(fd); // ignore error
+        }
+        return;
+    }
+    else if (failed)
+    {
+        // reported
+    }
+    else if (dec)
+    {
+        // --range is in decompressed bytes, so it is up to search_stream
+        found = search_stream(rare_search(s, NULL, 0, &rare_s, &rare_m),
+                              file_name, out, fd, dec, errors, stats);
+    }
+    else if (!S_ISREG(file_stat.st_mode) || (file_size == 0) || s->direct)
+    {
+        // Pipes and devices, and files like those in /proc that claim to
+        // be empty but aren't
+        found = search_stream(rare_search(s, NULL, 0, &rare_s, &rare_m),
+                              file_name, out, fd, NULL, errors, stats);
+    }
+    else if (range_end <= range_start)
+    {
+        // --range is past the end
+    }
+    else if (s->window && (range_end - range_start > s->window))
+    {
+        found = search_windowed(rare_search(s, NULL, 0, &rare_s, &rare_m),
+                                file_name, out, fd, range_end, errors,
+                                stats);
+    }
+    else
+    {
+        // map only the pages --range covers, unless the mapping is to be
+        // kept for later searches
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t map_off = range_start - range_start % page;
+        size_t map_len = range_end - map_off;
+        const struct map_entry *cached = NULL;
+        if (s->maps)
+        {
+            map_off = 0;
+            map_len = file_size;
+            cached = mc_lookup(s->maps, &file_stat);
+        }
+        const uint8_t *file = cached ? cached->data
+                                     : map_file(s, fd, map_len, (off_t)map_off);
+        if (file == MAP_FAILED)
+        {
+            report_error("Mmap", file_name);
+            (*errors)++;
+            failed = 1;
+        }
+        else
+        {
+            if (s->maps && !cached)
+            {
+                // or, out of memory, unmap it as usual
+                cached = mc_insert(s->maps, &file_stat, file, map_len);
+                file = cached ? cached->data : file;
+            }
+
+            if (!s->pool && !s->blocks && !cached)
+            {
+                madvise((void*)file, map_len, MADV_SEQUENTIAL);
+            }
+
+            const uint8_t *start = file + (range_start - map_off);
+            size_t len = range_end - range_start;
+            found = search_mapped(rare_search(s, start, len, &rare_s, &rare_m),
+                                  file_name, out, start, range_start, len,
+                                  s->prefetch, stats);
+
+            outbuf_drop_refs(out);
+            if (cached)
+            {
+                mc_release(s->maps, cached);
+            }
+            else if (munmap((void*)file, map_len) != 0)
+            {
+                report_error("Unmap", file_name);
+                (*errors)++;
+            }
+#ifdef POSIX_FADV_DONTNEED
+            if (s->noreuse)
+            {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            }
+#endif
+        }
+    }
+    if (!failed)
+    {
+        finish_file(s, file_name, out, found);
+    }
+    *count += found;
+    if (stats)
+    {
+        if (S_ISREG(file_stat.st_mode) && (file_size > 0) && !s->direct &&
+            !dec && !failed)
+        {
+            stats->bytes = range_end - range_start;
+        }
+        stats_end(s, file_name, stats, found);
+    }
+    free(blocks);
+    dc_close(dec);
+
+    if (!is_stdin && (close(fd) != 0))
+    {
+        report_error("Close", file_name);
+        (*errors)++;
+    }
+}
+
+static void search_file(const struct search *s, const char *file_name,
+                        struct outbuf *out, size_t *count, size_t *errors)
+{
+    if (!s->dir || (file_name[0] == '/') || (strcmp(file_name, "-") == 0))
+    {
+        search_path(s, file_name, file_name, out, count, errors);
+        return;
+    }
+    char *path = resolve_path(s->dir, file_name);
+    if (!path)
+    {
+        report_error("Buffer", file_name);
+        (*errors)++;
+        return;
+    }
+    search_path(s, path, file_name, out, count, errors);
+    free(path);
+}
+
+// Remember text as a pattern; it is compiled once all options are read.
+static void add_pattern(struct pattern_list *l, const char *text)
+{
+    if (pattern_list_add(l, text) != 0)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+    }
+}
+
+// Add a --include, --exclude or --exclude-dir glob.
+static void add_glob(char ***globs, size_t *n, char *glob)
+{
+    char **g = (char**)realloc(*globs, (*n + 1) * sizeof(char*));
+    if (!g)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+    }
+    g[(*n)++] = glob;
+    *globs = g;
+}
+
+// Add each line of file_name as a pattern.
+static void read_patterns(struct pattern_list *l, const char *file_name)
+{
+    FILE *f = fopen(file_name, "r");
+    if (!f)
+    {
+        report_error("Open", file_name);
+        exit(2);
+    }
+
+    char *line = NULL;
+    size_t alloc = 0;
+    ssize_t len;
+    while ((len = getline(&line, &alloc, f)) != -1)
+    {
+        while ((len > 0) &&
+               ((line[len - 1] == '\n') || (line[len - 1] == '\r')))
+        {
+            line[--len] = '\0';
+        }
+        if ((len == 0) || (line[0] == '#'))
+        {
+            continue;
+        }
+        add_pattern(l, line);
+    }
+    if (ferror(f))
+    {
+        report_error("Read", file_name);
+        exit(2);
+    }
+    free(line);
+    fclose(f);
+}
+
+// One FILE argument handed to the worker pool.
+struct file_job
+{
+    const struct search *s;
+    const char *file_name;
+    size_t count;
+    size_t errors;
+};
+
+// Guards stdout for output groups that overflow their worker's buffer.
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t outbuf_key;
+static pthread_once_t outbuf_once = PTHREAD_ONCE_INIT;
+
+static void outbuf_key_free(void *arg)
+{
+    outbuf_free((struct outbuf*)arg);
+    free(arg);
+}
+
+static void outbuf_key_init(void)
+{
+    pthread_key_create(&outbuf_key, outbuf_key_free);
+}
+
+// This thread's stdout buffer, owned by the caller until it is handed to
+// release_outbuf().  A file job run while its thread waits on chunks of
+// another file gets a fresh one.  NULL on allocation failure.
+static struct outbuf *acquire_outbuf(void)
+{
+    pthread_once(&outbuf_once, outbuf_key_init);
+    struct outbuf *o = (struct outbuf*)pthread_getspecific(outbuf_key);
+    if (o)
+    {
+        pthread_setspecific(outbuf_key, NULL);
+        return o;
+    }
+
+    o = (struct outbuf*)malloc(sizeof(struct outbuf));
+    if (o && (outbuf_init(o, STDOUT_FILENO, &output_lock) != 0))
+    {
+        outbuf_key_free(o);
+        o = NULL;
+    }
+    return o;
+}
+
+static void release_outbuf(struct outbuf *o)
+{
+    if (pthread_getspecific(outbuf_key))
+    {
+        outbuf_key_free(o);
+    }
+    else
+    {
+        pthread_setspecific(outbuf_key, o);
+    }
+}
+
+// Finish a file's output, counting a failed write as an error.
+static void end_file_output(struct outbuf *out, size_t *errors)
+{
+    outbuf_end_group(out);
+    if (out->error)
+    {
+        errno = out->error;
+        report_error("Write", "stdout");
+        out->error = 0;
+        (*errors)++;
+    }
+}
+
+// Format into this worker's own buffer; each file's output is written
+// as one group, so it stays under its own header.
+static void file_job_run(void *arg)
+{
+    struct file_job *job = (struct file_job*)arg;
+    struct outbuf *out = acquire_outbuf();
+    if (!out)
+    {
+        report_error("Buffer", job->file_name);
+        job->errors++;
+        return;
+    }
+
+    search_file(job->s, job->file_name, out, &job->count, &job->errors);
+    end_file_output(out, &job->errors);
+    release_outbuf(out);
+}
+
+// --follow and --checkpoint: FILEs searched from where the last search of
+// them left off, as they grow.
+
+static volatile sig_atomic_t follow_stop = 0;
+
+static void follow_signal(int sig)
+{
+    (void)sig;
+    follow_stop = 1;
+}
+
+// Save a --follow checkpoint at most this often, and when stopping.
+#define FOLLOW_SAVE_NS ((uint64_t)1000000000)
+
+struct followed
+{
+    const char *name;
+    int fd;             // or -1 if it couldn't be opened
+    struct stat st;
+    size_t pos;         // search from here next
+    size_t end;         // the size searched up to
+    size_t found;       // over all passes, for -m and -l
+};
+
+// Search what has been added to f since the last pass: from f->pos, less
+// any -b context, to the end, mapping only those pages.  stream_scan()
+// leaves f->pos within maxlen - 1 bytes of the end, where a match that
+// isn't all written yet could start, or, unless at_eof, at a match whose
+// -a context isn't.  A file that shrank was truncated or rewritten, and is
+// searched again from the start.
+static void follow_scan(const struct search *s, struct followed *f,
+                        int at_eof, struct outbuf *out, size_t *count,
+                        size_t *errors)
+{
+    if (fstat(f->fd, &f->st) != 0)
+    {
+        report_error("Stat", f->name);
+        (*errors)++;
+        return;
+    }
+    size_t size = (size_t)f->st.st_size;
+    if ((size < f->end) || (size < f->pos))
+    {
+        fprintf(stderr, "Truncated %s, searching it from the start\n",
+                f->name);
+        f->pos = 0;
+        f->end = 0;
+    }
+    if (((size == f->end) && !at_eof) || (size <= f->pos) ||
+        file_done(s, f->found))
+    {
+        f->end = size;
+        return;
+    }
+
+    // -m counts over all passes
+    struct search fs = *s;
+    if (s->stop_after)
+    {
+        fs.stop_after = s->stop_after - f->found;
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t before = (s->mode == OUTPUT_DUMP) ? s->before : 0;
+    size_t keep = (f->pos > before) ? f->pos - before : 0;
+    size_t map_off = keep - keep % page;
+    const uint8_t *data = map_file(s, f->fd, size - map_off, (off_t)map_off);
+    if (data == MAP_FAILED)
+    {
+        report_error("Mmap", f->name);
+        (*errors)++;
+        return;
+    }
+
+    struct file_stats file_stats;
+    struct file_stats *stats = NULL;
+    if (s->stats)
+    {
+        stats = &file_stats;
+        stats_begin(stats);
+        stats->bytes = size - f->pos;
+    }
+    size_t found = 0;
+    stream_scan(&fs, f->name, out, data, map_off, size - map_off, at_eof,
+                &f->pos, &found, stats);
+    finish_file(&fs, f->name, out, found);
+    if (stats)
+    {
+        stats_end(s, f->name, stats, found);
+    }
+
+    outbuf_drop_refs(out);
+    if (munmap((void*)data, size - map_off) != 0)
+    {
+        report_error("Unmap", f->name);
+        (*errors)++;
+    }
+    end_file_output(out, errors);
+    f->end = size;
+    f->found += found;
+    *count += found;
+}
+
+// Record where each file is up to in the checkpoint file.
+static void follow_save(struct checkpoint *cp, const char *checkpoint,
+                        const struct followed *files, int nfiles,
+                        size_t *errors)
+{
+    for (int i=0; i<nfiles; i++)
+    {
+        if ((files[i].fd >= 0) &&
+            (cp_set(cp, files[i].name, &files[i].st, files[i].pos) != 0))
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(2);
+        }
+    }
+    if (cp_save(cp, checkpoint) != 0)
+    {
+        report_error("Write", checkpoint);
+        (*errors)++;
+    }
+}
+
+// Search each of names from where checkpoint, if not NULL, says the last
+// search stopped, and save where this one stops.  With follow, keep
+// searching what is appended to them, woken by inotify, until
+// interrupted; matches waiting for their -a context are printed then,
+// with what there is of it.
+static void follow_files(const struct search *s, char *const *names,
+                         int nfiles, const char *checkpoint, int follow,
+                         size_t *count, size_t *errors)
+{
+    struct checkpoint cp;
+    memset(&cp, 0, sizeof(cp));
+    if (checkpoint && (cp_load(&cp, checkpoint) != 0))
+    {
+        if (errno == EINVAL)
+        {
+            fprintf(stderr, "Not a checkpoint: %s\n", checkpoint);
+        }
+        else
+        {
+            report_error("Read", checkpoint);
+        }
+        exit(2);
+    }
+    struct followed *files =
+        (struct followed*)calloc(nfiles, sizeof(struct followed));
+    struct outbuf out;
+    if (!files || (outbuf_init(&out, STDOUT_FILENO, NULL) != 0))
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+    }
+
+    int watch = -1;
+    sigset_t unblocked;
+    if (follow)
+    {
+        watch = inotify_init1(IN_CLOEXEC);
+        if (watch < 0)
+        {
+            report_error("Inotify", names[0]);
+            exit(2);
+        }
+        // stop between passes, with the output and checkpoint whole: the
+        // signals are only let in while waiting
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = follow_signal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sigset_t stop_signals;
+        sigemptyset(&stop_signals);
+        sigaddset(&stop_signals, SIGINT);
+        sigaddset(&stop_signals, SIGTERM);
+        sigprocmask(SIG_BLOCK, &stop_signals, &unblocked);
+    }
+
+    int open_files = 0;
+    for (int i=0; i<nfiles; i++)
+    {
+        struct followed *f = &files[i];
+        f->name = names[i];
+        f->fd = open(f->name, O_RDONLY | O_CLOEXEC);
+        if ((f->fd < 0) || (fstat(f->fd, &f->st) != 0))
+        {
+            report_error("Open", f->name);
+            (*errors)++;
+        }
+        else if (!S_ISREG(f->st.st_mode))
+        {
+            fprintf(stderr, "Not a regular file: %s\n", f->name);
+            (*errors)++;
+        }
+        else if (follow &&
+                 (inotify_add_watch(watch, f->name, IN_MODIFY) < 0))
+        {
+            report_error("Inotify", f->name);
+            (*errors)++;
+        }
+        else
+        {
+            f->pos = checkpoint ? cp_get(&cp, f->name, &f->st) : 0;
+            open_files++;
+            continue;
+        }
+        if (f->fd >= 0)
+        {
+            close(f->fd); // ignore error
+            f->fd = -1;
+        }
     }
-    if ((c >= 'A') && (c <= 'F'))
+
+    uint64_t saved = 0;
+    while (open_files > 0)
+    {
+        int last = !follow || follow_stop;
+        int done = 1;
+        for (int i=0; i<nfiles; i++)
+        {
+            if (files[i].fd >= 0)
+            {
+                follow_scan(s, &files[i], last, &out, count, errors);
+                done &= file_done(s, files[i].found);
+            }
+        }
+        int stop = last || done || total_done(s);
+        if (checkpoint && (stop || (stats_now() - saved >= FOLLOW_SAVE_NS)))
+        {
+            follow_save(&cp, checkpoint, files, nfiles, errors);
+            saved = stats_now();
+        }
+        if (stop)
+        {
+            break;
+        }
+
+        // which file changed doesn't matter; an unchanged one costs a
+        // stat
+        struct pollfd pfd = { watch, POLLIN, 0 };
+        int ready = ppoll(&pfd, 1, NULL, &unblocked);
+        char events[4096];
+        if (((ready < 0) && (errno != EINTR)) ||
+            ((ready > 0) && (read(watch, events, sizeof(events)) < 0)))
+        {
+            report_error("Inotify", names[0]);
+            (*errors)++;
+            break;
+        }
+    }
+    if (follow)
+    {
+        sigprocmask(SIG_SETMASK, &unblocked, NULL);
+    }
+
+    for (int i=0; i<nfiles; i++)
+    {
+        if (files[i].fd >= 0)
+        {
+            close(files[i].fd); // ignore error
+        }
+    }
+    if (watch >= 0)
+    {
+        close(watch); // ignore error
+    }
+    outbuf_free(&out);
+    free(files);
+    cp_free(&cp);
+}
+
+// Totals for -r, whose files are found as the walk goes.
+struct walk_search
+{
+    const struct search *s;
+    struct outbuf *out;     // without a pool, shared by every file
+    pthread_mutex_t lock;
+    size_t count;
+    size_t errors;
+};
+
+static void walk_search_file(void *arg, const char *path)
+{
+    struct walk_search *ws = (struct walk_search*)arg;
+    size_t count = 0;
+    size_t errors = 0;
+    struct outbuf *out = ws->out ? ws->out : acquire_outbuf();
+    if (!out)
+    {
+        report_error("Buffer", path);
+        errors++;
+    }
+    else
+    {
+        search_file(ws->s, path, out, &count, &errors);
+        end_file_output(out, &errors);
+        if (!ws->out)
+        {
+            release_outbuf(out);
+        }
+    }
+
+    pthread_mutex_lock(&ws->lock);
+    ws->count += count;
+    ws->errors += errors;
+    pthread_mutex_unlock(&ws->lock);
+}
+
+static int walk_search_stop(void *arg)
+{
+    return total_done(((struct walk_search*)arg)->s);
+}
+
+static void walk_search_error(void *arg, const char *what, const char *path)
+{
+    struct walk_search *ws = (struct walk_search*)arg;
+    report_error(what, path);
+    pthread_mutex_lock(&ws->lock);
+    ws->errors++;
+    pthread_mutex_unlock(&ws->lock);
+}
+
+// Search names, walking the ones that are directories with w.  Returns
+// 0, or -1 if out of memory before anything was searched.
+static int search_recursive(const struct search *s, struct walk *w,
+                            char *const *names, int nfiles,
+                            size_t *count, size_t *errors)
+{
+    struct outbuf out;
+    struct walk_search ws = {
+        .s = s,
+        .out = NULL,
+        .count = 0,
+        .errors = 0
+    };
+    if (!s->pool)
+    {
+        if (outbuf_init(&out, STDOUT_FILENO, NULL) != 0)
+        {
+            return -1;
+        }
+        ws.out = &out;
+    }
+    pthread_mutex_init(&ws.lock, NULL);
+    w->file = walk_search_file;
+    w->error = walk_search_error;
+    w->stop = walk_search_stop;
+    w->arg = &ws;
+    w->pool = s->pool;
+
+    for (int f=0; f<nfiles; f++)
+    {
+        struct stat st;
+        if ((strcmp(names[f], "-") != 0) && (stat(names[f], &st) == 0) &&
+            S_ISDIR(st.st_mode))
+        {
+            walk_tree(w, names[f]);
+        }
+        else
+        {
+            walk_search_file(&ws, names[f]);
+        }
+    }
+
+    pthread_mutex_destroy(&ws.lock);
+    if (ws.out)
+    {
+        outbuf_free(&out);
+    }
+    *count += ws.count;
+    *errors += ws.errors;
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+
+// Regular files up to this size are read whole through io_uring; bigger
+// ones, those that may have a FILE.mgi, and anything that isn't a regular
+// file, are searched as usual once the ring is done.
+#define URING_MAX_READ ((size_t)1 << 20)
+
+// Files in flight per ring.  Each has at most two operations queued.
+#define URING_SLOTS 64
+
+enum uring_op
+{
+    URING_OPEN,
+    URING_STAT,
+    URING_READ,
+    URING_CLOSE
+};
+
+struct uring_slot
+{
+    const char *file_name;  // NULL when free
+    int fd;
+    int pending;            // operations in flight
+    int open_res;
+    int stat_res;
+    struct statx stx;
+    uint8_t *buf;
+    size_t alloc;
+    size_t got;
+};
+
+// FILE arguments shared by all ring workers, claimed in order.
+struct uring_files
+{
+    const struct search *s;
+    char *const *names;
+    int nfiles;
+    int next;
+    pthread_mutex_t lock;
+    size_t count;
+    size_t errors;
+};
+
+// One ring and the files it has in flight.
+struct uring_worker
+{
+    const struct search *s;
+    struct uring u;
+    struct uring_slot slots[URING_SLOTS];
+    int busy;               // slots in use
+    const char **deferred;  // left for search_file()
+    size_t ndeferred;
+    size_t count;
+    size_t errors;
+    struct outbuf *out;
+};
+
+static const char *uring_claim(struct uring_files *files)
+{
+    const char *name = NULL;
+    pthread_mutex_lock(&files->lock);
+    if (files->next < files->nfiles)
+    {
+        name = files->names[files->next++];
+    }
+    pthread_mutex_unlock(&files->lock);
+    return name;
+}
+
+static void uring_defer(struct uring_worker *w, const char *file_name)
+{
+    const char **d = (const char**)realloc(
+        w->deferred, (w->ndeferred + 1) * sizeof(char*));
+    if (!d)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+    }
+    w->deferred = d;
+    w->deferred[w->ndeferred++] = file_name;
+}
+
+// A submission entry for slot, tagged with op.
+static struct io_uring_sqe *uring_op(struct uring_worker *w,
+                                     struct uring_slot *slot,
+                                     enum uring_op op)
+{
+    struct io_uring_sqe *sqe;
+    while (!(sqe = uring_sqe(&w->u)))
+    {
+        // can't happen with two ops per slot, but be safe
+        uring_submit(&w->u, 0);
+    }
+    sqe->user_data = (uint64_t)(slot - w->slots) << 2 | op;
+    slot->pending++;
+    return sqe;
+}
+
+static void uring_start(struct uring_worker *w, struct uring_slot *slot,
+                        const char *file_name)
+{
+    slot->file_name = file_name;
+    slot->fd = -1;
+    slot->got = 0;
+    w->busy++;
+
+    struct io_uring_sqe *sqe = uring_op(w, slot, URING_OPEN);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)file_name;
+    sqe->open_flags = O_RDONLY;
+
+    // by name, so it doesn't have to wait for the open
+    sqe = uring_op(w, slot, URING_STAT);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)file_name;
+    sqe->len = STATX_TYPE | STATX_SIZE;
+    sqe->off = (uint64_t)(uintptr_t)&slot->stx;
+}
+
+static void uring_close(struct uring_worker *w, struct uring_slot *slot)
+{
+    struct io_uring_sqe *sqe = uring_op(w, slot, URING_CLOSE);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = slot->fd;
+}
+
+static void uring_read(struct uring_worker *w, struct uring_slot *slot)
+{
+    struct io_uring_sqe *sqe = uring_op(w, slot, URING_READ);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(slot->buf + slot->got);
+    sqe->len = (unsigned)(slot->stx.stx_size - slot->got);
+    sqe->off = slot->got;
+}
+
+static void uring_release(struct uring_worker *w, struct uring_slot *slot)
+{
+    slot->file_name = NULL;
+    w->busy--;
+}
+
+static void uring_error(struct uring_worker *w, const char *what,
+                        const char *file_name, int res)
+{
+    errno = -res;
+    report_error(what, file_name);
+    w->errors++;
+}
+
+// The open and stat are both back: read the file, or leave it for later.
+static void uring_opened(struct uring_worker *w, struct uring_slot *slot)
+{
+    if (slot->open_res < 0)
+    {
+        if (slot->open_res == -EINVAL)
+        {
+            // kernel too old for IORING_OP_OPENAT
+            uring_defer(w, slot->file_name);
+        }
+        else
+        {
+            uring_error(w, "Open", slot->file_name, slot->open_res);
+        }
+        uring_release(w, slot);
+        return;
+    }
+    if (slot->stat_res < 0)
+    {
+        if (slot->stat_res == -EINVAL)
+        {
+            uring_defer(w, slot->file_name);
+        }
+        else
+        {
+            uring_error(w, "Stat", slot->file_name, slot->stat_res);
+        }
+        uring_close(w, slot);
+        return;
+    }
+
+    size_t size = (size_t)slot->stx.stx_size;
+    if (S_ISDIR(slot->stx.stx_mode))
+    {
+        uring_close(w, slot);
+        return;
+    }
+    // one big enough to have a FILE.mgi is searched by search_file(),
+    // which uses the index rather than reading all of it
+    if (!S_ISREG(slot->stx.stx_mode) || (size == 0) ||
+        (size > URING_MAX_READ) ||
+        (w->s->use_index && (size >= GI_MIN_SIZE)))
+    {
+        uring_defer(w, slot->file_name);
+        uring_close(w, slot);
+        return;
+    }
+
+    if (slot->alloc < size)
+    {
+        uint8_t *buf = (uint8_t*)realloc(slot->buf, size);
+        if (!buf)
+        {
+            uring_error(w, "Buffer", slot->file_name, -ENOMEM);
+            uring_close(w, slot);
+            return;
+        }
+        slot->buf = buf;
+        slot->alloc = size;
+    }
+    uring_read(w, slot);
+}
+
+static void uring_complete(struct uring_worker *w, struct io_uring_cqe *cqe)
+{
+    struct uring_slot *slot = &w->slots[cqe->user_data >> 2];
+    enum uring_op op = (enum uring_op)(cqe->user_data & 3);
+    slot->pending--;
+
+    switch (op)
+    {
+        case URING_OPEN:
+            slot->open_res = cqe->res;
+            if (cqe->res >= 0)
+            {
+                slot->fd = cqe->res;
+            }
+            if (slot->pending == 0)
+            {
+                uring_opened(w, slot);
+            }
+            break;
+        case URING_STAT:
+            slot->stat_res = cqe->res;
+            if (slot->pending == 0)
+            {
+                uring_opened(w, slot);
+            }
+            break;
+        case URING_READ:
+            if (cqe->res < 0)
+            {
+                uring_error(w, "Read", slot->file_name, cqe->res);
+                uring_close(w, slot);
+                break;
+            }
+            slot->got += (size_t)cqe->res;
+            if ((cqe->res > 0) && (slot->got < slot->stx.stx_size))
+            {
+                // short read
+                uring_read(w, slot);
+                break;
+            }
+            if (total_done(w->s))
+            {
+                uring_close(w, slot);
+                break;
+            }
+            size_t start = (w->s->range_start < slot->got)
+                ? w->s->range_start : slot->got;
+            size_t end = (w->s->range_end < slot->got)
+                ? w->s->range_end : slot->got;
+            if (end < start)
+            {
+                end = start;
+            }
+            struct file_stats file_stats;
+            struct file_stats *stats = NULL;
+            if (w->s->stats)
+            {
+                stats = &file_stats;
+                stats_begin(stats);
+                stats->bytes = end - start;
+            }
+            struct search rare_s;
+            struct matcher rare_m;
+            const struct search *fs = rare_search(w->s, slot->buf + start,
+                                                  end - start, &rare_s,
+                                                  &rare_m);
+            size_t found = search_mapped(fs, slot->file_name, w->out,
+                                         slot->buf + start, start,
+                                         end - start, 0, stats);
+            finish_file(w->s, slot->file_name, w->out, found);
+            if (stats)
+            {
+                stats_end(w->s, slot->file_name, stats, found);
+            }
+            end_file_output(w->out, &w->errors);
+            w->count += found;
+            uring_close(w, slot);
+            break;
+        case URING_CLOSE:
+            if (cqe->res == -EINVAL)
+            {
+                // kernel too old for IORING_OP_CLOSE
+                close(slot->fd);
+            }
+            else if (cqe->res < 0)
+            {
+                uring_error(w, "Close", slot->file_name, cqe->res);
+            }
+            uring_release(w, slot);
+            break;
+    }
+}
+
+// Keep up to URING_SLOTS files in flight on one ring until every file
+// has been claimed, then search the ones that weren't small regular
+// files the ordinary way.
+static void uring_worker_run(void *arg)
+{
+    struct uring_files *files = (struct uring_files*)arg;
+    struct uring_worker *w =
+        (struct uring_worker*)calloc(1, sizeof(struct uring_worker));
+    struct outbuf *out = acquire_outbuf();
+    if (!w || !out)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+    }
+    w->s = files->s;
+    w->out = out;
+
+    const char *name = NULL;
+    if (uring_init(&w->u, 2 * URING_SLOTS) != 0)
+    {
+        // search this worker's share without the ring
+        while ((name = uring_claim(files)))
+        {
+            uring_defer(w, name);
+        }
+    }
+    else
+    {
+        int more = 1;
+        for (;;)
+        {
+            for (int i=0; more && (i<URING_SLOTS); i++)
+            {
+                if (w->slots[i].file_name)
+                {
+                    continue;
+                }
+                while ((name = uring_claim(files)) &&
+                       (strcmp(name, "-") == 0))
+                {
+                    uring_defer(w, name);
+                }
+                if (!name)
+                {
+                    more = 0;
+                    break;
+                }
+                uring_start(w, &w->slots[i], name);
+            }
+            if (w->busy == 0)
+            {
+                break;
+            }
+
+            int ret = uring_submit(&w->u, 1);
+            if (ret < 0)
+            {
+                errno = -ret;
+                perror("io_uring");
+                exit(2);
+            }
+            struct io_uring_cqe *cqe;
+            while ((cqe = uring_peek(&w->u)))
+            {
+                uring_complete(w, cqe);
+                uring_seen(&w->u);
+            }
+        }
+        uring_free(&w->u);
+    }
+
+    for (size_t i=0; i<w->ndeferred; i++)
     {
-        return c - 'A' + 10;
+        search_file(w->s, w->deferred[i], out, &w->count, &w->errors);
+        end_file_output(out, &w->errors);
+    }
+
+    pthread_mutex_lock(&files->lock);
+    files->count += w->count;
+    files->errors += w->errors;
+    pthread_mutex_unlock(&files->lock);
+
+    for (int i=0; i<URING_SLOTS; i++)
+    {
+        free(w->slots[i].buf);
+    }
+    free(w->deferred);
+    free(w);
+    release_outbuf(out);
+}
+
+// Search names through io_uring: one ring per worker, or one on this
+// thread.  Returns -1, having searched nothing, if the kernel has no
+// io_uring.
+static int search_files_uring(const struct search *s, char *const *names,
+                              int nfiles, size_t *count, size_t *errors)
+{
+    struct uring probe;
+    if (uring_init(&probe, 2) != 0)
+    {
+        return -1;
+    }
+    uring_free(&probe);
+
+    struct uring_files files;
+    memset(&files, 0, sizeof(files));
+    files.s = s;
+    files.names = names;
+    files.nfiles = nfiles;
+    pthread_mutex_init(&files.lock, NULL);
+
+    if (s->pool)
+    {
+        for (int i=0; i<s->jobs; i++)
+        {
+            if (pool_submit(s->pool, uring_worker_run, &files) != 0)
+            {
+                break;
+            }
+        }
+        pool_wait(s->pool);
+    }
+    else
+    {
+        uring_worker_run(&files);
+    }
+    pthread_mutex_destroy(&files.lock);
+
+    *count += files.count;
+    *errors += files.errors;
+    return 0;
+}
+
+#endif // HAVE_IO_URING
+
+// --index: write FILE.mgi next to each FILE, instead of searching.
+// Returns the exit status.
+static int build_indexes(char *const *names, int nfiles, int jobs)
+{
+    struct pool *pool = NULL;
+    if (jobs > 1)
+    {
+        pool = pool_create(jobs);
+        if (!pool)
+        {
+            fprintf(stderr, "Unable to start %d workers\n", jobs);
+            exit(2);
+        }
+    }
+    int status = 0;
+    for (int f=0; f<nfiles; f++)
+    {
+        char *path = gi_path(names[f]);
+        if (!path)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(2);
+        }
+        if (gi_build(names[f], path, pool, jobs) != 0)
+        {
+            report_error("Index", names[f]);
+            status = 2;
+        }
+        free(path);
+    }
+    if (pool)
+    {
+        pool_destroy(pool);
+    }
+    return status;
+}
+
+// getopt_long values for options with no short form
+enum
+{
+    OPT_DIRECT = 256,
+    OPT_CACHE_SIZE,
+    OPT_CHECKPOINT,
+    OPT_COMPILE,
+    OPT_EXCLUDE,
+    OPT_EXCLUDE_DIR,
+    OPT_FOLLOW,
+    OPT_FORMAT,
+    OPT_HUGEPAGES,
+    OPT_INCLUDE,
+    OPT_INDEX,
+    OPT_MAX_SIZE,
+    OPT_MAX_TOTAL,
+    OPT_MIN_SIZE,
+    OPT_NO_INDEX,
+    OPT_NOREUSE,
+    OPT_OVERLAP,
+    OPT_PATTERNS_DB,
+    OPT_POPULATE,
+    OPT_PREFETCH,
+    OPT_RANGE,
+    OPT_RARE_BYTE,
+    OPT_SERVE,
+    OPT_STATS,
+    OPT_URING,
+    OPT_WINDOW
+};
+
+// A --serve request's arguments, pointing into its buffer.
+struct request
+{
+    const char *cwd;
+    char **pats;
+    size_t npats;
+    char *db_file;              // absolute, from malloc(), or NULL
+    int flags;                  // PATTERN_*
+    int overlap;
+    size_t before;
+    size_t after;
+    int color;
+    enum output_mode mode;
+    enum output_format format;
+    size_t max_count;
+    size_t max_total;
+    size_t range_start;
+    size_t range_end;
+    int rare_byte;
+    int decompress;
+    int use_index;
+    char **files;
+    int nfiles;
+};
+
+// Read the options of a request, with the same meanings as on the command
+// line.  Returns 0, or the exit status for a request that makes no sense.
+static int parse_request(struct request *r, int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "count", no_argument, NULL, 'n' },
+        { "decompress", no_argument, NULL, 'z' },
+        { "files-with-matches", no_argument, NULL, 'l' },
+        { "format", required_argument, NULL, OPT_FORMAT },
+        { "ignore-case", no_argument, NULL, 'i' },
+        { "max-count", required_argument, NULL, 'm' },
+        { "max-total", required_argument, NULL, OPT_MAX_TOTAL },
+        { "no-index", no_argument, NULL, OPT_NO_INDEX },
+        { "offsets", no_argument, NULL, 'o' },
+        { "overlap", no_argument, NULL, OPT_OVERLAP },
+        { "patterns-db", required_argument, NULL, OPT_PATTERNS_DB },
+        { "range", required_argument, NULL, OPT_RANGE },
+        { "rare-byte", no_argument, NULL, OPT_RARE_BYTE },
+        { "wide", no_argument, NULL, 'w' },
+        { NULL, 0, NULL, 0 }
+    };
+    // getopt keeps its state in globals
+    static pthread_mutex_t getopt_lock = PTHREAD_MUTEX_INITIALIZER;
+    FILE *err = report_stream();
+    int hexlify = 1;
+    int fold = 0;
+    int wide = 0;
+    const char *db_file = NULL;
+    int status = 0;
+    int ch;
+    long n;
+
+    r->pats = (char**)calloc((size_t)argc, sizeof(char*));
+    if (!r->pats)
+    {
+        fprintf(err, "Out of memory\n");
+        return 2;
+    }
+    pthread_mutex_lock(&getopt_lock);
+    optind = 0;
+    opterr = 0;
+    while ((status == 0) &&
+           ((ch = getopt_long(argc, argv, "a:b:ce:Hilm:nowz", options,
+                              NULL)) != -1))
+    {
+        switch (ch)
+        {
+            case 'a':
+            case 'b':
+                n = strtol(optarg, NULL, 10);
+                if ((n > 0) && (n < 1024))
+                {
+                    *((ch == 'a') ? &r->after : &r->before) = (size_t)n;
+                }
+                break;
+            case 'c':
+                r->color++;
+                break;
+            case 'e':
+                r->pats[r->npats++] = optarg;
+                break;
+            case 'H':
+                hexlify = !hexlify;
+                break;
+            case 'i':
+                fold = 1;
+                break;
+            case 'l':
+                r->mode = OUTPUT_FILES;
+                break;
+            case 'm':
+            case OPT_MAX_TOTAL:
+                if (!parse_count(optarg, (ch == 'm') ? &r->max_count
+                                                     : &r->max_total))
+                {
+                    fprintf(err, "Invalid match count: %s\n", optarg);
+                    status = 64;
+                }
+                break;
+            case 'n':
+                r->mode = OUTPUT_COUNT;
+                break;
+            case 'o':
+                r->mode = OUTPUT_OFFSETS;
+                break;
+            case 'w':
+                wide = 1;
+                break;
+            case 'z':
+                r->decompress = 1;
+                break;
+            case OPT_FORMAT:
+                if (strcmp(optarg, "dump") == 0)
+                {
+                    r->format = FORMAT_DUMP;
+                }
+                else if (strcmp(optarg, "jsonl") == 0)
+                {
+                    r->format = FORMAT_JSONL;
+                }
+                else if (strcmp(optarg, "bin") == 0)
+                {
+                    r->format = FORMAT_BIN;
+                }
+                else
+                {
+                    fprintf(err, "Invalid format: %s\n", optarg);
+                    status = 64;
+                }
+                break;
+            case OPT_NO_INDEX:
+                r->use_index = 0;
+                break;
+            case OPT_OVERLAP:
+                r->overlap = 1;
+                break;
+            case OPT_PATTERNS_DB:
+                db_file = optarg;
+                break;
+            case OPT_RANGE:
+                if (!parse_range(optarg, &r->range_start, &r->range_end))
+                {
+                    fprintf(err, "Invalid range: %s\n", optarg);
+                    status = 64;
+                }
+                break;
+            case OPT_RARE_BYTE:
+                r->rare_byte = 1;
+                break;
+            default:
+                if ((optopt > 0) && (optopt < 256))
+                {
+                    fprintf(err, "Not an option for --serve: -%c\n",
+                            optopt);
+                }
+                else
+                {
+                    fprintf(err, "Not an option for --serve: %s\n",
+                            argv[optind - 1]);
+                }
+                status = 64;
+                break;
+        }
     }
-    fprintf(stderr, "Invalid input character: %c\n", c);
-    exit(1);
-}
-
-// calls malloc, please free result
-// returns NULL on error
-uint8_t *hex_decode(const char* word, size_t *hex_size)
-{
-    if (!word)
+    int first = optind;
+    pthread_mutex_unlock(&getopt_lock);
+    if (status != 0)
     {
-        return NULL;
+        return status;
     }
 
-    size_t wlen = strlen(word);
-    if (wlen == 0)
+    if ((r->format != FORMAT_DUMP) && (r->mode != OUTPUT_DUMP))
     {
-        return NULL;
+        fprintf(err, "--format is for printing matches, not -l, -n or "
+                "-o\n");
+        return 64;
     }
-
-    if (wlen%2 != 0)
+    if (db_file)
     {
-        // 2 chars per octet
-        return NULL;
+        if ((r->npats > 0) || fold || wide || !hexlify)
+        {
+            fprintf(err, "Give -e, -H, -i and -w to --compile, not "
+                    "--patterns-db\n");
+            return 64;
+        }
+        r->db_file = resolve_path(r->cwd, db_file);
+        if (!r->db_file)
+        {
+            fprintf(err, "Out of memory\n");
+            return 2;
+        }
     }
-
-    size_t ret_size = wlen / 2;
-    uint8_t *ret = (uint8_t*)malloc(ret_size);
-    for (size_t i=0; i<ret_size; i++)
+    else if ((r->npats == 0) && (first < argc))
     {
-        ret[i] = (hchar(word[2*i]) << 4) | hchar(word[2*i + 1]);
+        r->pats[r->npats++] = argv[first++];
     }
-    if (hex_size)
+    if ((!db_file && (r->npats == 0)) || (first == argc))
     {
-        *hex_size = ret_size;
+        fprintf(err, "A request needs patterns and FILEs\n");
+        return 64;
     }
-    return ret;
+    r->files = argv + first;
+    r->nfiles = argc - first;
+    r->flags = (hexlify ? 0 : PATTERN_LITERAL) | (fold ? PATTERN_FOLD : 0) |
+               (wide ? PATTERN_WIDE : 0);
+    return 0;
 }
 
-#define LINE_SIZE 16
-void print_match(const uint8_t *file, size_t offset, size_t pattern_size,
-                 size_t before, size_t after, int color)
+// Search r's files, printing to out_fd.  Returns the exit status.
+static int run_request(struct server *sv, const struct request *r,
+                       int out_fd)
 {
-    size_t start = offset - before;
-    size_t end = offset + pattern_size + after - 1;
-    size_t start_pad = start % LINE_SIZE;
-    size_t cur = start - start_pad;
-    int i;
-    char c;
+    struct serve_patterns p = {
+        r->pats, r->npats, r->db_file, r->flags, r->overlap
+    };
+    int status = 0;
+    struct serve_matcher *c = serve_compile(sv, &p, report_stream(),
+                                            &status);
+    if (!c)
+    {
+        return status;
+    }
+
+    size_t total = 0;
+    struct search s = {
+        .m = &c->m,
+        .before = r->before,
+        .after = r->after,
+        .color = (!isatty(out_fd) && r->color) ? r->color - 1 : r->color,
+        .direct = 0,
+        .window = 0,
+        .noreuse = 0,
+        .populate = 0,
+        .hugepages = 0,
+        .prefetch = 0,
+        .rare_byte = r->rare_byte,
+        .decompress = r->decompress,
+        .use_index = r->use_index,
+        .blocks = NULL,
+        .nblocks = 0,
+        .mode = r->mode,
+        .format = r->format,
+        .show_names = (r->nfiles > 1),
+        .stop_after = (r->mode == OUTPUT_FILES) ? 1 : r->max_count,
+        .max_total = r->max_total,
+        .total = &total,
+        .range_start = r->range_start,
+        .range_end = r->range_end,
+        .pool = sv->pool,
+        .jobs = sv->jobs,
+        .stats = NULL,
+        .maps = &sv->maps,
+        .dir = r->cwd
+    };
 
-    while (cur < end)
+    struct outbuf out;
+    size_t count = 0;
+    size_t errors = 0;
+    if (outbuf_init(&out, out_fd, NULL) != 0)
     {
-        printf("%08zx ", cur);
-        for (i=cur; i<(cur + LINE_SIZE); i++)
+        fprintf(report_stream(), "Out of memory\n");
+        serve_release(sv, c);
+        return 2;
+    }
+    if (r->format == FORMAT_BIN)
+    {
+        print_bin_header(&out);
+    }
+    for (int f=0; (f<r->nfiles) && !total_done(&s); f++)
+    {
+        if (strcmp(r->files[f], "-") == 0)
         {
-            if ((i < start) || (i > end))
-            {
-                printf("   ");
-            }
-            else
-            {
-                if (color && (i >= offset) && (i < offset + pattern_size))
-                {
-                    printf(" \x1b[2;31m%02x\x1b[0m", file[i]);
-                }
-                else
-                {
-                    printf(" %02x", file[i]);
-                }
-            }
+            fprintf(report_stream(), "--serve can't read standard input\n");
+            errors++;
+            continue;
         }
-        printf("  |");
-        for (i=cur; i<(cur + LINE_SIZE); i++)
+        search_file(&s, r->files[f], &out, &count, &errors);
+        if (out.error == EPIPE)
         {
-            if ((i < start) || (i > end))
-            {
-                printf(" ");
-            }
-            else
-            {
-                c = file[i];
-                if (color && (i >= offset) && (i < offset + pattern_size))
-                {
-                    printf("\x1b[2;31m");
-                }
-                if (isprint(c))
-                {
-                    printf("%c", file[i]);
-                }
-                else
-                {
-                    printf(".");
-                }
-                if (color && (i >= offset) && (i < offset + pattern_size))
-                {
-                    printf("\x1b[0m");
-                }
-            }
+            // nobody is reading; where mgrep itself would get SIGPIPE
+            break;
         }
-        printf("|\n");
-        cur += LINE_SIZE;
+        end_file_output(&out, &errors);
+    }
+    outbuf_free(&out);
+    serve_release(sv, c);
+    return (count > 0) ? 0 : (errors > 0) ? 2 : 1;
+}
+
+// Run a --serve request, with the same options as on the command line,
+// reporting errors to the client.  Returns the exit status.
+static int serve_run(struct server *sv, const struct serve_request *sr)
+{
+    pthread_once(&report_once, report_key_init);
+    void *outer = pthread_getspecific(report_key);
+    pthread_setspecific(report_key, sr->err);
+
+    struct request r;
+    memset(&r, 0, sizeof(r));
+    r.cwd = sr->cwd;
+    r.before = 16;
+    r.after = 16;
+    r.use_index = 1;
+    r.range_end = SIZE_MAX;
+    int status = parse_request(&r, sr->argc, sr->argv);
+    if (status == 0)
+    {
+        status = run_request(sv, &r, sr->out_fd);
     }
-    printf("\n");
+    free(r.pats);
+    free(r.db_file);
+    pthread_setspecific(report_key, outer);
+    return status;
 }
 
 int main(int argc, char *const argv[])
@@ -162,9 +2876,95 @@ int main(int argc, char *const argv[])
     size_t after = 16;
     int color = 0;
     bool hexlify = true;
+    int fold = 0;
+    int wide = 0;
+    int jobs = 1;
+    int direct = 0;
+    size_t window = 0;
+    int noreuse = 0;
+    int populate = 0;
+    int hugepages = 0;
+    size_t prefetch = 0;
+    int overlap = 0;
+    int rare_byte = 0;
+    int decompress = 0;
+    int build_index = 0;
+    int use_index = 1;
+    const char *serve_socket = NULL;
+    size_t cache_size = SERVE_CACHE;
+    int uring = 0;
+    int recursive = 0;
+    int follow = 0;
+    const char *checkpoint_file = NULL;
+    int stats = 0;
+    size_t max_count = 0;
+    size_t max_total = 0;
+    size_t total = 0;
+    size_t limit;
+    size_t range_start = 0;
+    size_t range_end = SIZE_MAX;
+    struct stats_total stats_total;
+    struct walk walk;
+    size_t size;
+    enum output_mode mode = OUTPUT_DUMP;
+    enum output_format format = FORMAT_DUMP;
+    struct pattern_list patterns = { NULL, 0, 0 };
+    char **pattern_files = NULL;
+    int npattern_files = 0;
+    const char *compile_file = NULL;
+    const char *db_file = NULL;
+    struct pattern_db db;
     int ch;
-    long ia, ib;
-    while ((ch = getopt(argc, argv, "a:b:chH")) != -1)
+    long ia, ib, ij;
+    memset(&walk, 0, sizeof(walk));
+    if ((argc >= 2) && (strcmp(argv[1], "--client") == 0))
+    {
+        // the rest is the server's to read
+        if (argc < 3)
+        {
+            usage();
+        }
+        return serve_client(argv[2], argc - 3, argv + 3);
+    }
+    static const struct option long_options[] = {
+        { "cache-size", required_argument, NULL, OPT_CACHE_SIZE },
+        { "checkpoint", required_argument, NULL, OPT_CHECKPOINT },
+        { "compile", required_argument, NULL, OPT_COMPILE },
+        { "count", no_argument, NULL, 'n' },
+        { "decompress", no_argument, NULL, 'z' },
+        { "direct", no_argument, NULL, OPT_DIRECT },
+        { "exclude", required_argument, NULL, OPT_EXCLUDE },
+        { "exclude-dir", required_argument, NULL, OPT_EXCLUDE_DIR },
+        { "follow", no_argument, NULL, OPT_FOLLOW },
+        { "format", required_argument, NULL, OPT_FORMAT },
+        { "hugepages", no_argument, NULL, OPT_HUGEPAGES },
+        { "include", required_argument, NULL, OPT_INCLUDE },
+        { "index", no_argument, NULL, OPT_INDEX },
+        { "max-count", required_argument, NULL, 'm' },
+        { "max-size", required_argument, NULL, OPT_MAX_SIZE },
+        { "max-total", required_argument, NULL, OPT_MAX_TOTAL },
+        { "min-size", required_argument, NULL, OPT_MIN_SIZE },
+        { "no-index", no_argument, NULL, OPT_NO_INDEX },
+        { "noreuse", no_argument, NULL, OPT_NOREUSE },
+        { "overlap", no_argument, NULL, OPT_OVERLAP },
+        { "patterns-db", required_argument, NULL, OPT_PATTERNS_DB },
+        { "populate", no_argument, NULL, OPT_POPULATE },
+        { "prefetch", required_argument, NULL, OPT_PREFETCH },
+        { "range", required_argument, NULL, OPT_RANGE },
+        { "rare-byte", no_argument, NULL, OPT_RARE_BYTE },
+        { "serve", required_argument, NULL, OPT_SERVE },
+        { "stats", no_argument, NULL, OPT_STATS },
+        { "uring", no_argument, NULL, OPT_URING },
+        { "window", required_argument, NULL, OPT_WINDOW },
+        { "files-with-matches", no_argument, NULL, 'l' },
+        { "ignore-case", no_argument, NULL, 'i' },
+        { "offsets", no_argument, NULL, 'o' },
+        { "recursive", no_argument, NULL, 'r' },
+        { "wide", no_argument, NULL, 'w' },
+        { NULL, 0, NULL, 0 }
+    };
+    while ((ch = getopt_long(argc, argv, "a:b:ce:f:hHij:lm:norwz",
+                             long_options, NULL)) != -1)
     {
         switch(ch)
         {
@@ -185,9 +2985,179 @@ int main(int argc, char *const argv[])
             case 'c':
                 color++;
                 break;
+            case 'e':
+                add_pattern(&patterns, optarg);
+                break;
+            case 'f':
+                // read after -H has had its say
+                pattern_files = (char**)realloc(pattern_files,
+                    (npattern_files + 1) * sizeof(char*));
+                if (!pattern_files)
+                {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(2);
+                }
+                pattern_files[npattern_files++] = optarg;
+                break;
             case 'H':
                 hexlify = !hexlify;
                 break;
+            case 'i':
+                fold = 1;
+                break;
+            case 'j':
+                ij = strtol(optarg, NULL, 10);
+                if ((ij > 0) && (ij < 1024))
+                {
+                    jobs = (int)ij;
+                }
+                break;
+            case OPT_CACHE_SIZE:
+                cache_size = parse_size(optarg);
+                if (cache_size == 0)
+                {
+                    fprintf(stderr, "Invalid cache size: %s\n", optarg);
+                    exit(64);
+                }
+                break;
+            case OPT_CHECKPOINT:
+                checkpoint_file = optarg;
+                break;
+            case OPT_COMPILE:
+                compile_file = optarg;
+                break;
+            case OPT_DIRECT:
+                direct = 1;
+                break;
+            case OPT_EXCLUDE:
+                add_glob(&walk.exclude, &walk.nexclude, optarg);
+                break;
+            case OPT_EXCLUDE_DIR:
+                add_glob(&walk.exclude_dir, &walk.nexclude_dir, optarg);
+                break;
+            case OPT_FOLLOW:
+                follow = 1;
+                break;
+            case OPT_FORMAT:
+                if (strcmp(optarg, "dump") == 0)
+                {
+                    format = FORMAT_DUMP;
+                }
+                else if (strcmp(optarg, "jsonl") == 0)
+                {
+                    format = FORMAT_JSONL;
+                }
+                else if (strcmp(optarg, "bin") == 0)
+                {
+                    format = FORMAT_BIN;
+                }
+                else
+                {
+                    fprintf(stderr, "Invalid format: %s\n", optarg);
+                    exit(64);
+                }
+                break;
+            case OPT_HUGEPAGES:
+                hugepages = 1;
+                break;
+            case OPT_INCLUDE:
+                add_glob(&walk.include, &walk.ninclude, optarg);
+                break;
+            case OPT_INDEX:
+                build_index = 1;
+                break;
+            case OPT_MAX_SIZE:
+            case OPT_MIN_SIZE:
+                size = parse_size(optarg);
+                if (size == 0)
+                {
+                    fprintf(stderr, "Invalid file size: %s\n", optarg);
+                    exit(64);
+                }
+                *((ch == OPT_MAX_SIZE) ? &walk.max_size : &walk.min_size) =
+                    size;
+                break;
+            case OPT_NO_INDEX:
+                use_index = 0;
+                break;
+            case OPT_NOREUSE:
+                noreuse = 1;
+                break;
+            case OPT_OVERLAP:
+                overlap = 1;
+                break;
+            case OPT_PATTERNS_DB:
+                db_file = optarg;
+                break;
+            case OPT_POPULATE:
+                populate = 1;
+                break;
+            case OPT_PREFETCH:
+                prefetch = parse_size(optarg);
+                if (prefetch == 0)
+                {
+                    fprintf(stderr, "Invalid prefetch size: %s\n", optarg);
+                    exit(64);
+                }
+                break;
+            case OPT_RANGE:
+                if (!parse_range(optarg, &range_start, &range_end))
+                {
+                    fprintf(stderr, "Invalid range: %s\n", optarg);
+                    exit(64);
+                }
+                break;
+            case OPT_RARE_BYTE:
+                rare_byte = 1;
+                break;
+            case OPT_SERVE:
+                serve_socket = optarg;
+                break;
+            case OPT_STATS:
+                stats = 1;
+                break;
+            case OPT_URING:
+#ifdef HAVE_IO_URING
+                uring = 1;
+#else
+                fprintf(stderr, "Built without io_uring, ignoring --uring\n");
+#endif
+                break;
+            case OPT_WINDOW:
+                window = parse_size(optarg);
+                if (window == 0)
+                {
+                    fprintf(stderr, "Invalid window size: %s\n", optarg);
+                    exit(64);
+                }
+                break;
+            case 'l':
+                mode = OUTPUT_FILES;
+                break;
+            case 'm':
+            case OPT_MAX_TOTAL:
+                if (!parse_count(optarg, &limit))
+                {
+                    fprintf(stderr, "Invalid match count: %s\n", optarg);
+                    exit(64);
+                }
+                *((ch == 'm') ? &max_count : &max_total) = limit;
+                break;
+            case 'n':
+                mode = OUTPUT_COUNT;
+                break;
+            case 'o':
+                mode = OUTPUT_OFFSETS;
+                break;
+            case 'r':
+                recursive = 1;
+                break;
+            case 'w':
+                wide = 1;
+                break;
+            case 'z':
+                decompress = 1;
+                break;
             case 'h':
             default:
                 usage();
@@ -200,118 +3170,354 @@ int main(int argc, char *const argv[])
         color--;
     }
 
+    if ((format != FORMAT_DUMP) && (mode != OUTPUT_DUMP))
+    {
+        fprintf(stderr, "--format is for printing matches, not -l, -n or "
+                "-o\n");
+        exit(64);
+    }
+
     argc -= optind;
     argv += optind;
 
-    if (argc < 2)
+    if (serve_socket)
     {
-        usage();
+        // requests bring their own patterns and files
+        if ((patterns.len > 0) || (npattern_files > 0) || db_file ||
+            compile_file || build_index || (argc > 0))
+        {
+            fprintf(stderr, "--serve takes a socket, not patterns or "
+                    "files\n");
+            exit(64);
+        }
+        return serve(serve_socket, jobs, cache_size, serve_run);
     }
 
-    size_t pattern_size = 0;
-    uint8_t *pattern;
-    if (hexlify)
+    if (build_index)
     {
-        pattern = hex_decode(argv[0], &pattern_size);
+        if ((patterns.len > 0) || (npattern_files > 0) || db_file ||
+            compile_file || (argc < 1))
+        {
+            fprintf(stderr, "--index takes files, not patterns\n");
+            exit(64);
+        }
+        return build_indexes(argv, argc, jobs);
     }
-    else
+
+    for (int i=0; i<npattern_files; i++)
+    {
+        read_patterns(&patterns, pattern_files[i]);
+    }
+    free(pattern_files);
+
+    if (db_file)
+    {
+        if ((patterns.len > 0) || (npattern_files > 0) || fold || wide ||
+            !hexlify)
+        {
+            fprintf(stderr, "Give -e, -f, -H, -i and -w to --compile, "
+                    "not --patterns-db\n");
+            exit(64);
+        }
+        if (db_open(&db, db_file) != 0)
+        {
+            if (errno == EINVAL)
+            {
+                fprintf(stderr, "Not a pattern db for this mgrep: %s\n",
+                        db_file);
+            }
+            else
+            {
+                report_error("Open", db_file);
+            }
+            exit(2);
+        }
+    }
+    else if ((patterns.len == 0) && (npattern_files == 0))
     {
-        pattern_size = strlen(argv[0]);
-        pattern = (uint8_t*)strndup(argv[0], pattern_size);
+        // HEXPATTERN is the first argument
+        if (argc < 1)
+        {
+            usage();
+        }
+        add_pattern(&patterns, argv[0]);
+        argc--;
+        argv++;
     }
 
-    if (!pattern)
+    if (!db_file && (patterns.len == 0))
     {
-        fprintf(stderr, "Invalid pattern\n");
+        usage();
     }
 
-    // initialize boyer-moore patterns
-    int *delta1 = (int*)malloc(ALPHABET_LEN * sizeof(int));
-    int *delta2 = (int*)malloc(pattern_size * sizeof(int));
-    make_delta1(delta1, pattern, pattern_size);
-    make_delta2(delta2, pattern, pattern_size);
+    static char *const read_stdin[] = { "-", NULL };
+    if (argc < 1)
+    {
+        argc = 1;
+        argv = read_stdin;
+    }
 
-    size_t count = 0;
-    size_t errors = 0;
-    for (int f=1; f<argc; f++)
+    if (follow || checkpoint_file)
     {
-        int first = 1;
-        const char *file_name = argv[f];
-        int fd = open(file_name, O_RDONLY);
-        if (fd < 0)
+        int named = 1;
+        for (int f=0; f<argc; f++)
         {
-            fprintf(stderr, "Open error ");
-            perror(file_name);
-            errors++;
-            continue;
+            named &= (strcmp(argv[f], "-") != 0);
+        }
+        if (!named || recursive || decompress || (range_start != 0) ||
+            (range_end != SIZE_MAX))
+        {
+            fprintf(stderr, "--follow and --checkpoint search named FILEs, "
+                    "without -r, -z or --range\n");
+            exit(64);
         }
+    }
+
+    const char *bad = NULL;
+    int flags = (hexlify ? 0 : PATTERN_LITERAL) | (fold ? PATTERN_FOLD : 0) |
+                (wide ? PATTERN_WIDE : 0);
+    switch (pattern_list_compile(&patterns, flags, &bad))
+    {
+        case PATTERN_OK:
+            break;
+        case PATTERN_INVALID:
+            fprintf(stderr, "Invalid pattern: %s\n", bad);
+            exit(64);
+        case PATTERN_MASK_MULTI:
+            fprintf(stderr, "Wildcards and masks need a single pattern: %s\n",
+                    bad);
+            exit(64);
+        case PATTERN_NOMEM:
+            fprintf(stderr, "Out of memory\n");
+            exit(2);
+    }
+
+    // build the search tables and pick an engine
+    struct matcher m;
+    int ret = db_file
+        ? matcher_init_ac(&m, db.pats, db.npats, db.fold,
+                          db.has_ac ? &db.ac : NULL)
+        : matcher_init(&m, patterns.pats, patterns.len, fold);
+    if (ret != 0)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+    }
+
+    if (overlap && (m.npats > 1))
+    {
+        fprintf(stderr, "--overlap needs a single pattern\n");
+        exit(64);
+    }
+    if (overlap && (matcher_set_overlap(&m) != 0))
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+    }
 
-        // Get the file size, to make mmap search the whole thing
-        struct stat file_stat;
-        if (fstat(fd, &file_stat) != 0)
+    if (compile_file)
+    {
+        // save the tables for --patterns-db, instead of searching
+        if (db_write(compile_file, &m) != 0)
         {
-            fprintf(stderr, "Stat error ");
-            perror(file_name);
-            errors++;
-            close(fd); // ignore error
-            continue;
+            report_error("Write", compile_file);
+            exit(2);
         }
+        matcher_free(&m);
+        if (db_file)
+        {
+            db_close(&db);
+        }
+        pattern_list_free(&patterns);
+        return 0;
+    }
 
-        size_t file_size = (size_t)file_stat.st_size;
-        if ((file_size == 0) || !S_ISREG(file_stat.st_mode))
+    struct search s = {
+        .m = &m,
+        .before = before,
+        .after = after,
+        .color = color,
+        .direct = direct,
+        .window = window,
+        .noreuse = noreuse,
+        .populate = populate,
+        .hugepages = hugepages,
+        .prefetch = prefetch,
+        .rare_byte = rare_byte,
+        .decompress = decompress,
+        .use_index = use_index,
+        .blocks = NULL,
+        .nblocks = 0,
+        .mode = mode,
+        .format = format,
+        .show_names = (argc > 1) || recursive,
+        .stop_after = (mode == OUTPUT_FILES) ? 1 : max_count,
+        .max_total = max_total,
+        .total = &total,
+        .range_start = range_start,
+        .range_end = range_end,
+        .pool = NULL,
+        .jobs = jobs,
+        .stats = NULL,
+        .maps = NULL,
+        .dir = NULL
+    };
+    uint64_t started = 0;
+    if (stats)
+    {
+        memset(&stats_total, 0, sizeof(stats_total));
+        pthread_mutex_init(&stats_total.lock, NULL);
+        s.stats = &stats_total;
+        started = stats_now();
+    }
+    if (jobs > 1)
+    {
+        s.pool = pool_create(jobs);
+        if (!s.pool)
         {
-            close(fd); // ignore error
-            continue;
+            fprintf(stderr, "Unable to start %d workers\n", jobs);
+            exit(2);
+        }
+        if (s.stats)
+        {
+            stats_total.nodes = (struct node_stats*)
+                calloc(pool_nodes(s.pool), sizeof(struct node_stats));
+            if (!stats_total.nodes)
+            {
+                fprintf(stderr, "Out of memory\n");
+                exit(2);
+            }
         }
+    }
 
-        const uint8_t *file = mmap(0, file_size, PROT_READ, MAP_SHARED, fd, 0);
-        if (file == MAP_FAILED)
+    if (format == FORMAT_BIN)
+    {
+        // once, ahead of all the workers' records
+        struct outbuf header;
+        if (outbuf_init(&header, STDOUT_FILENO, NULL) != 0)
         {
-            fprintf(stderr, "Mmap error ");
-            perror(file_name);
-            errors++;
-            close(fd); // ignore error
-            continue;
+            fprintf(stderr, "Out of memory\n");
+            exit(2);
         }
+        print_bin_header(&header);
+        outbuf_end_group(&header);
+        outbuf_free(&header);
+    }
+
+    size_t count = 0;
+    size_t errors = 0;
+    int nfiles = argc;
+    int done = 0;
+#ifdef HAVE_IO_URING
+    if (uring && !s.direct && !s.decompress && !recursive && !follow &&
+        !checkpoint_file && (nfiles > 1))
+    {
+        done = (search_files_uring(&s, argv, nfiles, &count, &errors) == 0);
+    }
+#endif
+    (void)uring;
 
+    if (done)
+    {
+        // searched through io_uring
+    }
+    else if (follow || checkpoint_file)
+    {
+        follow_files(&s, argv, nfiles, checkpoint_file, follow, &count,
+                     &errors);
+    }
+    else if (recursive)
+    {
+        if (search_recursive(&s, &walk, argv, nfiles, &count, &errors) != 0)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(2);
+        }
+    }
+    else if (s.pool && (nfiles > 1))
+    {
+        struct file_job *file_jobs =
+            (struct file_job*)calloc(nfiles, sizeof(struct file_job));
+        if (!file_jobs)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(2);
+        }
 
-        // Find all matches, don't worry about overlaps
-        size_t last = 0;
-        size_t next = 0;
-        while ((next = bm_search(file + last,
-                                 file_size - last,
-                                 pattern, pattern_size,
-                                 delta1, delta2)) != NOT_FOUND)
+        for (int f=0; f<nfiles; f++)
         {
-            if (first)
+            file_jobs[f].s = &s;
+            file_jobs[f].file_name = argv[f];
+            if (pool_submit(s.pool, file_job_run, &file_jobs[f]) != 0)
             {
-                first = 0;
-                printf("---- %s ----\n", file_name);
+                // run it here instead
+                file_job_run(&file_jobs[f]);
             }
-
-            print_match(file, last + next, pattern_size, before, after, color);
-            last += next + pattern_size;
-            count++;
         }
+        pool_wait(s.pool);
 
-        if (munmap((void*)file, file_size) != 0)
+        for (int f=0; f<nfiles; f++)
         {
-            fprintf(stderr, "Unmap error ");
-            perror(file_name);
-            errors++;
+            count += file_jobs[f].count;
+            errors += file_jobs[f].errors;
+        }
+        free(file_jobs);
+    }
+    else
+    {
+        struct outbuf out;
+        if (outbuf_init(&out, STDOUT_FILENO, NULL) != 0)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(2);
         }
 
-        if (close(fd) != 0)
+        // A single file is still cut into chunks for the pool if it is
+        // big enough.
+        for (int f=0; f<nfiles; f++)
         {
-            fprintf(stderr, "Close error ");
-            perror(file_name);
-            errors++;
+            search_file(&s, argv[f], &out, &count, &errors);
+            end_file_output(&out, &errors);
         }
+        outbuf_free(&out);
     }
 
-    free(delta2);
-    free(delta1);
-    free(pattern);
+    if (s.stats)
+    {
+        // wall clock time, so -j shows in the rate
+        char name[64];
+        char line[512];
+        stats_total.sum.elapsed_ns = stats_now() - started;
+        snprintf(name, sizeof(name), "total of %llu files",
+                 (unsigned long long)stats_total.sum.files);
+        stats_format(line, sizeof(line), name, &stats_total.sum);
+        fprintf(stderr, "stats %s\n", line);
+        for (int i=0; stats_total.nodes && (i<pool_nodes(s.pool)); i++)
+        {
+            if (stats_total.nodes[i].chunks > 0)
+            {
+                stats_format_node(line, sizeof(line),
+                                  pool_node_id(s.pool, i),
+                                  &stats_total.nodes[i]);
+                fprintf(stderr, "stats %s\n", line);
+            }
+        }
+        free(stats_total.nodes);
+        pthread_mutex_destroy(&stats_total.lock);
+    }
+    if (s.pool)
+    {
+        pool_destroy(s.pool);
+    }
+    matcher_free(&m);
+    if (db_file)
+    {
+        db_close(&db);
+    }
+    pattern_list_free(&patterns);
+    free(walk.include);
+    free(walk.exclude);
+    free(walk.exclude_dir);
 
     if (count > 0)
     {
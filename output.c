@@ -0,0 +1,455 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+#include "output.h"
+
+#define LINE_SIZE 16
+
+// Enough room for one dump line with every byte highlighted.
+#define MAX_LINE 512
+
+#define COLOR_ON "\x1b[2;31m"
+#define COLOR_OFF "\x1b[0m"
+
+static const char hex_digits[] = "0123456789abcdef";
+
+int outbuf_init(struct outbuf *o, int fd, pthread_mutex_t *lock)
+{
+    o->fd = fd;
+    o->buf = (char*)malloc(OUTBUF_SIZE);
+    o->len = 0;
+    o->lock = lock;
+    o->locked = 0;
+    o->error = 0;
+    o->iov = (struct iovec*)malloc(OUTBUF_IOV * sizeof(struct iovec));
+    o->niov = 0;
+    o->mark = 0;
+    o->refs = 0;
+    if (!o->buf || !o->iov)
+    {
+        outbuf_free(o);
+        return -1;
+    }
+    return 0;
+}
+
+void outbuf_free(struct outbuf *o)
+{
+    free(o->buf);
+    free(o->iov);
+    o->buf = NULL;
+    o->iov = NULL;
+}
+
+// Put what has been buffered since the last reference into iov.
+static void close_text(struct outbuf *o)
+{
+    if (o->len > o->mark)
+    {
+        o->iov[o->niov].iov_base = o->buf + o->mark;
+        o->iov[o->niov].iov_len = o->len - o->mark;
+        o->niov++;
+        o->mark = o->len;
+    }
+}
+
+static void write_all(struct outbuf *o)
+{
+    close_text(o);
+    struct iovec *iov = o->iov;
+    size_t niov = o->niov;
+    while ((niov > 0) && !o->error)
+    {
+        ssize_t n = writev(o->fd, iov, (int)niov);
+        if (n < 0)
+        {
+            if (errno != EINTR)
+            {
+                o->error = errno;
+            }
+            continue;
+        }
+        // past what was written, which can end mid-slice
+        size_t done = (size_t)n;
+        while ((niov > 0) && (done >= iov->iov_len))
+        {
+            done -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    o->len = 0;
+    o->niov = 0;
+    o->mark = 0;
+    o->refs = 0;
+}
+
+// Buffer is full mid-group: take the fd for the rest of the group.
+static void flush(struct outbuf *o)
+{
+    if (o->lock && !o->locked)
+    {
+        pthread_mutex_lock(o->lock);
+        o->locked = 1;
+    }
+    write_all(o);
+}
+
+void outbuf_write(struct outbuf *o, const void *data, size_t len)
+{
+    while (len > 0)
+    {
+        if (o->len == OUTBUF_SIZE)
+        {
+            flush(o);
+        }
+        size_t n = OUTBUF_SIZE - o->len;
+        if (n > len)
+        {
+            n = len;
+        }
+        memcpy(o->buf + o->len, data, n);
+        o->len += n;
+        data = (const char*)data + n;
+        len -= n;
+    }
+}
+
+void outbuf_ref(struct outbuf *o, const void *data, size_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+    // room for the text before it, and for the text after it when it
+    // is written
+    if ((o->niov + 3 > OUTBUF_IOV) || (o->refs >= OUTBUF_SIZE))
+    {
+        flush(o);
+    }
+    close_text(o);
+    o->iov[o->niov].iov_base = (void*)data;
+    o->iov[o->niov].iov_len = len;
+    o->niov++;
+    o->refs += len;
+}
+
+void outbuf_drop_refs(struct outbuf *o)
+{
+    if (o->refs > 0)
+    {
+        flush(o);
+    }
+}
+
+void outbuf_printf(struct outbuf *o, const char *fmt, ...)
+{
+    va_list ap;
+    char small[MAX_LINE];
+    va_start(ap, fmt);
+    int n = vsnprintf(small, sizeof(small), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+    {
+        return;
+    }
+    if ((size_t)n < sizeof(small))
+    {
+        outbuf_write(o, small, (size_t)n);
+        return;
+    }
+
+    char *big = (char*)malloc((size_t)n + 1);
+    if (!big)
+    {
+        o->error = ENOMEM;
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(big, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    outbuf_write(o, big, (size_t)n);
+    free(big);
+}
+
+void outbuf_end_group(struct outbuf *o)
+{
+    if ((o->len > 0) || (o->niov > 0))
+    {
+        if (o->lock && !o->locked)
+        {
+            pthread_mutex_lock(o->lock);
+            o->locked = 1;
+        }
+        write_all(o);
+    }
+    if (o->locked)
+    {
+        pthread_mutex_unlock(o->lock);
+        o->locked = 0;
+    }
+}
+
+// Make room for a line, returning where to format it.
+static char *line_start(struct outbuf *o)
+{
+    if (OUTBUF_SIZE - o->len < MAX_LINE)
+    {
+        flush(o);
+    }
+    return o->buf + o->len;
+}
+
+// "%08zx" without the printf.
+static char *put_offset(char *p, size_t offset)
+{
+    int digits = 8;
+    while ((digits < (int)(2 * sizeof(size_t))) &&
+           (offset >> (4 * digits)))
+    {
+        digits++;
+    }
+    for (int d = digits - 1; d >= 0; d--)
+    {
+        *p++ = hex_digits[(offset >> (4 * d)) & 0xf];
+    }
+    return p;
+}
+
+static char *put_str(char *p, const char *s, size_t len)
+{
+    memcpy(p, s, len);
+    return p + len;
+}
+
+void print_match(struct outbuf *o, const uint8_t *data, size_t data_offset,
+                 size_t data_len, size_t offset, size_t pattern_size,
+                 size_t before, size_t after, int color)
+{
+    size_t file_size = data_offset + data_len;
+    size_t start = (offset > before) ? offset - before : 0;
+    if (start < data_offset)
+    {
+        start = data_offset;
+    }
+    size_t end = offset + pattern_size + after - 1;
+    size_t start_pad = start % LINE_SIZE;
+    size_t cur = start - start_pad;
+    size_t i;
+
+    while ((cur < end) && (cur < file_size))
+    {
+        char *line = line_start(o);
+        char *p = put_offset(line, cur);
+        *p++ = ' ';
+        for (i=cur; i<(cur + LINE_SIZE); i++)
+        {
+            if ((i < start) || (i > end) || (i >= file_size))
+            {
+                p = put_str(p, "   ", 3);
+                continue;
+            }
+            int hi = color && (i >= offset) && (i < offset + pattern_size);
+            *p++ = ' ';
+            if (hi)
+            {
+                p = put_str(p, COLOR_ON, sizeof(COLOR_ON) - 1);
+            }
+            uint8_t c = data[i - data_offset];
+            *p++ = hex_digits[c >> 4];
+            *p++ = hex_digits[c & 0xf];
+            if (hi)
+            {
+                p = put_str(p, COLOR_OFF, sizeof(COLOR_OFF) - 1);
+            }
+        }
+        p = put_str(p, "  |", 3);
+        for (i=cur; i<(cur + LINE_SIZE); i++)
+        {
+            if ((i < start) || (i > end) || (i >= file_size))
+            {
+                *p++ = ' ';
+                continue;
+            }
+            int hi = color && (i >= offset) && (i < offset + pattern_size);
+            uint8_t c = data[i - data_offset];
+            if (hi)
+            {
+                p = put_str(p, COLOR_ON, sizeof(COLOR_ON) - 1);
+            }
+            // isprint() in the C locale
+            *p++ = ((c >= 0x20) && (c < 0x7f)) ? (char)c : '.';
+            if (hi)
+            {
+                p = put_str(p, COLOR_OFF, sizeof(COLOR_OFF) - 1);
+            }
+        }
+        p = put_str(p, "|\n", 2);
+        o->len += (size_t)(p - line);
+        cur += LINE_SIZE;
+    }
+    outbuf_write(o, "\n", 1);
+}
+
+// Clip [offset - before, offset + pattern_size + after) to the data, as
+// print_match does.
+static void context(size_t data_offset, size_t data_len, size_t offset,
+                    size_t pattern_size, size_t *before, size_t *after)
+{
+    if (*before > offset - data_offset)
+    {
+        *before = offset - data_offset;
+    }
+    size_t left = data_offset + data_len - (offset + pattern_size);
+    if (*after > left)
+    {
+        *after = left;
+    }
+}
+
+// "%zu" without the printf.
+static char *put_decimal(char *p, size_t n)
+{
+    char digits[24];
+    size_t i = sizeof(digits);
+    do
+    {
+        digits[--i] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n > 0);
+    return put_str(p, digits + i, sizeof(digits) - i);
+}
+
+// Hex digits for len bytes, formatted in the buffer.
+static void put_hex(struct outbuf *o, const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = (len < MAX_LINE / 2) ? len : MAX_LINE / 2;
+        char *p = line_start(o);
+        for (size_t i=0; i<n; i++)
+        {
+            *p++ = hex_digits[data[i] >> 4];
+            *p++ = hex_digits[data[i] & 0xf];
+        }
+        o->len += 2 * n;
+        data += n;
+        len -= n;
+    }
+}
+
+// s as a JSON string.  Bytes that aren't ASCII are passed through, so
+// names that aren't UTF-8 come out as they are on disk.
+static void put_json_string(struct outbuf *o, const char *s)
+{
+    outbuf_write(o, "\"", 1);
+    for (const char *run = s; ; s++)
+    {
+        uint8_t c = (uint8_t)*s;
+        if ((c >= 0x20) && (c != '"') && (c != '\\'))
+        {
+            continue;
+        }
+        outbuf_write(o, run, (size_t)(s - run));
+        if (c == 0)
+        {
+            break;
+        }
+        if ((c == '"') || (c == '\\'))
+        {
+            char esc[2] = { '\\', (char)c };
+            outbuf_write(o, esc, 2);
+        }
+        else
+        {
+            outbuf_printf(o, "\\u%04x", c);
+        }
+        run = s + 1;
+    }
+    outbuf_write(o, "\"", 1);
+}
+
+void print_match_json(struct outbuf *o, const char *file_name,
+                      size_t pattern, const uint8_t *data,
+                      size_t data_offset, size_t data_len, size_t offset,
+                      size_t pattern_size, size_t before, size_t after)
+{
+    context(data_offset, data_len, offset, pattern_size, &before, &after);
+    const uint8_t *match = data + (offset - data_offset);
+    outbuf_write(o, "{\"file\":", 8);
+    put_json_string(o, file_name);
+    char *line = line_start(o);
+    char *p = put_str(line, ",\"pattern\":", 11);
+    p = put_decimal(p, pattern);
+    p = put_str(p, ",\"offset\":", 10);
+    p = put_decimal(p, offset);
+    p = put_str(p, ",\"before\":\"", 11);
+    o->len += (size_t)(p - line);
+    put_hex(o, match - before, before);
+    outbuf_write(o, "\",\"match\":\"", 11);
+    put_hex(o, match, pattern_size);
+    outbuf_write(o, "\",\"after\":\"", 11);
+    put_hex(o, match + pattern_size, after);
+    outbuf_write(o, "\"}\n", 3);
+}
+
+static uint8_t *put_le32(uint8_t *p, uint32_t v)
+{
+    for (int i=0; i<4; i++)
+    {
+        *p++ = (uint8_t)(v >> (8 * i));
+    }
+    return p;
+}
+
+static uint8_t *put_le64(uint8_t *p, uint64_t v)
+{
+    for (int i=0; i<8; i++)
+    {
+        *p++ = (uint8_t)(v >> (8 * i));
+    }
+    return p;
+}
+
+void print_bin_header(struct outbuf *o)
+{
+    uint8_t header[12];
+    memcpy(header, BIN_MAGIC, 8);
+    put_le32(header + 8, BIN_VERSION);
+    outbuf_write(o, header, sizeof(header));
+}
+
+void print_match_bin(struct outbuf *o, const char *file_name,
+                     size_t pattern, const uint8_t *data,
+                     size_t data_offset, size_t data_len, size_t offset,
+                     size_t pattern_size, size_t before, size_t after)
+{
+    context(data_offset, data_len, offset, pattern_size, &before, &after);
+    size_t name_len = strlen(file_name);
+    uint8_t header[32];
+    uint8_t *p = put_le32(header, (uint32_t)(sizeof(header) - 4 + name_len +
+                                             before + pattern_size + after));
+    p = put_le32(p, (uint32_t)pattern);
+    p = put_le64(p, offset);
+    p = put_le32(p, (uint32_t)name_len);
+    p = put_le32(p, (uint32_t)before);
+    p = put_le32(p, (uint32_t)pattern_size);
+    put_le32(p, (uint32_t)after);
+    outbuf_write(o, header, sizeof(header));
+    outbuf_write(o, file_name, name_len);
+    outbuf_ref(o, data + (offset - before - data_offset),
+               before + pattern_size + after);
+}
@@ -0,0 +1,107 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/uio.h>
+
+// Output is formatted into a large buffer and handed to write(2) a
+// buffer at a time.  Each worker thread has its own.
+//
+// Buffers writing to a shared fd are given the lock that guards it.  A
+// group (normally one file's output) that fits in the buffer is written
+// in one go; one that does not takes the lock at its first flush and
+// keeps it until the group ends, so groups never interleave.
+//
+// Bytes that are already in memory somewhere, like the context of a
+// match in a mapped file, can be queued by reference instead of copied;
+// the buffer then goes out with writev(2).
+#define OUTBUF_SIZE ((size_t)1 << 20)
+#define OUTBUF_IOV 256
+
+struct outbuf
+{
+    int fd;
+    char *buf;
+    size_t len;
+    pthread_mutex_t *lock;  // NULL if fd is not shared
+    int locked;             // we hold lock for the rest of this group
+    int error;              // errno of the first failed write, or 0
+    struct iovec *iov;      // slices of buf and outbuf_ref()'d memory
+    size_t niov;
+    size_t mark;            // buf[mark, len) is not in iov yet
+    size_t refs;            // bytes outbuf_ref()'d since the last write
+};
+
+// How matches are printed when they are printed whole.
+enum output_format
+{
+    FORMAT_DUMP,        // print_match
+    FORMAT_JSONL,       // print_match_json
+    FORMAT_BIN          // print_bin_header, then print_match_bin
+};
+
+// Returns 0 on success.
+int outbuf_init(struct outbuf *o, int fd, pthread_mutex_t *lock);
+
+void outbuf_free(struct outbuf *o);
+
+void outbuf_write(struct outbuf *o, const void *data, size_t len);
+
+// Queue len bytes at data to be written from where they are, after
+// what is buffered so far.  They have to stay put until the next
+// outbuf_end_group() or outbuf_drop_refs().
+void outbuf_ref(struct outbuf *o, const void *data, size_t len);
+
+// Write out anything outbuf_ref() queued, so that its memory can go.
+void outbuf_drop_refs(struct outbuf *o);
+
+void outbuf_printf(struct outbuf *o, const char *fmt, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 2, 3)))
+#endif
+    ;
+
+// Write out everything buffered and let other groups have the fd.
+void outbuf_end_group(struct outbuf *o);
+
+// Hex dump [offset - before, offset + pattern_size + after), with the
+// match highlighted if color is set.  data holds the bytes at
+// [data_offset, data_offset + data_len) of the file; the dump is clipped
+// to those.
+void print_match(struct outbuf *o, const uint8_t *data, size_t data_offset,
+                 size_t data_len, size_t offset, size_t pattern_size,
+                 size_t before, size_t after, int color);
+
+// One JSON object per line:
+//   {"file":"NAME","pattern":N,"offset":N,
+//    "before":"HEX","match":"HEX","after":"HEX"}
+// pattern counts from 1, offset is the match's, and the context is
+// clipped as for print_match, so before and after may be short.
+void print_match_json(struct outbuf *o, const char *file_name,
+                      size_t pattern, const uint8_t *data,
+                      size_t data_offset, size_t data_len, size_t offset,
+                      size_t pattern_size, size_t before, size_t after);
+
+// --format=bin starts with BIN_MAGIC (8 bytes) and a little-endian
+// uint32_t BIN_VERSION, then has a record per match, all little-endian:
+//   uint32_t size          of the rest of the record
+//   uint32_t pattern       counting from 1
+//   uint64_t offset        of the match
+//   uint32_t name_len, before_len, match_len, after_len
+//   the file name, then the bytes before, of and after the match
+// The context and match are written straight from data, so it has to
+// stay put until the next outbuf_drop_refs().
+#define BIN_MAGIC "MGREPBIN"
+#define BIN_VERSION 1
+
+void print_bin_header(struct outbuf *o);
+
+void print_match_bin(struct outbuf *o, const char *file_name,
+                     size_t pattern, const uint8_t *data,
+                     size_t data_offset, size_t data_len, size_t offset,
+                     size_t pattern_size, size_t before, size_t after);
+
+#endif // OUTPUT_H
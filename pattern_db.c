@@ -0,0 +1,371 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "boyer_moore.h"
+#include "pattern_db.h"
+
+#define DB_ENDIAN 0x01020304
+#define DB_FOLD 1
+
+// Offsets are from the start of the file, and 0 means absent.
+struct db_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t word;          // sizeof(size_t)
+    uint32_t flags;
+    uint64_t size;          // of the whole file
+
+    uint64_t npats;
+    uint64_t pats;          // struct db_pattern[npats]
+
+    // Aho-Corasick, if nstates is non-zero
+    uint64_t nstates;
+    uint64_t ndense;
+    uint64_t dense;
+    uint64_t edge_start;
+    uint64_t labels;
+    uint64_t targets;
+    uint64_t fail;
+    uint64_t out;
+    uint64_t patlen;
+};
+
+struct db_pattern
+{
+    uint64_t bytes;
+    uint64_t mask;
+    uint64_t len;
+    uint64_t text;          // NUL terminated
+};
+
+struct writer
+{
+    FILE *f;
+    uint64_t off;
+};
+
+// Append len bytes at the next DB_ALIGN boundary, and return where they
+// went, or 0 on error.
+static uint64_t put(struct writer *w, const void *data, size_t len)
+{
+    static const uint8_t zeros[DB_ALIGN];
+    size_t pad = (DB_ALIGN - w->off % DB_ALIGN) % DB_ALIGN;
+    if ((fwrite(zeros, 1, pad, w->f) != pad) ||
+        (fwrite(data, 1, len, w->f) != len))
+    {
+        return 0;
+    }
+    uint64_t at = w->off + pad;
+    w->off = at + len;
+    return at;
+}
+
+int db_write(const char *file_name, const struct matcher *m)
+{
+    struct db_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DB_MAGIC, sizeof(DB_MAGIC));
+    h.version = DB_VERSION;
+    h.endian = DB_ENDIAN;
+    h.word = sizeof(size_t);
+    h.flags = m->fold ? DB_FOLD : 0;
+    h.npats = m->npats;
+
+    // written beside file_name and renamed over it, so searches that
+    // have the old db mapped keep their pages, and a failed write leaves
+    // the old one
+    size_t name_len = strlen(file_name);
+    char *tmp = (char*)malloc(name_len + sizeof(".tmp"));
+    struct db_pattern *dp =
+        (struct db_pattern*)calloc(m->npats, sizeof(struct db_pattern));
+    struct writer w = { NULL, 0 };
+    if (!tmp || !dp)
+    {
+        goto error;
+    }
+    memcpy(tmp, file_name, name_len);
+    memcpy(tmp + name_len, ".tmp", sizeof(".tmp"));
+    if (!(w.f = fopen(tmp, "wb")))
+    {
+        goto error;
+    }
+
+    // header first, rewritten with the offsets at the end
+    if (fwrite(&h, sizeof(h), 1, w.f) != 1)
+    {
+        goto error;
+    }
+    w.off = sizeof(h);
+
+    for (size_t i=0; i<m->npats; i++)
+    {
+        const struct pattern *p = &m->pats[i];
+        dp[i].len = p->len;
+        dp[i].bytes = put(&w, p->bytes, p->len);
+        dp[i].text = put(&w, p->text, strlen(p->text) + 1);
+        if (!dp[i].bytes || !dp[i].text)
+        {
+            goto error;
+        }
+        if (p->mask && !(dp[i].mask = put(&w, p->mask, p->len)))
+        {
+            goto error;
+        }
+    }
+    if (!(h.pats = put(&w, dp, m->npats * sizeof(struct db_pattern))))
+    {
+        goto error;
+    }
+
+    const struct ac *a = m->ac;
+    if (a)
+    {
+        uint32_t nedges = a->edge_start[a->nstates];
+        h.nstates = a->nstates;
+        h.ndense = a->ndense;
+        if (!(h.dense = put(&w, a->dense, (size_t)a->ndense * ALPHABET_LEN *
+                                          sizeof(uint32_t))) ||
+            !(h.edge_start = put(&w, a->edge_start,
+                                 (a->nstates + 1) * sizeof(uint32_t))) ||
+            !(h.labels = put(&w, a->labels, nedges ? nedges : 1)) ||
+            !(h.targets = put(&w, a->targets,
+                              (nedges ? nedges : 1) * sizeof(uint32_t))) ||
+            !(h.fail = put(&w, a->fail, a->nstates * sizeof(uint32_t))) ||
+            !(h.out = put(&w, a->out, a->nstates * sizeof(int32_t))) ||
+            !(h.patlen = put(&w, a->patlen, m->npats * sizeof(size_t))))
+        {
+            goto error;
+        }
+    }
+
+    h.size = w.off;
+    if ((fseek(w.f, 0, SEEK_SET) != 0) ||
+        (fwrite(&h, sizeof(h), 1, w.f) != 1) ||
+        (fflush(w.f) != 0) || (fsync(fileno(w.f)) != 0))
+    {
+        goto error;
+    }
+    FILE *f = w.f;
+    w.f = NULL;
+    if ((fclose(f) != 0) || (rename(tmp, file_name) != 0))
+    {
+        goto error;
+    }
+    free(tmp);
+    free(dp);
+    return 0;
+
+error:
+    {
+        int saved = errno;
+        if (w.f)
+        {
+            fclose(w.f);
+        }
+        if (tmp)
+        {
+            unlink(tmp);
+        }
+        free(tmp);
+        free(dp);
+        errno = saved ? saved : EIO;
+    }
+    return -1;
+}
+
+// Non-zero if [off, off + len) lies within a file of size bytes.
+static int inside(const struct pattern_db *db, uint64_t off, uint64_t len)
+{
+    return (off != 0) && (off <= db->size) && (len <= db->size - off);
+}
+
+// Non-zero if an array of count items of size bytes, aligned for them,
+// lies within the file.
+static int inside_array(const struct pattern_db *db, uint64_t off,
+                        uint64_t count, uint64_t size)
+{
+    return (count <= UINT64_MAX / size) && (off % size == 0) &&
+           inside(db, off, count * size);
+}
+
+// Non-zero if the automaton's tables are safe to search with: every
+// state, edge and pattern index in range, edges sorted and leading to
+// later states, which each have one parent, failure links leading back
+// to earlier, shallower ones so that following them ends at the root, no
+// transition deeper than one byte on, and each state's output no longer
+// than the path to it, so that a match never starts before the text.
+// Anything else wrong with it can only make it find the wrong things.
+static int ac_valid(const struct pattern_db *db, const struct ac *a)
+{
+    uint32_t n = a->nstates;
+    uint32_t *depth = (uint32_t*)calloc(n, sizeof(uint32_t));
+    if (!depth)
+    {
+        return 0;
+    }
+    int ok = (a->edge_start[0] == 0) && (a->fail[0] == 0);
+    for (uint32_t k=0; ok && (k<n); k++)
+    {
+        ok = (a->edge_start[k] <= a->edge_start[k + 1]) &&
+             ((k == 0) || ((a->fail[k] < k) &&
+                           (depth[a->fail[k]] < depth[k])));
+        for (uint32_t e = a->edge_start[k];
+             ok && (e < a->edge_start[k + 1]); e++)
+        {
+            uint32_t t = a->targets[e];
+            ok = (t > k) && (t < n) && (depth[t] == 0) &&
+                 ((e == a->edge_start[k]) || (a->labels[e - 1] < a->labels[e]));
+            if (ok)
+            {
+                depth[t] = depth[k] + 1;
+            }
+        }
+        int32_t out = a->out[k];
+        ok = ok && ((out == -1) ||
+                    ((out >= 0) && ((size_t)out < db->npats) &&
+                     (a->patlen[out] == db->pats[out].len) &&
+                     (a->patlen[out] <= depth[k])));
+    }
+    for (size_t i=0; ok && (i < (size_t)a->ndense * ALPHABET_LEN); i++)
+    {
+        ok = (a->dense[i] < n) &&
+             (depth[a->dense[i]] <= depth[i / ALPHABET_LEN] + 1);
+    }
+    free(depth);
+    return ok;
+}
+
+int db_open(struct pattern_db *db, const char *file_name)
+{
+    memset(db, 0, sizeof(*db));
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct db_header))
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    db->size = (size_t)st.st_size;
+    db->map = mmap(NULL, db->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (db->map == MAP_FAILED)
+    {
+        db->map = NULL;
+        return -1;
+    }
+
+    const uint8_t *base = (const uint8_t*)db->map;
+    const struct db_header *h = (const struct db_header*)base;
+    if ((memcmp(h->magic, DB_MAGIC, sizeof(DB_MAGIC)) != 0) ||
+        (h->version != DB_VERSION) || (h->endian != DB_ENDIAN) ||
+        (h->word != sizeof(size_t)) || (h->size != db->size) ||
+        (h->npats == 0) || (h->npats > INT32_MAX) ||
+        !inside_array(db, h->pats, h->npats, sizeof(struct db_pattern)))
+    {
+        goto invalid;
+    }
+
+    db->npats = h->npats;
+    db->fold = (h->flags & DB_FOLD) != 0;
+    db->pats = (struct pattern*)calloc(db->npats, sizeof(struct pattern));
+    if (!db->pats)
+    {
+        db_close(db);
+        errno = ENOMEM;
+        return -1;
+    }
+    const struct db_pattern *dp = (const struct db_pattern*)(base + h->pats);
+    for (size_t i=0; i<db->npats; i++)
+    {
+        if ((dp[i].len == 0) || (dp[i].len > SIZE_MAX / 2) ||
+            !inside(db, dp[i].bytes, dp[i].len) ||
+            !inside(db, dp[i].text, 1) ||
+            (dp[i].mask && !inside(db, dp[i].mask, dp[i].len)) ||
+            !memchr(base + dp[i].text, 0, db->size - dp[i].text))
+        {
+            goto invalid;
+        }
+        // the mapping is read-only; struct pattern just isn't const
+        db->pats[i].bytes = (uint8_t*)(base + dp[i].bytes);
+        db->pats[i].mask = dp[i].mask ? (uint8_t*)(base + dp[i].mask) : NULL;
+        db->pats[i].len = dp[i].len;
+        db->pats[i].text = (const char*)(base + dp[i].text);
+    }
+
+    if (h->nstates)
+    {
+        uint64_t n = h->nstates;
+        if ((n >= UINT32_MAX) || (h->ndense > n) || (h->ndense == 0) ||
+            (h->ndense > UINT64_MAX / ALPHABET_LEN) ||
+            !inside_array(db, h->dense, h->ndense * ALPHABET_LEN, 4) ||
+            !inside_array(db, h->edge_start, n + 1, 4) ||
+            !inside_array(db, h->fail, n, 4) ||
+            !inside_array(db, h->out, n, 4) ||
+            !inside_array(db, h->patlen, db->npats, sizeof(size_t)))
+        {
+            goto invalid;
+        }
+        const uint32_t *edge_start = (const uint32_t*)(base + h->edge_start);
+        uint64_t nedges = edge_start[n];
+        if (!inside(db, h->labels, nedges) ||
+            !inside_array(db, h->targets, nedges, 4))
+        {
+            goto invalid;
+        }
+        db->has_ac = 1;
+        db->ac.nstates = (uint32_t)n;
+        db->ac.ndense = (uint32_t)h->ndense;
+        db->ac.dense = (uint32_t*)(base + h->dense);
+        db->ac.edge_start = (uint32_t*)(base + h->edge_start);
+        db->ac.labels = (uint8_t*)(base + h->labels);
+        db->ac.targets = (uint32_t*)(base + h->targets);
+        db->ac.fail = (uint32_t*)(base + h->fail);
+        db->ac.out = (int32_t*)(base + h->out);
+        db->ac.patlen = (const size_t*)(base + h->patlen);
+        db->ac.fold = db->fold;
+        if (!ac_valid(db, &db->ac))
+        {
+            goto invalid;
+        }
+    }
+    else if (db->npats > 1)
+    {
+        goto invalid;
+    }
+    return 0;
+
+invalid:
+    db_close(db);
+    errno = EINVAL;
+    return -1;
+}
+
+void db_close(struct pattern_db *db)
+{
+    free(db->pats);
+    if (db->map)
+    {
+        munmap(db->map, db->size);
+    }
+    memset(db, 0, sizeof(*db));
+}
@@ -0,0 +1,45 @@
+#ifndef PATTERN_DB_H
+#define PATTERN_DB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aho_corasick.h"
+#include "matcher.h"
+
+// A compiled pattern set on disk, written by --compile and mapped by
+// --patterns-db.  It holds the patterns as searched (after -i and -w)
+// and, for several patterns, the Aho-Corasick automaton, laid out so
+// that the tables are used straight from the mapping.  Single pattern
+// tables are quick enough to build that they are not stored.
+//
+// The format is native byte order and word size; a file from another
+// kind of machine, or another version, is refused, as is one whose
+// offsets, sizes or automaton indices would take a search outside it.
+#define DB_MAGIC "MGREPDB"
+#define DB_VERSION 1
+#define DB_ALIGN 64
+
+struct pattern_db
+{
+    void *map;
+    size_t size;
+    struct pattern *pats;   // bytes, masks and text point into map
+    size_t npats;
+    int fold;               // compiled with -i
+    struct ac ac;           // tables point into map
+    int has_ac;
+};
+
+// Write pats, compiled into m, to file_name.tmp and rename it over
+// file_name, so a db that's in use is replaced rather than truncated.
+// Returns 0, or -1 with errno set.
+int db_write(const char *file_name, const struct matcher *m);
+
+// Map file_name.  Returns 0, or -1 with errno set; EINVAL means the file
+// is not a pattern db this build can use.
+int db_open(struct pattern_db *db, const char *file_name);
+
+void db_close(struct pattern_db *db);
+
+#endif // PATTERN_DB_H
@@ -0,0 +1,310 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fold.h"
+#include "patterns.h"
+
+// Value of hex digit c, or -1.
+static int hchar(char c)
+{
+    if ((c >= '0') && (c <= '9'))
+    {
+        return c - '0';
+    }
+    if ((c >= 'a') && (c <= 'f'))
+    {
+        return c - 'a' + 10;
+    }
+    if ((c >= 'A') && (c <= 'F'))
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+uint8_t *hex_decode(const char* word, size_t *hex_size)
+{
+    if (!word)
+    {
+        return NULL;
+    }
+
+    size_t wlen = strlen(word);
+    if (wlen == 0)
+    {
+        return NULL;
+    }
+
+    if (wlen%2 != 0)
+    {
+        // 2 chars per octet
+        return NULL;
+    }
+
+    size_t ret_size = wlen / 2;
+    uint8_t *ret = (uint8_t*)malloc(ret_size);
+    if (!ret)
+    {
+        return NULL;
+    }
+    for (size_t i=0; i<ret_size; i++)
+    {
+        int hi = hchar(word[2*i]);
+        int lo = hchar(word[2*i + 1]);
+        if ((hi < 0) || (lo < 0))
+        {
+            free(ret);
+            return NULL;
+        }
+        ret[i] = (uint8_t)((hi << 4) | lo);
+    }
+    if (hex_size)
+    {
+        *hex_size = ret_size;
+    }
+    return ret;
+}
+
+uint8_t *hex_decode_masked(const char *word, size_t *hex_size,
+                           uint8_t **mask)
+{
+    *mask = NULL;
+    if (!word)
+    {
+        return NULL;
+    }
+
+    const char *slash = strchr(word, '/');
+    size_t wlen = slash ? (size_t)(slash - word) : strlen(word);
+    if ((wlen == 0) || (wlen%2 != 0))
+    {
+        return NULL;
+    }
+
+    size_t ret_size = wlen / 2;
+    uint8_t *ret = (uint8_t*)malloc(ret_size);
+    uint8_t *m = (uint8_t*)malloc(ret_size);
+    if (!ret || !m)
+    {
+        free(ret);
+        free(m);
+        return NULL;
+    }
+    for (size_t i=0; i<2*ret_size; i++)
+    {
+        uint8_t nibble = 0;
+        uint8_t bits = 0;
+        if (word[i] != '?')
+        {
+            int h = hchar(word[i]);
+            if (h < 0)
+            {
+                free(ret);
+                free(m);
+                return NULL;
+            }
+            nibble = (uint8_t)h;
+            bits = 0xf;
+        }
+        int shift = (i%2 == 0) ? 4 : 0;
+        if (shift)
+        {
+            ret[i/2] = 0;
+            m[i/2] = 0;
+        }
+        ret[i/2] |= nibble << shift;
+        m[i/2] |= bits << shift;
+    }
+
+    if (slash)
+    {
+        size_t mask_size = 0;
+        uint8_t *given = hex_decode(slash + 1, &mask_size);
+        if (!given || (mask_size != ret_size))
+        {
+            free(given);
+            free(ret);
+            free(m);
+            return NULL;
+        }
+        for (size_t i=0; i<ret_size; i++)
+        {
+            m[i] &= given[i];
+        }
+        free(given);
+    }
+
+    int exact = 1;
+    for (size_t i=0; i<ret_size; i++)
+    {
+        ret[i] &= m[i];
+        if (m[i] != 0xff)
+        {
+            exact = 0;
+        }
+    }
+    if (exact)
+    {
+        free(m);
+    }
+    else
+    {
+        *mask = m;
+    }
+    *hex_size = ret_size;
+    return ret;
+}
+
+int pattern_list_add(struct pattern_list *l, const char *text)
+{
+    if (l->len == l->alloc)
+    {
+        size_t alloc = l->alloc ? 2 * l->alloc : 16;
+        struct pattern *pats = (struct pattern*)realloc(
+            l->pats, alloc * sizeof(struct pattern));
+        if (!pats)
+        {
+            return -1;
+        }
+        l->pats = pats;
+        l->alloc = alloc;
+    }
+    char *copy = strdup(text);
+    if (!copy)
+    {
+        return -1;
+    }
+    l->pats[l->len].bytes = NULL;
+    l->pats[l->len].mask = NULL;
+    l->pats[l->len].len = 0;
+    l->pats[l->len].text = copy;
+    l->len++;
+    return 0;
+}
+
+// Fold p to lower case for -i.  Where a mask is given, letters that must
+// match exactly are masked down to the bits they share with their twin.
+static void fold_pattern(struct pattern *p)
+{
+    for (size_t i=0; i<p->len; i++)
+    {
+        if (!p->mask)
+        {
+            p->bytes[i] = fold_byte(p->bytes[i]);
+        }
+        else if ((p->mask[i] == 0xff) && fold_is_alpha(p->bytes[i]))
+        {
+            p->mask[i] = 0xdf;
+            p->bytes[i] &= 0xdf;
+        }
+    }
+}
+
+// For -w, add the UTF-16LE form of each pattern in l: every byte
+// followed by a zero byte, as Windows stores ASCII text.
+static int add_wide_patterns(struct pattern_list *l)
+{
+    static const char suffix[] = " (UTF-16LE)";
+    size_t narrow = l->len;
+    for (size_t i=0; i<narrow; i++)
+    {
+        size_t textlen = strlen(l->pats[i].text);
+        char *text = (char*)malloc(textlen + sizeof(suffix));
+        if (!text)
+        {
+            return -1;
+        }
+        memcpy(text, l->pats[i].text, textlen);
+        memcpy(text + textlen, suffix, sizeof(suffix));
+        int ret = pattern_list_add(l, text);
+        free(text);
+        if (ret != 0)
+        {
+            return -1;
+        }
+
+        const struct pattern *from = &l->pats[i];
+        struct pattern *to = &l->pats[l->len - 1];
+        to->len = 2 * from->len;
+        to->bytes = (uint8_t*)calloc(1, to->len);
+        if (from->mask)
+        {
+            to->mask = (uint8_t*)malloc(to->len);
+        }
+        if (!to->bytes || (from->mask && !to->mask))
+        {
+            return -1;
+        }
+        for (size_t j=0; j<from->len; j++)
+        {
+            to->bytes[2*j] = from->bytes[j];
+            if (to->mask)
+            {
+                to->mask[2*j] = from->mask[j];
+                to->mask[2*j + 1] = 0xff;
+            }
+        }
+    }
+    return 0;
+}
+
+enum pattern_error pattern_list_compile(struct pattern_list *l, int flags,
+                                        const char **bad)
+{
+    *bad = NULL;
+    for (size_t i=0; i<l->len; i++)
+    {
+        struct pattern *p = &l->pats[i];
+        if (flags & PATTERN_LITERAL)
+        {
+            p->len = strlen(p->text);
+            p->bytes = (uint8_t*)strndup(p->text, p->len);
+            if (!p->bytes)
+            {
+                return PATTERN_NOMEM;
+            }
+        }
+        else
+        {
+            p->bytes = hex_decode_masked(p->text, &p->len, &p->mask);
+        }
+
+        if (!p->bytes || (p->len == 0))
+        {
+            *bad = p->text;
+            return PATTERN_INVALID;
+        }
+        if (flags & PATTERN_FOLD)
+        {
+            fold_pattern(p);
+        }
+    }
+    if ((flags & PATTERN_WIDE) && (add_wide_patterns(l) != 0))
+    {
+        return PATTERN_NOMEM;
+    }
+    for (size_t i=0; i<l->len; i++)
+    {
+        if (l->pats[i].mask && (l->len > 1))
+        {
+            *bad = l->pats[i].text;
+            return PATTERN_MASK_MULTI;
+        }
+    }
+    return PATTERN_OK;
+}
+
+void pattern_list_free(struct pattern_list *l)
+{
+    for (size_t i=0; i<l->len; i++)
+    {
+        free(l->pats[i].mask);
+        free(l->pats[i].bytes);
+        free((char*)l->pats[i].text);
+    }
+    free(l->pats);
+    l->pats = NULL;
+    l->len = 0;
+    l->alloc = 0;
+}
@@ -0,0 +1,53 @@
+#ifndef PATTERNS_H
+#define PATTERNS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "matcher.h"
+
+// How pattern_list_compile reads the texts.
+#define PATTERN_LITERAL 1   // text is the bytes, not HEXPATTERN (-H)
+#define PATTERN_FOLD 2      // ignore ASCII case (-i)
+#define PATTERN_WIDE 4      // also search the UTF-16LE form (-w)
+
+enum pattern_error
+{
+    PATTERN_OK,
+    PATTERN_INVALID,        // not HEXPATTERN syntax, or empty
+    PATTERN_MASK_MULTI,     // a mask or wildcard alongside other patterns
+    PATTERN_NOMEM
+};
+
+struct pattern_list
+{
+    struct pattern *pats;
+    size_t len;
+    size_t alloc;
+};
+
+// Decode word as hex.
+// calls malloc, please free result
+// returns NULL on error
+uint8_t *hex_decode(const char* word, size_t *hex_size);
+
+// Like hex_decode, but a ? in place of a hex digit matches any nibble,
+// and a /MASK suffix, in hex and as long as the pattern, gives the bits
+// that must match: 4d5a??00 or 4d5a0000/ffff00ff.  Sets *mask to NULL if
+// every bit must match.  Pattern bytes come back with the free bits
+// cleared.
+uint8_t *hex_decode_masked(const char *word, size_t *hex_size,
+                           uint8_t **mask);
+
+// Remember a copy of text as a pattern, to be compiled later.  Returns 0,
+// or -1 if out of memory.
+int pattern_list_add(struct pattern_list *l, const char *text);
+
+// Turn every text in l into bytes and masks, as flags say.  On error,
+// sets *bad to the text at fault, if there is one.
+enum pattern_error pattern_list_compile(struct pattern_list *l, int flags,
+                                        const char **bad);
+
+void pattern_list_free(struct pattern_list *l);
+
+#endif // PATTERNS_H
@@ -0,0 +1,428 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef HAVE_NUMA
+#include <numa.h>
+#include <sched.h>
+#endif
+
+#include "pool.h"
+
+struct task
+{
+    pool_fn fn;
+    void *arg;
+    struct pool_group *group;
+    struct task *next;
+};
+
+// Tasks for one node's workers, which the others take when they run out.
+struct queue
+{
+    struct task *head;
+    struct task *tail;
+    pthread_cond_t work;    // signalled when a task is queued here, or
+                            // for this node's workers to take another's
+    int waiting;            // this node's workers waiting on work, and
+    int signals;            // not yet woken by one of these
+    int id;                 // the system's number for the node
+};
+
+struct pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t idle;    // signalled when pending, or any group's
+                            // pending, drops to zero
+    struct queue *queues;   // one per node, then one for tasks that can
+                            // run anywhere
+    int nnodes;
+    size_t pending;         // queued plus running
+    int shutdown;
+    int nthreads;
+    pthread_t *threads;
+    pthread_key_t self;     // a worker's node plus one
+};
+
+struct start
+{
+    struct pool *p;
+    int node;
+};
+
+// Find the nodes there are CPUs to run on, into p->queues[].id.  Without
+// NUMA, or with a single node, that is one node, and nothing is pinned.
+static int find_nodes(struct pool *p)
+{
+    p->nnodes = 1;
+#ifdef HAVE_NUMA
+    if (numa_available() < 0)
+    {
+        return 0;
+    }
+    int max = numa_max_node();
+    struct bitmask *cpus = numa_allocate_cpumask();
+    int *ids = (int*)calloc(max + 1, sizeof(int));
+    if (!cpus || !ids)
+    {
+        numa_bitmask_free(cpus);
+        free(ids);
+        return -1;
+    }
+    int n = 0;
+    for (int node=0; node<=max; node++)
+    {
+        if (!numa_bitmask_isbitset(numa_all_nodes_ptr, node) ||
+            (numa_node_to_cpus(node, cpus) != 0))
+        {
+            continue;
+        }
+        for (unsigned int cpu=0; cpu<cpus->size; cpu++)
+        {
+            if (numa_bitmask_isbitset(cpus, cpu) &&
+                numa_bitmask_isbitset(numa_all_cpus_ptr, cpu))
+            {
+                ids[n++] = node;
+                break;
+            }
+        }
+    }
+    numa_bitmask_free(cpus);
+    if (n > 1)
+    {
+        p->nnodes = n;
+    }
+    p->queues = (struct queue*)calloc(p->nnodes + 1, sizeof(struct queue));
+    if (p->queues && (n > 1))
+    {
+        for (int i=0; i<n; i++)
+        {
+            p->queues[i].id = ids[i];
+        }
+    }
+    free(ids);
+    return p->queues ? 0 : -1;
+#else
+    return 0;
+#endif
+}
+
+int pool_self_node(struct pool *p)
+{
+    void *v = pthread_getspecific(p->self);
+    if (v)
+    {
+        return (int)((intptr_t)v - 1);
+    }
+#ifdef HAVE_NUMA
+    if (p->nnodes > 1)
+    {
+        int cpu = sched_getcpu();
+        int id = (cpu >= 0) ? numa_node_of_cpu(cpu) : -1;
+        for (int i=0; i<p->nnodes; i++)
+        {
+            if (p->queues[i].id == id)
+            {
+                return i;
+            }
+        }
+    }
+#endif
+    return 0;
+}
+
+// Take the next task for a thread on node off the queue: the node's own
+// first, then one that can run anywhere, then another node's.  With g,
+// only one of g's.  Call with the lock held.
+static struct task *pop(struct pool *p, int node, struct pool_group *g)
+{
+    int nqueues = p->nnodes + 1;
+    int order[2] = { node, p->nnodes };
+    for (int i=0; i<nqueues + 2; i++)
+    {
+        struct queue *q = &p->queues[(i < 2) ? order[i] : i - 2];
+        struct task *prev = NULL;
+        struct task *t = q->head;
+        while (t && g && (t->group != g))
+        {
+            prev = t;
+            t = t->next;
+        }
+        if (t)
+        {
+            if (prev)
+            {
+                prev->next = t->next;
+            }
+            else
+            {
+                q->head = t->next;
+            }
+            if (q->tail == t)
+            {
+                q->tail = prev;
+            }
+            return t;
+        }
+    }
+    return NULL;
+}
+
+// Run t with the lock released, then account for it.  Call with the lock
+// held; returns with it held.
+static void run(struct pool *p, struct task *t)
+{
+    pthread_mutex_unlock(&p->lock);
+    t->fn(t->arg);
+    pthread_mutex_lock(&p->lock);
+
+    int wake = (--p->pending == 0);
+    if (t->group && (--t->group->pending == 0))
+    {
+        wake = 1;
+    }
+    if (wake)
+    {
+        pthread_cond_broadcast(&p->idle);
+    }
+    free(t);
+}
+
+static void *worker(void *arg)
+{
+    struct start *st = arg;
+    struct pool *p = st->p;
+    int node = st->node;
+    free(st);
+
+#ifdef HAVE_NUMA
+    if (p->nnodes > 1)
+    {
+        // and, allocating locally, fault pages in on this node
+        numa_run_on_node(p->queues[node].id);
+    }
+#endif
+    pthread_setspecific(p->self, (void*)(intptr_t)(node + 1));
+
+    struct queue *q = &p->queues[node];
+    pthread_mutex_lock(&p->lock);
+    for (;;)
+    {
+        struct task *t = pop(p, node, NULL);
+        if (t)
+        {
+            run(p, t);
+            continue;
+        }
+        if (p->shutdown)
+        {
+            break;
+        }
+        q->waiting++;
+        pthread_cond_wait(&q->work, &p->lock);
+        if (q->signals > 0)
+        {
+            q->signals--;
+        }
+        else
+        {
+            // woken spuriously, or for shutdown
+            q->waiting--;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+struct pool *pool_create(int nthreads)
+{
+    struct pool *p = (struct pool*)calloc(1, sizeof(struct pool));
+    if (!p)
+    {
+        return NULL;
+    }
+    if (find_nodes(p) != 0)
+    {
+        free(p);
+        return NULL;
+    }
+    if (!p->queues)
+    {
+        p->queues = (struct queue*)calloc(2, sizeof(struct queue));
+    }
+    p->threads = (pthread_t*)calloc(nthreads, sizeof(pthread_t));
+    if (!p->queues || !p->threads || (pthread_key_create(&p->self, NULL) != 0))
+    {
+        free(p->queues);
+        free(p->threads);
+        free(p);
+        return NULL;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->idle, NULL);
+    for (int i=0; i<=p->nnodes; i++)
+    {
+        pthread_cond_init(&p->queues[i].work, NULL);
+    }
+
+    for (p->nthreads=0; p->nthreads<nthreads; p->nthreads++)
+    {
+        // nodes in turn, so -j spreads over all of them
+        struct start *st = (struct start*)malloc(sizeof(struct start));
+        if (!st)
+        {
+            break;
+        }
+        st->p = p;
+        st->node = p->nthreads % p->nnodes;
+        if (pthread_create(&p->threads[p->nthreads], NULL, worker, st) != 0)
+        {
+            free(st);
+            break;
+        }
+    }
+    if (p->nthreads == 0)
+    {
+        pool_destroy(p);
+        return NULL;
+    }
+    return p;
+}
+
+int pool_nodes(const struct pool *p)
+{
+    return p->nnodes;
+}
+
+int pool_node_id(const struct pool *p, int node)
+{
+    return p->queues[node].id;
+}
+
+int pool_submit(struct pool *p, pool_fn fn, void *arg)
+{
+    return pool_submit_node(p, NULL, -1, fn, arg);
+}
+
+int pool_submit_group(struct pool *p, struct pool_group *g,
+                      pool_fn fn, void *arg)
+{
+    return pool_submit_node(p, g, -1, fn, arg);
+}
+
+int pool_submit_node(struct pool *p, struct pool_group *g, int node,
+                     pool_fn fn, void *arg)
+{
+    struct task *t = (struct task*)malloc(sizeof(struct task));
+    if (!t)
+    {
+        return -1;
+    }
+    t->fn = fn;
+    t->arg = arg;
+    t->group = g;
+    t->next = NULL;
+
+    if ((node < 0) || (node >= p->nnodes))
+    {
+        node = p->nnodes;
+    }
+    struct queue *q = &p->queues[node];
+    pthread_mutex_lock(&p->lock);
+    if (q->tail)
+    {
+        q->tail->next = t;
+    }
+    else
+    {
+        q->head = t;
+    }
+    q->tail = t;
+    p->pending++;
+    if (g)
+    {
+        g->pending++;
+    }
+
+    // one of the node's own workers if one is free, else anyone's; busy
+    // ones look for more when they finish
+    if ((node == p->nnodes) || (q->waiting == 0))
+    {
+        for (int i=0; i<p->nnodes; i++)
+        {
+            if (p->queues[i].waiting > 0)
+            {
+                q = &p->queues[i];
+                break;
+            }
+        }
+    }
+    if (q->waiting > 0)
+    {
+        q->waiting--;
+        q->signals++;
+        pthread_cond_signal(&q->work);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+void pool_wait(struct pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    while (p->pending > 0)
+    {
+        pthread_cond_wait(&p->idle, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_wait_group(struct pool *p, struct pool_group *g)
+{
+    int node = pool_self_node(p);
+    pthread_mutex_lock(&p->lock);
+    while (g->pending > 0)
+    {
+        // only g's: another file's job run from here could hold up this
+        // one's output, or wait on what this one holds
+        struct task *t = pop(p, node, g);
+        if (t)
+        {
+            run(p, t);
+        }
+        else
+        {
+            pthread_cond_wait(&p->idle, &p->lock);
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_destroy(struct pool *p)
+{
+    pool_wait(p);
+
+    pthread_mutex_lock(&p->lock);
+    p->shutdown = 1;
+    for (int i=0; i<=p->nnodes; i++)
+    {
+        pthread_cond_broadcast(&p->queues[i].work);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i=0; i<p->nthreads; i++)
+    {
+        pthread_join(p->threads[i], NULL);
+    }
+
+    for (int i=0; i<=p->nnodes; i++)
+    {
+        pthread_cond_destroy(&p->queues[i].work);
+    }
+    pthread_cond_destroy(&p->idle);
+    pthread_mutex_destroy(&p->lock);
+    pthread_key_delete(p->self);
+    free(p->queues);
+    free(p->threads);
+    free(p);
+}
@@ -0,0 +1,62 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// A fixed-size pool of worker threads pulling tasks off FIFO queues.
+//
+// Built with NUMA (-DHAVE_NUMA), on a machine with more than one node the
+// workers are spread over the nodes and each pinned to its own, and a
+// task can be queued for a node.  Its workers take their node's tasks
+// first, then anyone's, then, rather than sit idle, other nodes'.
+// Otherwise there is a single node, 0.
+
+typedef void (*pool_fn)(void *arg);
+
+struct pool;
+
+// A set of tasks that can be waited on separately from the rest of the
+// pool.  Initialize with POOL_GROUP_INIT.
+struct pool_group
+{
+    size_t pending;
+};
+#define POOL_GROUP_INIT { 0 }
+
+// Start nthreads workers.  Returns NULL on error.
+struct pool *pool_create(int nthreads);
+
+// Queue fn(arg) to run on some worker.  Returns 0 on success.
+int pool_submit(struct pool *p, pool_fn fn, void *arg);
+
+// As pool_submit, also counting the task in group g.
+int pool_submit_group(struct pool *p, struct pool_group *g,
+                      pool_fn fn, void *arg);
+
+// As pool_submit_group, queueing the task for node's workers, or for any
+// worker if node is negative.
+int pool_submit_node(struct pool *p, struct pool_group *g, int node,
+                     pool_fn fn, void *arg);
+
+// The number of nodes the workers are on; nodes are 0 to this minus one.
+int pool_nodes(const struct pool *p);
+
+// The system's number for node.
+int pool_node_id(const struct pool *p, int node);
+
+// The node the calling thread is on: its own for a worker, else the one
+// it is running on now.
+int pool_self_node(struct pool *p);
+
+// Block until every task submitted so far has finished.
+void pool_wait(struct pool *p);
+
+// Block until every task in group g has finished.  The caller runs g's
+// queued tasks itself while it waits, so this is safe to call from inside
+// a task; it never runs anyone else's.
+void pool_wait_group(struct pool *p, struct pool_group *g);
+
+// Wait for outstanding tasks, then stop and free the workers.
+void pool_destroy(struct pool *p);
+
+#endif // POOL_H
@@ -0,0 +1,110 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "boyer_moore.h"
+#include "rare_byte.h"
+
+void rb_default_freq(uint64_t freq[256])
+{
+    for (int c=0; c<256; c++)
+    {
+        if ((c >= 'a') && (c <= 'z'))
+        {
+            freq[c] = 60;
+        }
+        else if ((c == ' ') || (c == '\n') || ((c >= 'A') && (c <= 'Z')) ||
+                 ((c >= '0') && (c <= '9')))
+        {
+            freq[c] = 40;
+        }
+        else if ((c < 0x20) || (c > 0xf0) || ((c >= 0x21) && (c < 0x7f)))
+        {
+            freq[c] = 20;   // small integers, -1..-15, punctuation
+        }
+        else
+        {
+            freq[c] = 10;
+        }
+    }
+    freq[0x00] = 1000;
+    freq[0xff] = 200;
+}
+
+void rb_histogram(uint64_t freq[256], const uint8_t *data, size_t len)
+{
+    // four tables, so runs of one byte don't serialize on one counter
+    uint32_t t[4][256];
+    memset(t, 0, sizeof(t));
+    memset(freq, 0, 256 * sizeof(uint64_t));
+    while (len > 0)
+    {
+        // keep the 32-bit counters from overflowing
+        size_t n = (len < ((size_t)1 << 30)) ? len : ((size_t)1 << 30);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            t[0][data[i]]++;
+            t[1][data[i + 1]]++;
+            t[2][data[i + 2]]++;
+            t[3][data[i + 3]]++;
+        }
+        for (; i < n; i++)
+        {
+            t[0][data[i]]++;
+        }
+        for (int c=0; c<256; c++)
+        {
+            freq[c] += (uint64_t)t[0][c] + t[1][c] + t[2][c] + t[3][c];
+        }
+        memset(t, 0, sizeof(t));
+        data += n;
+        len -= n;
+    }
+}
+
+size_t rb_pick(const uint8_t *pat, size_t patlen, const uint64_t freq[256])
+{
+    size_t best = 0;
+    for (size_t i=1; i<patlen; i++)
+    {
+        if (freq[pat[i]] <= freq[pat[best]])
+        {
+            best = i;
+        }
+    }
+    return best;
+}
+
+size_t rb_search(const uint8_t *string, size_t stringlen,
+                 const uint8_t *pat, size_t patlen, size_t anchor,
+                 uint64_t *verified)
+{
+    if (stringlen < patlen)
+    {
+        return NOT_FOUND;
+    }
+    // where pat[anchor] lands for the candidates [0, stringlen - patlen]
+    const uint8_t *p = string + anchor;
+    const uint8_t *end = string + (stringlen - patlen) + anchor + 1;
+    const uint8_t c = pat[anchor];
+    while (p < end)
+    {
+        p = (const uint8_t*)memchr(p, c, (size_t)(end - p));
+        if (!p)
+        {
+            break;
+        }
+        if (verified)
+        {
+            (*verified)++;
+        }
+        const uint8_t *start = p - anchor;
+        if ((memcmp(start, pat, anchor) == 0) &&
+            (memcmp(p + 1, pat + anchor + 1, patlen - anchor - 1) == 0))
+        {
+            return (size_t)(start - string);
+        }
+        p++;
+    }
+    return NOT_FOUND;
+}
@@ -0,0 +1,33 @@
+#ifndef RARE_BYTE_H
+#define RARE_BYTE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Search for the byte of a pattern that is rarest in the input, with
+// memchr(), and check the whole pattern around each one found.  On data
+// dominated by a few values (00 and ff in memory dumps), a pattern that
+// ends in one of them gets almost no Boyer-Moore skip and floods the
+// first/last byte filter, while some byte in its middle hardly ever
+// occurs.
+
+// Bytes of a file sampled to pick the anchor.
+#define RB_SAMPLE ((size_t)1 << 20)
+
+// Rough byte frequencies of binary data in general, for input that can't
+// be sampled ahead: 00 and ff most, then ASCII text, then the rest.
+void rb_default_freq(uint64_t freq[256]);
+
+// Count the bytes of data into freq.
+void rb_histogram(uint64_t freq[256], const uint8_t *data, size_t len);
+
+// Index of the byte of pat that is rarest by freq; on ties, the last.
+size_t rb_pick(const uint8_t *pat, size_t patlen, const uint64_t freq[256]);
+
+// Offset of the first match of pat in string, or NOT_FOUND, looking for
+// pat[anchor] first.  Adds the candidates checked to *verified, if set.
+size_t rb_search(const uint8_t *string, size_t stringlen,
+                 const uint8_t *pat, size_t patlen, size_t anchor,
+                 uint64_t *verified);
+
+#endif // RARE_BYTE_H
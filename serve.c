@@ -0,0 +1,688 @@
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "serve.h"
+#include "stats.h"
+
+#define SERVE_MAX_REQUEST ((size_t)1 << 20)
+
+// A client has this many seconds to send its request, and no more than
+// this many connections are served at a time.
+#define SERVE_TIMEOUT 10
+#define SERVE_CONNECTIONS 64
+
+struct connection
+{
+    struct server *sv;
+    int fd;
+};
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_signal(int sig)
+{
+    (void)sig;
+    serve_stop = 1;
+}
+
+// Print "<what> error <file_name>: <strerror>", as mgrep does.
+static void report_error(const char *what, const char *file_name)
+{
+    fprintf(stderr, "%s error %s: %s\n", what, file_name, strerror(errno));
+}
+
+// How p gives its patterns, to find them among those already compiled.
+// In memory from malloc(), or NULL.
+static char *request_key(const struct serve_patterns *p, size_t *key_len)
+{
+    char head[128];
+    struct stat st;
+    if (p->db_file)
+    {
+        // a db compiled again is a new key
+        if (stat(p->db_file, &st) != 0)
+        {
+            memset(&st, 0, sizeof(st));
+        }
+        snprintf(head, sizeof(head), "db %d %lld %lld.%09ld", p->overlap,
+                 (long long)st.st_size, (long long)st.st_mtim.tv_sec,
+                 (long)st.st_mtim.tv_nsec);
+    }
+    else
+    {
+        snprintf(head, sizeof(head), "pats %d %d", p->flags, p->overlap);
+    }
+
+    size_t len = strlen(head) + 1;
+    const char *const *texts = p->db_file ? &p->db_file
+                                          : (const char *const*)p->pats;
+    size_t ntexts = p->db_file ? 1 : p->npats;
+    for (size_t i=0; i<ntexts; i++)
+    {
+        len += strlen(texts[i]) + 1;
+    }
+    char *key = (char*)malloc(len);
+    if (!key)
+    {
+        return NULL;
+    }
+    char *at = key;
+    for (size_t i=0; i<=ntexts; i++)
+    {
+        const char *text = (i == 0) ? head : texts[i - 1];
+        size_t n = strlen(text) + 1;
+        memcpy(at, text, n);
+        at += n;
+    }
+    *key_len = len;
+    return key;
+}
+
+static void free_matcher(struct serve_matcher *c)
+{
+    matcher_free(&c->m);
+    if (c->has_db)
+    {
+        db_close(&c->db);
+    }
+    pattern_list_free(&c->patterns);
+    free(c->key);
+    free(c);
+}
+
+// Compile p as main() would, reporting what is wrong with it to err.
+// Returns NULL, with *status the exit status, on error.
+static struct serve_matcher *compile_patterns(const struct serve_patterns *p,
+                                              char *key, size_t key_len,
+                                              FILE *err, int *status)
+{
+    struct serve_matcher *c = (struct serve_matcher*)calloc(1, sizeof(*c));
+    if (!c)
+    {
+        fprintf(err, "Out of memory\n");
+        *status = 2;
+        return NULL;
+    }
+    c->key = key;
+    c->key_len = key_len;
+
+    int ret;
+    if (p->db_file)
+    {
+        if (db_open(&c->db, p->db_file) != 0)
+        {
+            if (errno == EINVAL)
+            {
+                fprintf(err, "Not a pattern db for this mgrep: %s\n",
+                        p->db_file);
+            }
+            else
+            {
+                fprintf(err, "Open error %s: %s\n", p->db_file,
+                        strerror(errno));
+            }
+            free_matcher(c);
+            *status = 2;
+            return NULL;
+        }
+        c->has_db = 1;
+        ret = matcher_init_ac(&c->m, c->db.pats, c->db.npats, c->db.fold,
+                              c->db.has_ac ? &c->db.ac : NULL);
+    }
+    else
+    {
+        const char *bad = NULL;
+        for (size_t i=0; i<p->npats; i++)
+        {
+            if (pattern_list_add(&c->patterns, p->pats[i]) != 0)
+            {
+                fprintf(err, "Out of memory\n");
+                free_matcher(c);
+                *status = 2;
+                return NULL;
+            }
+        }
+        switch (pattern_list_compile(&c->patterns, p->flags, &bad))
+        {
+            case PATTERN_OK:
+                break;
+            case PATTERN_INVALID:
+                fprintf(err, "Invalid pattern: %s\n", bad);
+                *status = 64;
+                break;
+            case PATTERN_MASK_MULTI:
+                fprintf(err, "Wildcards and masks need a single pattern: "
+                        "%s\n", bad);
+                *status = 64;
+                break;
+            case PATTERN_NOMEM:
+                fprintf(err, "Out of memory\n");
+                *status = 2;
+                break;
+        }
+        if (*status != 0)
+        {
+            free_matcher(c);
+            return NULL;
+        }
+        ret = matcher_init(&c->m, c->patterns.pats, c->patterns.len,
+                           (p->flags & PATTERN_FOLD) != 0);
+    }
+    if ((ret == 0) && p->overlap && (c->m.npats > 1))
+    {
+        fprintf(err, "--overlap needs a single pattern\n");
+        free_matcher(c);
+        *status = 64;
+        return NULL;
+    }
+    if ((ret != 0) || (p->overlap && (matcher_set_overlap(&c->m) != 0)))
+    {
+        fprintf(err, "Out of memory\n");
+        free_matcher(c);
+        *status = 2;
+        return NULL;
+    }
+    return c;
+}
+
+struct serve_matcher *serve_compile(struct server *sv,
+                                    const struct serve_patterns *p,
+                                    FILE *err, int *status)
+{
+    size_t key_len;
+    char *key = request_key(p, &key_len);
+    if (!key)
+    {
+        fprintf(err, "Out of memory\n");
+        *status = 2;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&sv->lock);
+    for (int i=0; i<SERVE_MATCHERS; i++)
+    {
+        struct serve_matcher *c = sv->matchers[i];
+        if (c && (c->key_len == key_len) &&
+            (memcmp(c->key, key, key_len) == 0))
+        {
+            c->refs++;
+            c->used = ++sv->clock;
+            pthread_mutex_unlock(&sv->lock);
+            free(key);
+            return c;
+        }
+    }
+    pthread_mutex_unlock(&sv->lock);
+
+    // compile outside the lock; a twin compiled meanwhile just isn't kept
+    struct serve_matcher *c = compile_patterns(p, key, key_len, err, status);
+    if (!c)
+    {
+        return NULL;
+    }
+    c->refs = 1;
+    pthread_mutex_lock(&sv->lock);
+    c->used = ++sv->clock;
+    int slot = -1;
+    for (int i=0; i<SERVE_MATCHERS; i++)
+    {
+        struct serve_matcher *o = sv->matchers[i];
+        if (!o)
+        {
+            slot = i;
+            break;
+        }
+        if ((o->refs == 0) &&
+            ((slot < 0) || (o->used < sv->matchers[slot]->used)))
+        {
+            slot = i;
+        }
+    }
+    struct serve_matcher *evicted = NULL;
+    if (slot >= 0)
+    {
+        evicted = sv->matchers[slot];
+        sv->matchers[slot] = c;
+        c->cached = 1;
+    }
+    pthread_mutex_unlock(&sv->lock);
+    if (evicted)
+    {
+        free_matcher(evicted);
+    }
+    return c;
+}
+
+void serve_release(struct server *sv, struct serve_matcher *c)
+{
+    pthread_mutex_lock(&sv->lock);
+    int gone = (--c->refs == 0) && !c->cached;
+    pthread_mutex_unlock(&sv->lock);
+    if (gone)
+    {
+        free_matcher(c);
+    }
+}
+
+// Read a whole request off fd into *buf, and the descriptors sent with
+// it into fds.  Returns the number of strings in it, or -1, also if it
+// doesn't all arrive within SERVE_TIMEOUT.
+static int read_request(int fd, char **buf, int fds[2])
+{
+    struct timeval timeout = { SERVE_TIMEOUT, 0 };
+    uint64_t deadline = stats_now() + (uint64_t)SERVE_TIMEOUT * 1000000000;
+    char *data = (char*)malloc(SERVE_MAX_REQUEST);
+    if (!data ||
+        (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                    sizeof(timeout)) != 0))
+    {
+        free(data);
+        return -1;
+    }
+    size_t len = 0;
+    size_t strings = 0;
+    size_t want = 2;            // the directory and the count, at first
+    int nfds = 0;
+    while (strings < want)
+    {
+        union
+        {
+            struct cmsghdr align;
+            char space[CMSG_SPACE(2 * sizeof(int))];
+        } control;
+        struct iovec iov = { data + len, SERVE_MAX_REQUEST - len };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.space;
+        msg.msg_controllen = sizeof(control.space);
+        ssize_t n = (len < SERVE_MAX_REQUEST)
+            ? recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) : 0;
+        if ((n < 0) && (errno == EINTR))
+        {
+            continue;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); (n >= 0) && cm;
+             cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if ((cm->cmsg_level != SOL_SOCKET) ||
+                (cm->cmsg_type != SCM_RIGHTS))
+            {
+                continue;
+            }
+            size_t count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i=0; i<count; i++)
+            {
+                int got;
+                memcpy(&got, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+                if (nfds < 2)
+                {
+                    fds[nfds++] = got;
+                }
+                else
+                {
+                    close(got);
+                }
+            }
+        }
+        if ((n <= 0) || (stats_now() > deadline))
+        {
+            break;
+        }
+        for (size_t i=len; i<len + (size_t)n; i++)
+        {
+            if ((data[i] == '\0') && (++strings == 2))
+            {
+                // the count is the second string
+                char *count = (char*)memchr(data, '\0', len + (size_t)n) + 1;
+                want = 2 + (size_t)strtoul(count, NULL, 10);
+            }
+        }
+        len += (size_t)n;
+    }
+    if ((strings < want) || (nfds < 2) || (want > INT_MAX))
+    {
+        for (int i=0; i<nfds; i++)
+        {
+            close(fds[i]);
+        }
+        free(data);
+        return -1;
+    }
+    *buf = data;
+    return (int)want;
+}
+
+// Let the server know a connection's thread is done with it.
+static void end_connection(struct connection *conn)
+{
+    struct server *sv = conn->sv;
+    close(conn->fd);
+    free(conn);
+    pthread_mutex_lock(&sv->lock);
+    sv->connections--;
+    pthread_cond_signal(&sv->done);
+    pthread_mutex_unlock(&sv->lock);
+}
+
+// A connection's thread: read its request, run it and answer.
+static void *serve_connection(void *arg)
+{
+    struct connection *conn = (struct connection*)arg;
+    char *data = NULL;
+    int fds[2];
+    int nstrings = read_request(conn->fd, &data, fds);
+    if (nstrings < 0)
+    {
+        end_connection(conn);
+        return NULL;
+    }
+
+    // argv as for main(), after the directory and count
+    int argc = nstrings - 1;
+    char **argv = (char**)calloc((size_t)argc + 1, sizeof(char*));
+    FILE *err = fdopen(fds[1], "w");
+    unsigned char status = 2;
+    if (argv && err)
+    {
+        setvbuf(err, NULL, _IOLBF, 0);
+        char *p = data;
+        p += strlen(p) + 1;
+        p += strlen(p) + 1;
+        argv[0] = "mgrep";
+        for (int i=1; i<argc; i++)
+        {
+            argv[i] = p;
+            p += strlen(p) + 1;
+        }
+        struct serve_request r = { data, argc, argv, fds[0], err };
+        status = (unsigned char)conn->sv->run(conn->sv, &r);
+        fflush(err);
+    }
+    if (err)
+    {
+        fclose(err);
+    }
+    else
+    {
+        close(fds[1]);
+    }
+    close(fds[0]);
+    send(conn->fd, &status, 1, MSG_NOSIGNAL); // ignore error
+    free(argv);
+    free(data);
+    end_connection(conn);
+    return NULL;
+}
+
+// Non-zero if a server is answering on addr already.  With errno set to
+// ECONNREFUSED, nothing is, and the socket there is left from one that
+// has gone.
+static int serving(const struct sockaddr_un *addr)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    int ret = (connect(fd, (const struct sockaddr*)addr, sizeof(*addr)) == 0);
+    int err = errno;
+    close(fd);
+    errno = ret ? 0 : err;
+    return ret;
+}
+
+int serve(const char *socket_path, int jobs, size_t cache_size, serve_fn run)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return 64;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    struct server sv;
+    memset(&sv, 0, sizeof(sv));
+    sv.jobs = jobs;
+    sv.run = run;
+    struct stat st;
+    if ((lstat(socket_path, &st) == 0) && S_ISSOCK(st.st_mode))
+    {
+        if (serving(&addr))
+        {
+            fprintf(stderr, "Already serving on %s\n", socket_path);
+            return 2;
+        }
+        if (errno == ECONNREFUSED)
+        {
+            // left by a server that is gone
+            unlink(socket_path);
+        }
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if ((fd < 0) ||
+        (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) ||
+        (listen(fd, SOMAXCONN) != 0))
+    {
+        report_error("Listen", socket_path);
+        return 2;
+    }
+
+    // a client that goes away mid-answer is a failed write, not a signal;
+    // SIGINT and SIGTERM are only let in while waiting for the next one,
+    // here rather than on whichever thread the kernel picks
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigset_t stop_signals;
+    sigset_t unblocked;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &unblocked);
+    if (jobs > 1)
+    {
+        sv.pool = pool_create(jobs);
+        if (!sv.pool)
+        {
+            fprintf(stderr, "Unable to start %d workers\n", jobs);
+            close(fd);
+            unlink(socket_path);
+            return 2;
+        }
+    }
+
+    pthread_attr_t detached;
+    pthread_attr_init(&detached);
+    pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+    mc_init(&sv.maps, cache_size);
+    pthread_mutex_init(&sv.lock, NULL);
+    pthread_cond_init(&sv.done, NULL);
+    while (!serve_stop)
+    {
+        pthread_mutex_lock(&sv.lock);
+        while (sv.connections >= SERVE_CONNECTIONS)
+        {
+            // the rest wait in the listen queue
+            pthread_cond_wait(&sv.done, &sv.lock);
+        }
+        pthread_mutex_unlock(&sv.lock);
+
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (ppoll(&pfd, 1, NULL, &unblocked) <= 0)
+        {
+            continue;
+        }
+        int c = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (c < 0)
+        {
+            if ((errno != EINTR) && (errno != ECONNABORTED) &&
+                (errno != EAGAIN) && (errno != EWOULDBLOCK))
+            {
+                report_error("Accept", socket_path);
+                sleep(1);
+            }
+            continue;
+        }
+        struct connection *conn =
+            (struct connection*)malloc(sizeof(struct connection));
+        if (!conn)
+        {
+            close(c);
+            continue;
+        }
+        conn->sv = &sv;
+        conn->fd = c;
+        pthread_mutex_lock(&sv.lock);
+        sv.connections++;
+        pthread_mutex_unlock(&sv.lock);
+        pthread_t thread;
+        if (pthread_create(&thread, &detached, serve_connection, conn) != 0)
+        {
+            end_connection(conn);
+        }
+    }
+
+    close(fd);
+    unlink(socket_path);
+    pthread_mutex_lock(&sv.lock);
+    while (sv.connections > 0)
+    {
+        pthread_cond_wait(&sv.done, &sv.lock);
+    }
+    pthread_mutex_unlock(&sv.lock);
+    pthread_attr_destroy(&detached);
+    pthread_sigmask(SIG_SETMASK, &unblocked, NULL);
+    if (sv.pool)
+    {
+        pool_destroy(sv.pool);
+    }
+    for (int i=0; i<SERVE_MATCHERS; i++)
+    {
+        if (sv.matchers[i])
+        {
+            free_matcher(sv.matchers[i]);
+        }
+    }
+    mc_free(&sv.maps);
+    pthread_cond_destroy(&sv.done);
+    pthread_mutex_destroy(&sv.lock);
+    return 0;
+}
+
+int serve_client(const char *socket_path, int argc, char *const argv[])
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return 64;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    char *cwd = getcwd(NULL, 0);
+    char count[32];
+    snprintf(count, sizeof(count), "%d", argc);
+    size_t len = (cwd ? strlen(cwd) : 0) + strlen(count) + 2;
+    for (int i=0; i<argc; i++)
+    {
+        len += strlen(argv[i]) + 1;
+    }
+    char *data = (char*)malloc(len);
+    if (!cwd || !data || (len > SERVE_MAX_REQUEST))
+    {
+        fprintf(stderr, cwd && data ? "Request too long\n"
+                                    : "Out of memory\n");
+        return 2;
+    }
+    char *p = data;
+    for (int i=-2; i<argc; i++)
+    {
+        const char *s = (i == -2) ? cwd : (i == -1) ? count : argv[i];
+        size_t n = strlen(s) + 1;
+        memcpy(p, s, n);
+        p += n;
+    }
+    free(cwd);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((fd < 0) ||
+        (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0))
+    {
+        report_error("Connect", socket_path);
+        return 2;
+    }
+
+    // the descriptors go with the first byte
+    int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    union
+    {
+        struct cmsghdr align;
+        char space[CMSG_SPACE(sizeof(fds))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { data, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = (sent == 0) ? sendmsg(fd, &msg, MSG_NOSIGNAL)
+                                : send(fd, data + sent, len - sent,
+                                       MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            report_error("Send", socket_path);
+            return 2;
+        }
+        sent += (size_t)n;
+    }
+    free(data);
+
+    unsigned char status;
+    ssize_t n;
+    while (((n = recv(fd, &status, 1, 0)) < 0) && (errno == EINTR))
+    {
+    }
+    close(fd);
+    if (n != 1)
+    {
+        fprintf(stderr, "No answer from %s\n", socket_path);
+        return 2;
+    }
+    return status;
+}
@@ -0,0 +1,106 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "map_cache.h"
+#include "matcher.h"
+#include "pattern_db.h"
+#include "patterns.h"
+#include "pool.h"
+
+// mgrep --serve SOCKET: answer searches sent by mgrep --client over a
+// unix socket.  A request is the client's working directory, the number
+// of arguments and then the arguments, each NUL-terminated, sent along
+// with the client's stdout and stderr (SCM_RIGHTS).  Matches are written
+// straight to the client's stdout and errors to its stderr, then the
+// exit status goes back on the socket as one byte.
+//
+// Each connection gets a thread of its own, so that one slow request
+// holds up nobody else's.  Between requests the server keeps files
+// mapped, and the last few pattern sets it was given compiled.
+
+// Bytes of files kept mapped between requests, by default.
+#define SERVE_CACHE ((size_t)16 << 30)
+
+// Pattern sets kept compiled between requests.
+#define SERVE_MATCHERS 16
+
+// A request's patterns, as it gives them.
+struct serve_patterns
+{
+    char *const *pats;
+    size_t npats;
+    const char *db_file;        // absolute, or NULL
+    int flags;                  // PATTERN_*
+    int overlap;
+};
+
+// A pattern set compiled for a request.
+struct serve_matcher
+{
+    struct matcher m;
+
+    // the rest belongs to the server
+    char *key;                  // the patterns and flags, as given
+    size_t key_len;
+    struct pattern_list patterns;
+    struct pattern_db db;
+    int has_db;
+    size_t refs;
+    uint64_t used;
+    int cached;                 // in server.matchers
+};
+
+// One request, as main() would get it on the client.
+struct serve_request
+{
+    const char *cwd;
+    int argc;
+    char **argv;                // argv[0] is "mgrep"
+    int out_fd;                 // the client's stdout
+    FILE *err;                  // and stderr
+};
+
+struct server;
+
+// Run r, on the connection's thread.  Returns its exit status.
+typedef int (*serve_fn)(struct server *sv, const struct serve_request *r);
+
+struct server
+{
+    struct pool *pool;          // with -j, for the requests' big files
+    int jobs;
+    struct map_cache maps;
+
+    // the rest belongs to the server
+    serve_fn run;
+    pthread_mutex_t lock;       // guards matchers and connections
+    struct serve_matcher *matchers[SERVE_MATCHERS];
+    uint64_t clock;
+    int connections;            // threads serving one
+    pthread_cond_t done;        // signalled when one finishes
+};
+
+// Answer requests on socket_path with run, on jobs workers, until SIGINT
+// or SIGTERM.  Returns the exit status.
+int serve(const char *socket_path, int jobs, size_t cache_size,
+          serve_fn run);
+
+// p compiled, now or for an earlier request, held until
+// serve_release().  NULL if p is no good, with what is wrong printed to
+// err and *status the exit status.
+struct serve_matcher *serve_compile(struct server *sv,
+                                    const struct serve_patterns *p,
+                                    FILE *err, int *status);
+
+void serve_release(struct server *sv, struct serve_matcher *c);
+
+// mgrep --client SOCKET ARGS...: have the server at socket_path search,
+// with our stdout and stderr.  Returns its exit status.
+int serve_client(const char *socket_path, int argc, char *const argv[]);
+
+#endif // SERVE_H
@@ -0,0 +1,155 @@
+// Baeza-Yates, R. and Gonnet, G. H., "A new approach to text
+// searching", Communications of the ACM 35(10), 1992, pp. 74-82.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "boyer_moore.h"
+#include "shift_and.h"
+
+struct shift_and *sa_create(const uint8_t *pat, const uint8_t *mask,
+                            size_t patlen)
+{
+    struct shift_and *sa = (struct shift_and*)calloc(1, sizeof(*sa));
+    if (!sa)
+    {
+        return NULL;
+    }
+    sa->pat = pat;
+    sa->mask = mask;
+    sa->patlen = patlen;
+
+    // longest run of bytes that must match exactly
+    size_t best = 0;
+    size_t bestlen = 0;
+    size_t run = 0;
+    for (size_t i=0; i<patlen; i++)
+    {
+        run = (mask[i] == 0xff) ? run + 1 : 0;
+        if (run > bestlen)
+        {
+            bestlen = run;
+            best = i + 1 - run;
+        }
+    }
+
+    if (bestlen >= SA_MIN_ANCHOR)
+    {
+        sa->anchor = best;
+        sa->anchorlen = bestlen;
+        sa->bm = bm_create(pat + best, bestlen, 0);
+        if (!sa->bm)
+        {
+            free(sa);
+            return NULL;
+        }
+    }
+
+    sa->width = (patlen < SA_MAX_WIDTH) ? patlen : SA_MAX_WIDTH;
+    for (int c=0; c<256; c++)
+    {
+        uint64_t bits = 0;
+        for (size_t i=0; i<sa->width; i++)
+        {
+            if ((c & mask[i]) == pat[i])
+            {
+                bits |= (uint64_t)1 << i;
+            }
+        }
+        sa->masks[c] = bits;
+    }
+    return sa;
+}
+
+void sa_free(struct shift_and *sa)
+{
+    if (sa)
+    {
+        bm_free(sa->bm);
+        free(sa);
+    }
+}
+
+// Non-zero if window matches the pattern from byte from on.
+static int verify(const struct shift_and *sa, const uint8_t *window,
+                  size_t from)
+{
+    for (size_t i=from; i<sa->patlen; i++)
+    {
+        if ((window[i] & sa->mask[i]) != sa->pat[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Next offset at or after pos where the anchor lines up with its place
+// in the pattern and the whole pattern fits, or NOT_FOUND.
+static size_t next_anchor(const struct shift_and *sa,
+                          const uint8_t *string, size_t stringlen,
+                          size_t pos)
+{
+    const uint8_t *anchor = sa->pat + sa->anchor;
+    size_t from = pos + sa->anchor;
+    // the anchor has to end by here for the pattern to fit
+    size_t end = stringlen - (sa->patlen - sa->anchor - sa->anchorlen);
+    if ((from > end) || (end - from < sa->anchorlen))
+    {
+        return NOT_FOUND;
+    }
+
+    size_t hit = sa->simd
+        ? sa->simd(string + from, end - from, anchor, sa->anchorlen)
+        : bm_find(sa->bm, string + from, end - from);
+    return (hit == NOT_FOUND) ? NOT_FOUND : pos + hit;
+}
+
+// Shift-And over the whole string.  Whenever no prefix of the pattern is
+// in progress, no match can start at or before the current byte, so jump
+// ahead to the next anchor instead.  Each byte goes through the bit
+// vector at most once, so one pass is the most this costs, however many
+// bytes are free.
+size_t sa_search(const struct shift_and *sa,
+                 const uint8_t *string, size_t stringlen)
+{
+    if (stringlen < sa->patlen)
+    {
+        return NOT_FOUND;
+    }
+
+    uint64_t state = 0;
+    uint64_t last = (uint64_t)1 << (sa->width - 1);
+    // a match has to start before this for the whole pattern to fit
+    size_t stop = stringlen - (sa->patlen - sa->width);
+    size_t direct = 0;      // don't look for the anchor before here
+
+    for (size_t i=0; i<stop; i++)
+    {
+        if ((state == 0) && sa->anchorlen && (i >= direct))
+        {
+            size_t start = next_anchor(sa, string, stringlen, i);
+            if (start == NOT_FOUND)
+            {
+                return NOT_FOUND;
+            }
+            if (start - i < SA_MIN_SKIP)
+            {
+                // the anchor is everywhere; it only slows things down
+                direct = start + SA_DIRECT_RUN;
+            }
+            i = start;
+        }
+
+        state = ((state << 1) | 1) & sa->masks[string[i]];
+        if (state & last)
+        {
+            size_t start = i + 1 - sa->width;
+            if (verify(sa, string + start, sa->width))
+            {
+                return start;
+            }
+        }
+    }
+    return NOT_FOUND;
+}
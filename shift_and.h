@@ -0,0 +1,53 @@
+#ifndef SHIFT_AND_H
+#define SHIFT_AND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "boyer_moore.h"
+#include "simd_search.h"
+
+// Bit-parallel Shift-And handles this many pattern bytes at once; the
+// rest of a longer pattern is checked after the first ones match.
+#define SA_MAX_WIDTH 64
+
+// An anchor (a run of bytes with every bit fixed) at least this long is
+// found with the exact search engines, to skip stretches where the
+// pattern can't start.  Shorter ones hit too often.
+#define SA_MIN_ANCHOR 3
+
+// When the anchor turns up within SA_MIN_SKIP bytes of where the search
+// stands, stop looking for it for the next SA_DIRECT_RUN bytes.
+#define SA_MIN_SKIP 16
+#define SA_DIRECT_RUN 4096
+
+// Search for a pattern in which some bits of some bytes may be anything.
+struct shift_and
+{
+    const uint8_t *pat;     // not owned; pat[i] & ~mask[i] == 0
+    const uint8_t *mask;    // not owned; bits of pat[i] that must match
+    size_t patlen;
+
+    // the longest run of exact bytes, used to skip ahead when it is long
+    // enough
+    size_t anchor;          // offset in pat
+    size_t anchorlen;       // 0 if too short to be worth it
+    simd_search_fn simd;    // filter for the anchor; NULL for Boyer-Moore
+    struct bm *bm;          // Boyer-Moore for the anchor
+
+    // bit i of masks[c] is set if byte c fits pat[i]
+    size_t width;           // pattern bytes in the bit vector
+    uint64_t masks[256];
+};
+
+// Build the tables for pat under mask.  Returns NULL on error.
+struct shift_and *sa_create(const uint8_t *pat, const uint8_t *mask,
+                            size_t patlen);
+
+void sa_free(struct shift_and *sa);
+
+// Offset of the first match in string, or NOT_FOUND.
+size_t sa_search(const struct shift_and *sa,
+                 const uint8_t *string, size_t stringlen);
+
+#endif // SHIFT_AND_H
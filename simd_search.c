@@ -0,0 +1,588 @@
+// Vectorized candidate filter for short patterns.
+//
+// For every position i, compare string[i] with the first byte of pat and
+// string[i + patlen - 1] with the last byte, 16 or 32 positions per step.
+// Only positions where both agree are checked in full.  This does not
+// depend on the skip distance, so it stays fast for the 2-6 byte patterns
+// where Boyer-Moore can barely skip at all.
+//
+// The folded kernels ignore ASCII case: pat is lower case, and at the
+// positions where it has a letter, the input byte is ORed with 0x20
+// before comparing.  That maps A-Z onto a-z and nothing else onto a
+// letter, so one compare still decides each byte.
+//
+// For the common lengths of 4, 8 and 16 bytes there are copies of each
+// kernel compiled for that length, so the second load is at a constant
+// offset and a candidate is checked with one or two word compares.
+//
+// See: http://0x80.pl/articles/simd-strfind.html
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "boyer_moore.h"
+#include "fold.h"
+#include "simd_search.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+struct kernel
+{
+    const char *name;
+    simd_search_fn fn;
+    simd_search_fn folded;
+    simd_count_fn counted;
+    simd_search_fn fixed[3];    // for 4, 8 and 16 bytes, without folding
+    int (*supported)(void);
+};
+
+#if defined(HAVE_X86_SIMD) || defined(HAVE_NEON)
+
+static inline uint8_t fetch(uint8_t c, int fold)
+{
+    return fold ? fold_byte(c) : c;
+}
+
+// 0x20 where pat has a letter, when folding; see the top of the file
+static inline uint8_t case_bit(uint8_t c, int fold)
+{
+    return (fold && fold_is_alpha(c)) ? 0x20 : 0;
+}
+
+// pat[0] and pat[patlen-1] are known to match at s
+static inline int verify(const uint8_t *s, const uint8_t *pat, size_t patlen,
+                         int fold)
+{
+    if (!fold)
+    {
+        return (patlen <= 2) || (memcmp(s + 1, pat + 1, patlen - 2) == 0);
+    }
+    for (size_t i=1; i + 1 < patlen; i++)
+    {
+        if (fold_byte(s[i]) != pat[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// A pattern of 4, 8 or 16 bytes as words, to compare candidates with.
+struct pat_words
+{
+    uint64_t lo;
+    uint64_t hi;
+    uint32_t lo32;
+};
+
+// Only in the copies compiled for one length; elsewhere the branch would
+// cost every candidate.  Without optimization nothing is constant, and
+// the generic checks are used.
+#define is_fixed(patlen) (__builtin_constant_p(patlen) && \
+    (((patlen) == 4) || ((patlen) == 8) || ((patlen) == 16)))
+
+static inline void words_prepare(struct pat_words *w, const uint8_t *pat,
+                                 size_t patlen)
+{
+    memset(w, 0, sizeof(*w));
+    if (patlen == 4)
+    {
+        memcpy(&w->lo32, pat, 4);
+    }
+    else if ((patlen == 8) || (patlen == 16))
+    {
+        memcpy(&w->lo, pat, 8);
+        if (patlen == 16)
+        {
+            memcpy(&w->hi, pat + 8, 8);
+        }
+    }
+}
+
+// The whole of a 4, 8 or 16 byte candidate at s, with unaligned loads.
+static inline int verify_words(const uint8_t *s, const struct pat_words *w,
+                               size_t patlen)
+{
+    if (patlen == 4)
+    {
+        uint32_t x;
+        memcpy(&x, s, 4);
+        return x == w->lo32;
+    }
+    uint64_t lo;
+    memcpy(&lo, s, 8);
+    if (patlen == 8)
+    {
+        return lo == w->lo;
+    }
+    uint64_t hi;
+    memcpy(&hi, s + 8, 8);
+    return ((lo ^ w->lo) | (hi ^ w->hi)) == 0;
+}
+
+// Check the last few positions, too few for a full vector, one at a time.
+static size_t scalar_tail(const uint8_t *string, size_t i, size_t limit,
+                          const uint8_t *pat, size_t patlen, int fold,
+                          uint64_t *verified)
+{
+    for (; i < limit; i++)
+    {
+        if ((fetch(string[i], fold) == pat[0]) &&
+            (fetch(string[i + patlen - 1], fold) == pat[patlen - 1]))
+        {
+            if (verified)
+            {
+                (*verified)++;
+            }
+            if (verify(string + i, pat, patlen, fold))
+            {
+                return i;
+            }
+        }
+    }
+    return NOT_FOUND;
+}
+
+// Pattern and case bits padded to one vector, for checking a whole
+// folded candidate at once.  Only for patterns up to 16 bytes, and only
+// where 16 bytes can be read.
+struct folded_pat
+{
+    uint8_t pat[16];
+    uint8_t bits[16];
+    int usable;
+};
+
+static inline void fold_prepare(struct folded_pat *f, const uint8_t *pat,
+                                size_t patlen, int fold)
+{
+    f->usable = fold && (patlen <= 16);
+    if (fold)
+    {
+        memset(f->pat, 0, sizeof(f->pat));
+        memset(f->bits, 0, sizeof(f->bits));
+    }
+    if (f->usable)
+    {
+        for (size_t i=0; i<patlen; i++)
+        {
+            f->pat[i] = pat[i];
+            f->bits[i] = case_bit(pat[i], 1);
+        }
+    }
+}
+
+#endif
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse2"), always_inline))
+static inline int verify_sse2(const uint8_t *s, __m128i pv, __m128i bits,
+                              unsigned want)
+{
+    __m128i x = _mm_or_si128(_mm_loadu_si128((const __m128i*)s), bits);
+    return ((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, pv)) & want) == want;
+}
+
+__attribute__((target("sse2"), always_inline))
+static inline size_t sse2_impl(const uint8_t *string, size_t stringlen,
+                               const uint8_t *pat, size_t patlen, int fold,
+                               uint64_t *verified)
+{
+    if (stringlen < patlen)
+    {
+        return NOT_FOUND;
+    }
+    const __m128i first = _mm_set1_epi8((char)pat[0]);
+    const __m128i last = _mm_set1_epi8((char)pat[patlen - 1]);
+    const __m128i first_bit = _mm_set1_epi8((char)case_bit(pat[0], fold));
+    const __m128i last_bit =
+        _mm_set1_epi8((char)case_bit(pat[patlen - 1], fold));
+    struct folded_pat f;
+    fold_prepare(&f, pat, patlen, fold);
+    struct pat_words w;
+    words_prepare(&w, pat, patlen);
+    const __m128i pv = fold ? _mm_loadu_si128((const __m128i*)f.pat)
+                            : _mm_setzero_si128();
+    const __m128i bits = fold ? _mm_loadu_si128((const __m128i*)f.bits)
+                              : _mm_setzero_si128();
+    const unsigned want = (patlen >= 16) ? 0xffff : (1u << patlen) - 1;
+
+    size_t limit = stringlen - patlen + 1; // candidates are [0, limit)
+    size_t i = 0;
+    for (; i + 16 <= limit; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(string + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(string + i + patlen - 1));
+        if (fold)
+        {
+            a = _mm_or_si128(a, first_bit);
+            b = _mm_or_si128(b, last_bit);
+        }
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask)
+        {
+            size_t bit = (size_t)__builtin_ctz(mask);
+            size_t at = i + bit;
+            if (verified)
+            {
+                (*verified)++;
+            }
+            if ((!fold && is_fixed(patlen))
+                ? verify_words(string + at, &w, patlen)
+                : (f.usable && (at + 16 <= stringlen))
+                ? verify_sse2(string + at, pv, bits, want)
+                : verify(string + at, pat, patlen, fold))
+            {
+                return at;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return scalar_tail(string, i, limit, pat, patlen, fold, verified);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline size_t avx2_impl(const uint8_t *string, size_t stringlen,
+                               const uint8_t *pat, size_t patlen, int fold,
+                               uint64_t *verified)
+{
+    if (stringlen < patlen)
+    {
+        return NOT_FOUND;
+    }
+    const __m256i first = _mm256_set1_epi8((char)pat[0]);
+    const __m256i last = _mm256_set1_epi8((char)pat[patlen - 1]);
+    const __m256i first_bit =
+        _mm256_set1_epi8((char)case_bit(pat[0], fold));
+    const __m256i last_bit =
+        _mm256_set1_epi8((char)case_bit(pat[patlen - 1], fold));
+    struct folded_pat f;
+    fold_prepare(&f, pat, patlen, fold);
+    struct pat_words w;
+    words_prepare(&w, pat, patlen);
+    const __m128i pv = fold ? _mm_loadu_si128((const __m128i*)f.pat)
+                            : _mm_setzero_si128();
+    const __m128i bits = fold ? _mm_loadu_si128((const __m128i*)f.bits)
+                              : _mm_setzero_si128();
+    const unsigned want = (patlen >= 16) ? 0xffff : (1u << patlen) - 1;
+
+    size_t limit = stringlen - patlen + 1; // candidates are [0, limit)
+    size_t i = 0;
+    for (; i + 32 <= limit; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(string + i));
+        __m256i b = _mm256_loadu_si256(
+            (const __m256i*)(string + i + patlen - 1));
+        if (fold)
+        {
+            a = _mm256_or_si256(a, first_bit);
+            b = _mm256_or_si256(b, last_bit);
+        }
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                             _mm256_cmpeq_epi8(b, last)));
+        while (mask)
+        {
+            size_t bit = (size_t)__builtin_ctz(mask);
+            size_t at = i + bit;
+            if (verified)
+            {
+                (*verified)++;
+            }
+            if ((!fold && is_fixed(patlen))
+                ? verify_words(string + at, &w, patlen)
+                : (f.usable && (at + 16 <= stringlen))
+                ? verify_sse2(string + at, pv, bits, want)
+                : verify(string + at, pat, patlen, fold))
+            {
+                return at;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return scalar_tail(string, i, limit, pat, patlen, fold, verified);
+}
+
+__attribute__((target("sse2")))
+static size_t search_sse2(const uint8_t *string, size_t stringlen,
+                          const uint8_t *pat, size_t patlen)
+{
+    return sse2_impl(string, stringlen, pat, patlen, 0, NULL);
+}
+
+__attribute__((target("sse2")))
+static size_t search_sse2_folded(const uint8_t *string, size_t stringlen,
+                                 const uint8_t *pat, size_t patlen)
+{
+    return sse2_impl(string, stringlen, pat, patlen, 1, NULL);
+}
+
+__attribute__((target("avx2")))
+static size_t search_avx2(const uint8_t *string, size_t stringlen,
+                          const uint8_t *pat, size_t patlen)
+{
+    return avx2_impl(string, stringlen, pat, patlen, 0, NULL);
+}
+
+__attribute__((target("avx2")))
+static size_t search_avx2_folded(const uint8_t *string, size_t stringlen,
+                                 const uint8_t *pat, size_t patlen)
+{
+    return avx2_impl(string, stringlen, pat, patlen, 1, NULL);
+}
+
+__attribute__((target("avx2")))
+static size_t count_avx2(const uint8_t *string, size_t stringlen,
+                         const uint8_t *pat, size_t patlen, int fold,
+                         uint64_t *verified)
+{
+    if (fold)
+    {
+        return avx2_impl(string, stringlen, pat, patlen, 1, verified);
+    }
+    return avx2_impl(string, stringlen, pat, patlen, 0, verified);
+}
+
+// The kernels compiled for one pattern length; patlen must be that.
+#define FIXED_KERNEL(impl, isa, len)                                      \
+    __attribute__((target(isa)))                                          \
+    static size_t impl##_##len(const uint8_t *string, size_t stringlen,   \
+                               const uint8_t *pat, size_t patlen)         \
+    {                                                                     \
+        (void)patlen;                                                     \
+        return impl##_impl(string, stringlen, pat, len, 0, NULL);         \
+    }
+
+FIXED_KERNEL(avx2, "avx2", 4)
+FIXED_KERNEL(avx2, "avx2", 8)
+FIXED_KERNEL(avx2, "avx2", 16)
+FIXED_KERNEL(sse2, "sse2", 4)
+FIXED_KERNEL(sse2, "sse2", 8)
+FIXED_KERNEL(sse2, "sse2", 16)
+
+static int have_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("sse2")))
+static size_t count_sse2(const uint8_t *string, size_t stringlen,
+                         const uint8_t *pat, size_t patlen, int fold,
+                         uint64_t *verified)
+{
+    if (fold)
+    {
+        return sse2_impl(string, stringlen, pat, patlen, 1, verified);
+    }
+    return sse2_impl(string, stringlen, pat, patlen, 0, verified);
+}
+
+static int have_sse2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+// best first
+static const struct kernel kernels[] = {
+    { "avx2", search_avx2, search_avx2_folded, count_avx2,
+      { avx2_4, avx2_8, avx2_16 }, have_avx2 },
+    { "sse2", search_sse2, search_sse2_folded, count_sse2,
+      { sse2_4, sse2_8, sse2_16 }, have_sse2 },
+    { NULL, NULL, NULL, NULL, { NULL, NULL, NULL }, NULL }
+};
+
+#elif defined(HAVE_NEON)
+
+// NEON has no movemask: narrow each byte of a compare result to 4 bits
+static inline uint64_t neon_mask(uint8x16_t eq)
+{
+    return vget_lane_u64(vreinterpret_u64_u8(
+        vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+static inline size_t neon_impl(const uint8_t *string, size_t stringlen,
+                               const uint8_t *pat, size_t patlen, int fold,
+                               uint64_t *verified)
+{
+    if (stringlen < patlen)
+    {
+        return NOT_FOUND;
+    }
+    const uint8x16_t first = vdupq_n_u8(pat[0]);
+    const uint8x16_t last = vdupq_n_u8(pat[patlen - 1]);
+    const uint8x16_t first_bit = vdupq_n_u8(case_bit(pat[0], fold));
+    const uint8x16_t last_bit = vdupq_n_u8(case_bit(pat[patlen - 1], fold));
+    struct folded_pat f;
+    fold_prepare(&f, pat, patlen, fold);
+    struct pat_words w;
+    words_prepare(&w, pat, patlen);
+    const uint8x16_t pv = vld1q_u8(f.pat);
+    const uint8x16_t bits = vld1q_u8(f.bits);
+    const uint64_t want = (patlen >= 16) ? ~(uint64_t)0
+                                         : ((uint64_t)1 << (patlen * 4)) - 1;
+
+    size_t limit = stringlen - patlen + 1; // candidates are [0, limit)
+    size_t i = 0;
+    for (; i + 16 <= limit; i += 16)
+    {
+        uint8x16_t a = vld1q_u8(string + i);
+        uint8x16_t b = vld1q_u8(string + i + patlen - 1);
+        if (fold)
+        {
+            a = vorrq_u8(a, first_bit);
+            b = vorrq_u8(b, last_bit);
+        }
+        uint64_t mask = neon_mask(vandq_u8(vceqq_u8(a, first),
+                                           vceqq_u8(b, last)));
+        while (mask)
+        {
+            size_t bit = (size_t)__builtin_ctzll(mask) / 4;
+            size_t at = i + bit;
+            if (verified)
+            {
+                (*verified)++;
+            }
+            if ((!fold && is_fixed(patlen))
+                ? verify_words(string + at, &w, patlen)
+                : (f.usable && (at + 16 <= stringlen))
+                ? ((neon_mask(vceqq_u8(vorrq_u8(vld1q_u8(string + at), bits),
+                                       pv)) & want) == want)
+                : verify(string + at, pat, patlen, fold))
+            {
+                return at;
+            }
+            mask &= ~((uint64_t)0xf << (bit * 4));
+        }
+    }
+    return scalar_tail(string, i, limit, pat, patlen, fold, verified);
+}
+
+static size_t search_neon(const uint8_t *string, size_t stringlen,
+                          const uint8_t *pat, size_t patlen)
+{
+    return neon_impl(string, stringlen, pat, patlen, 0, NULL);
+}
+
+static size_t search_neon_folded(const uint8_t *string, size_t stringlen,
+                                 const uint8_t *pat, size_t patlen)
+{
+    return neon_impl(string, stringlen, pat, patlen, 1, NULL);
+}
+
+static size_t count_neon(const uint8_t *string, size_t stringlen,
+                         const uint8_t *pat, size_t patlen, int fold,
+                         uint64_t *verified)
+{
+    if (fold)
+    {
+        return neon_impl(string, stringlen, pat, patlen, 1, verified);
+    }
+    return neon_impl(string, stringlen, pat, patlen, 0, verified);
+}
+
+#define FIXED_KERNEL(len)                                                 \
+    static size_t neon_##len(const uint8_t *string, size_t stringlen,     \
+                             const uint8_t *pat, size_t patlen)           \
+    {                                                                     \
+        (void)patlen;                                                     \
+        return neon_impl(string, stringlen, pat, len, 0, NULL);           \
+    }
+
+FIXED_KERNEL(4)
+FIXED_KERNEL(8)
+FIXED_KERNEL(16)
+
+// NEON is part of the base aarch64 architecture
+static int have_neon(void)
+{
+    return 1;
+}
+
+static const struct kernel kernels[] = {
+    { "neon", search_neon, search_neon_folded, count_neon,
+      { neon_4, neon_8, neon_16 }, have_neon },
+    { NULL, NULL, NULL, NULL, { NULL, NULL, NULL }, NULL }
+};
+
+#else
+
+static const struct kernel kernels[] = {
+    { NULL, NULL, NULL, NULL, { NULL, NULL, NULL }, NULL }
+};
+
+#endif
+
+simd_search_fn simd_search_select(const char **name, int fold)
+{
+    for (const struct kernel *k = kernels; k->name; k++)
+    {
+        if (k->supported())
+        {
+            *name = k->name;
+            return fold ? k->folded : k->fn;
+        }
+    }
+    return NULL;
+}
+
+simd_search_fn simd_search_kernel(const char *name, int fold)
+{
+    for (const struct kernel *k = kernels; k->name; k++)
+    {
+        if ((strcmp(k->name, name) == 0) && k->supported())
+        {
+            return fold ? k->folded : k->fn;
+        }
+    }
+    return NULL;
+}
+
+simd_count_fn simd_search_counted(const char *name)
+{
+    for (const struct kernel *k = kernels; k->name; k++)
+    {
+        if ((strcmp(k->name, name) == 0) && k->supported())
+        {
+            return k->counted;
+        }
+    }
+    return NULL;
+}
+
+simd_search_fn simd_search_fixed(const char *name, size_t patlen)
+{
+    int slot;
+    switch (patlen)
+    {
+        case 4:
+            slot = 0;
+            break;
+        case 8:
+            slot = 1;
+            break;
+        case 16:
+            slot = 2;
+            break;
+        default:
+            return NULL;
+    }
+    for (const struct kernel *k = kernels; k->name; k++)
+    {
+        if ((strcmp(k->name, name) == 0) && k->supported())
+        {
+            return k->fixed[slot];
+        }
+    }
+    return NULL;
+}
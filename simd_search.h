@@ -0,0 +1,36 @@
+#ifndef SIMD_SEARCH_H
+#define SIMD_SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Same contract as bm_search: offset of the first occurrence of pat in
+// string, or NOT_FOUND.
+typedef size_t (*simd_search_fn)(const uint8_t *string, size_t stringlen,
+                                 const uint8_t *pat, size_t patlen);
+
+// Pick the widest first/last-byte filter this CPU supports.  Returns
+// NULL if there is none, and sets *name to the kernel's name otherwise.
+// With fold, the kernel ignores ASCII case, and pat must be lower case.
+simd_search_fn simd_search_select(const char **name, int fold);
+
+// The kernel called name ("avx2", "sse2" or "neon"), or NULL if it isn't
+// built in or this CPU can't run it.
+simd_search_fn simd_search_kernel(const char *name, int fold);
+
+// The kernel called name compiled for patterns of exactly patlen bytes,
+// or NULL if there isn't one for that length (4, 8 and 16 have them).
+// It has the same contract, but patlen must always be that length, and
+// it doesn't fold.
+simd_search_fn simd_search_fixed(const char *name, size_t patlen);
+
+// A kernel that also counts the candidates it checks in full, for
+// --stats; fold is as for simd_search_select.
+typedef size_t (*simd_count_fn)(const uint8_t *string, size_t stringlen,
+                                const uint8_t *pat, size_t patlen, int fold,
+                                uint64_t *verified);
+
+// The counting version of the kernel called name, or NULL.
+simd_count_fn simd_search_counted(const char *name);
+
+#endif // SIMD_SEARCH_H
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+#include "stats.h"
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void stats_faults(uint64_t *minor, uint64_t *major)
+{
+    struct rusage ru;
+#ifdef RUSAGE_THREAD
+    int who = RUSAGE_THREAD;
+#else
+    int who = RUSAGE_SELF;
+#endif
+    if (getrusage(who, &ru) != 0)
+    {
+        *minor = 0;
+        *major = 0;
+        return;
+    }
+    *minor = (uint64_t)ru.ru_minflt;
+    *major = (uint64_t)ru.ru_majflt;
+}
+
+void stats_add_engine(struct engine_stats *to,
+                      const struct engine_stats *from)
+{
+    to->verifies += from->verifies;
+    to->windows += from->windows;
+    to->shifted += from->shifted;
+    to->counted |= from->counted;
+}
+
+void stats_add(struct file_stats *to, const struct file_stats *from)
+{
+    to->files += from->files;
+    to->bytes += from->bytes;
+    to->matches += from->matches;
+    to->elapsed_ns += from->elapsed_ns;
+    to->output_ns += from->output_ns;
+    to->minor_faults += from->minor_faults;
+    to->major_faults += from->major_faults;
+    stats_add_engine(&to->engine, &from->engine);
+}
+
+void stats_format(char *buf, size_t size, const char *name,
+                  const struct file_stats *st)
+{
+    const struct engine_stats *e = &st->engine;
+    uint64_t search_ns = (st->elapsed_ns > st->output_ns)
+        ? st->elapsed_ns - st->output_ns : 0;
+    double gbps = st->elapsed_ns ? (double)st->bytes / st->elapsed_ns : 0;
+    int n = snprintf(buf, size,
+                     "%s: %llu bytes in %.3f ms, %.2f GB/s, %llu matches",
+                     name, (unsigned long long)st->bytes,
+                     st->elapsed_ns / 1e6, gbps,
+                     (unsigned long long)st->matches);
+    if ((e->counted & ENGINE_VERIFIES) && (n >= 0) && ((size_t)n < size))
+    {
+        n += snprintf(buf + n, size - n, ", %llu verifications",
+                      (unsigned long long)e->verifies);
+    }
+    if ((e->counted & ENGINE_SHIFTS) && (n >= 0) && ((size_t)n < size))
+    {
+        n += snprintf(buf + n, size - n, ", average shift %.2f",
+                      e->windows ? (double)e->shifted / e->windows : 0.0);
+    }
+    if ((n >= 0) && ((size_t)n < size))
+    {
+        snprintf(buf + n, size - n,
+                 ", %llu minor and %llu major faults, "
+                 "search %.3f ms, output %.3f ms",
+                 (unsigned long long)st->minor_faults,
+                 (unsigned long long)st->major_faults,
+                 search_ns / 1e6, st->output_ns / 1e6);
+    }
+}
+
+void stats_format_node(char *buf, size_t size, int node,
+                       const struct node_stats *st)
+{
+    // per worker busy on it, so nodes compare however many were used
+    double gbps = st->busy_ns ? (double)st->bytes / st->busy_ns : 0;
+    snprintf(buf, size,
+             "node %d: %llu bytes in %llu chunks, busy %.3f ms, "
+             "%.2f GB/s a worker",
+             node, (unsigned long long)st->bytes,
+             (unsigned long long)st->chunks, st->busy_ns / 1e6, gbps);
+}
@@ -0,0 +1,63 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Counters for --stats.  Nothing here is touched unless it was asked
+// for; the engines have separate counting entry points.
+
+// What an engine counts, in engine_stats.counted
+#define ENGINE_VERIFIES 1   // verifies
+#define ENGINE_SHIFTS 2     // windows and shifted
+
+struct engine_stats
+{
+    uint64_t verifies;      // candidates checked past the first compare
+    uint64_t windows;       // alignments of the pattern tried
+    uint64_t shifted;       // bytes the pattern moved, over all of them
+    int counted;
+};
+
+// Per file, and summed over all of them.
+struct file_stats
+{
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t matches;
+    uint64_t elapsed_ns;    // searching and printing
+    uint64_t output_ns;     // printing
+    uint64_t minor_faults;
+    uint64_t major_faults;
+    struct engine_stats engine;
+};
+
+// Pieces of large files scanned on one NUMA node's workers, with -j.
+struct node_stats
+{
+    uint64_t chunks;
+    uint64_t bytes;
+    uint64_t busy_ns;       // over all its workers
+};
+
+// Monotonic clock, in nanoseconds.
+uint64_t stats_now(void);
+
+// Page faults so far, of the calling thread where the system can tell,
+// else of the process.
+void stats_faults(uint64_t *minor, uint64_t *major);
+
+void stats_add_engine(struct engine_stats *to,
+                      const struct engine_stats *from);
+
+void stats_add(struct file_stats *to, const struct file_stats *from);
+
+// One line, without a newline, describing st: "name: 1234 bytes in ...".
+void stats_format(char *buf, size_t size, const char *name,
+                  const struct file_stats *st);
+
+// As stats_format, for node, the system's number for it.
+void stats_format_node(char *buf, size_t size, int node,
+                       const struct node_stats *st);
+
+#endif // STATS_H
@@ -0,0 +1,156 @@
+// Crochemore, M. and Perrin, D., "Two-way string-matching",
+// Journal of the ACM 38(3), 1991, pp. 651-675.
+// The byte skip before each attempt follows the glibc and musl memmem()
+// implementations.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "boyer_moore.h"
+#include "two_way.h"
+
+// Start of the maximal suffix of pat, less one, under the byte order
+// (reverse == 0) or its opposite, and that suffix's period.  Indexes
+// start at (size_t)-1 and rely on unsigned wraparound.
+static size_t max_suffix(const uint8_t *pat, size_t patlen, int reverse,
+                         size_t *period)
+{
+    size_t ms = (size_t)-1;     // start of the best suffix so far, less one
+    size_t j = 0;               // start of the candidate suffix
+    size_t k = 1;
+    size_t p = 1;
+
+    while (j + k < patlen)
+    {
+        uint8_t a = pat[ms + k];
+        uint8_t b = pat[j + k];
+        if (a == b)
+        {
+            if (k == p)
+            {
+                j += p;
+                k = 1;
+            }
+            else
+            {
+                k++;
+            }
+        }
+        else if (reverse ? (a < b) : (a > b))
+        {
+            // the candidate is smaller; skip past the compared part
+            j += k;
+            k = 1;
+            p = j - ms;
+        }
+        else
+        {
+            // the candidate is larger; it becomes the best
+            ms = j++;
+            k = p = 1;
+        }
+    }
+    *period = p;
+    return ms;
+}
+
+void tw_init(struct two_way *tw, const uint8_t *pat, size_t patlen)
+{
+    size_t p;
+    size_t rp;
+    size_t ms = max_suffix(pat, patlen, 0, &p);
+    size_t rms = max_suffix(pat, patlen, 1, &rp);
+
+    // the later of the two maximal suffixes is a critical factorization
+    if (rms + 1 > ms + 1)
+    {
+        ms = rms;
+        p = rp;
+    }
+
+    tw->ms = ms;
+    if (memcmp(pat, pat + p, ms + 1) == 0)
+    {
+        // periodic: after a shift by p, the first patlen - p bytes of
+        // the window are already known to match
+        tw->period = p;
+        tw->memory = patlen - p;
+    }
+    else
+    {
+        // no useful period; any shift up to this one is safe
+        size_t left = ms + 1;
+        size_t right = patlen - ms - 1;
+        tw->period = ((left > right) ? left : right) + 1;
+        tw->memory = 0;
+    }
+
+    for (size_t i=0; i<256; i++)
+    {
+        tw->skip[i] = patlen;
+    }
+    for (size_t i=0; i<patlen; i++)
+    {
+        tw->skip[pat[i]] = patlen-1 - i;
+    }
+}
+
+int tw_periodic(const struct two_way *tw, size_t patlen)
+{
+    return (tw->memory != 0) && (tw->period * 2 <= patlen);
+}
+
+size_t tw_search(const struct two_way *tw,
+                 const uint8_t *string, size_t stringlen,
+                 const uint8_t *pat, size_t patlen)
+{
+    size_t right = tw->ms + 1;  // first byte of the right half
+    size_t mem = 0;             // window prefix known to match
+    size_t pos = 0;
+
+    while (stringlen - pos >= patlen)
+    {
+        const uint8_t *w = string + pos;
+
+        // shift the last occurrence of the window's last byte under it
+        size_t k = tw->skip[w[patlen-1]];
+        if (k)
+        {
+            if (k < mem)
+            {
+                k = mem;
+            }
+            pos += k;
+            mem = 0;
+            continue;
+        }
+
+        // right half, forwards
+        k = (right > mem) ? right : mem;
+        while ((k < patlen) && (pat[k] == w[k]))
+        {
+            k++;
+        }
+        if (k < patlen)
+        {
+            pos += k - tw->ms;
+            mem = 0;
+            continue;
+        }
+
+        // left half, backwards, down to what is already known
+        k = right;
+        while ((k > mem) && (pat[k-1] == w[k-1]))
+        {
+            k--;
+        }
+        if (k <= mem)
+        {
+            return pos;
+        }
+        pos += tw->period;
+        mem = tw->memory;
+    }
+    return NOT_FOUND;
+}
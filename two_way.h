@@ -0,0 +1,35 @@
+#ifndef TWO_WAY_H
+#define TWO_WAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Crochemore-Perrin Two-Way string matching.  The pattern is split at a
+// critical factorization; the right half is compared forwards, then the
+// left half backwards.  When the pattern is periodic, the bytes that
+// still match after a shift by the period are remembered rather than
+// compared again, so a search never looks at a text byte more than a
+// couple of times, however repetitive the pattern.
+struct two_way
+{
+    size_t ms;              // pat[0, ms] is the left half; (size_t)-1 if empty
+    size_t period;          // shift after the left half matches or fails
+    size_t memory;          // prefix known to match after that shift,
+                            // non-zero only if the pattern is periodic
+    size_t skip[256];       // distance from the last occurrence of each
+                            // byte to the end of the pattern
+};
+
+void tw_init(struct two_way *tw, const uint8_t *pat, size_t patlen);
+
+// Non-zero if shifting the pattern by tw->period lines it up with itself
+// over at least half its length, as in 00000000 or abcabcabc.  These are
+// the patterns that cost Boyer-Moore the most.
+int tw_periodic(const struct two_way *tw, size_t patlen);
+
+// Offset of the first match in string, or NOT_FOUND.
+size_t tw_search(const struct two_way *tw,
+                 const uint8_t *string, size_t stringlen,
+                 const uint8_t *pat, size_t patlen);
+
+#endif // TWO_WAY_H
@@ -0,0 +1,173 @@
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+int uring_init(struct uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+    {
+        return -errno;
+    }
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (u->cq_ring_size > u->sq_ring_size)
+        {
+            u->sq_ring_size = u->cq_ring_size;
+        }
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+    {
+        goto error;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        u->cq_ring = u->sq_ring;
+    }
+    else
+    {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, u->fd,
+                          IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED)
+        {
+            u->cq_ring = NULL;
+            goto error;
+        }
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe*)mmap(NULL, u->sqes_size,
+                                         PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, u->fd,
+                                         IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+    {
+        u->sqes = NULL;
+        goto error;
+    }
+
+    char *sq = (char*)u->sq_ring;
+    char *cq = (char*)u->cq_ring;
+    u->sq_head = (unsigned*)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)(sq + p.sq_off.array);
+    u->cq_head = (unsigned*)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    u->sq_entries = p.sq_entries;
+    return 0;
+
+error:
+    {
+        int err = errno;
+        if (u->sq_ring == MAP_FAILED)
+        {
+            u->sq_ring = NULL;
+        }
+        uring_free(u);
+        return -err;
+    }
+}
+
+void uring_free(struct uring *u)
+{
+    if (u->sqes)
+    {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->cq_ring && (u->cq_ring != u->sq_ring))
+    {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if (u->sq_ring)
+    {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+    if (u->fd >= 0)
+    {
+        close(u->fd);
+    }
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *u)
+{
+    unsigned head = load_acquire(u->sq_head);
+    unsigned tail = *u->sq_tail + u->queued;
+    if (tail - head >= u->sq_entries)
+    {
+        return NULL;
+    }
+    unsigned index = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    u->queued++;
+    return sqe;
+}
+
+int uring_submit(struct uring *u, unsigned wait_nr)
+{
+    store_release(u->sq_tail, *u->sq_tail + u->queued);
+    u->queued = 0;
+    for (;;)
+    {
+        // anything the kernel hasn't consumed yet, even after EINTR
+        unsigned to_submit = *u->sq_tail - load_acquire(u->sq_head);
+        long ret = syscall(__NR_io_uring_enter, u->fd, to_submit, wait_nr,
+                           wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0)
+        {
+            return 0;
+        }
+        if (errno != EINTR)
+        {
+            return -errno;
+        }
+    }
+}
+
+struct io_uring_cqe *uring_peek(struct uring *u)
+{
+    unsigned head = *u->cq_head;
+    if (head == load_acquire(u->cq_tail))
+    {
+        return NULL;
+    }
+    return &u->cqes[head & *u->cq_mask];
+}
+
+void uring_seen(struct uring *u)
+{
+    store_release(u->cq_head, *u->cq_head + 1);
+}
+
+#else
+
+// ISO C forbids an empty translation unit
+typedef int uring_unused;
+
+#endif // HAVE_IO_URING
@@ -0,0 +1,54 @@
+#ifndef URING_H
+#define URING_H
+
+// Just enough of io_uring, over the raw system calls, to batch opens,
+// stats, reads and closes.  Only built with -DHAVE_IO_URING.
+
+#ifdef HAVE_IO_URING
+
+#include <stddef.h>
+
+#include <linux/io_uring.h>
+
+struct uring
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned queued;        // sqes filled in but not yet submitted
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+// Returns 0 on success, or -errno (e.g. when the kernel has io_uring
+// turned off).
+int uring_init(struct uring *u, unsigned entries);
+
+void uring_free(struct uring *u);
+
+// A zeroed submission entry, or NULL if the queue is full.
+struct io_uring_sqe *uring_sqe(struct uring *u);
+
+// Submit what is queued and wait for at least wait_nr completions.
+// Returns 0 or -errno.
+int uring_submit(struct uring *u, unsigned wait_nr);
+
+// The next completion, or NULL.  Call uring_seen() when done with it.
+struct io_uring_cqe *uring_peek(struct uring *u);
+
+void uring_seen(struct uring *u);
+
+#endif // HAVE_IO_URING
+
+#endif // URING_H
@@ -0,0 +1,266 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "walk.h"
+
+// glibc has had getdents64() since 2.30; it fills a whole buffer of
+// entries with one system call, where readdir() leaves the buffer size
+// to libc.
+#if defined(__GLIBC__) && \
+    ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 30)))
+#define HAVE_GETDENTS64 1
+#endif
+
+#define DENTS_BUF 32768
+
+struct walk_dir
+{
+    struct walk *w;
+    struct walk_dir *next;  // in w->todo
+    char path[];
+};
+
+struct walk_file
+{
+    struct walk *w;
+    char path[];
+};
+
+static int match_any(char *const *globs, size_t n, const char *name)
+{
+    for (size_t i=0; i<n; i++)
+    {
+        if (fnmatch(globs[i], name, 0) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// path/name in a block with room for a struct of head bytes in front.
+static void *join_path(size_t head, const char *path, const char *name)
+{
+    size_t plen = strlen(path);
+    size_t nlen = strlen(name);
+    int slash = (plen > 0) && (nlen > 0) && (path[plen - 1] != '/');
+    char *block = (char*)malloc(head + plen + slash + nlen + 1);
+    if (block)
+    {
+        char *p = block + head;
+        memcpy(p, path, plen);
+        if (slash)
+        {
+            p[plen] = '/';
+        }
+        memcpy(p + plen + slash, name, nlen + 1);
+    }
+    return block;
+}
+
+static void file_run(void *arg)
+{
+    struct walk_file *f = (struct walk_file*)arg;
+    struct walk *w = f->w;
+    if (!w->stop || !w->stop(w->arg))
+    {
+        w->file(w->arg, f->path);
+    }
+    free(f);
+}
+
+static void dir_run(void *arg);
+
+static void queue_dir(struct walk *w, const char *path, const char *name)
+{
+    struct walk_dir *d = (struct walk_dir*)join_path(
+        sizeof(struct walk_dir), path, name);
+    if (!d)
+    {
+        errno = ENOMEM;
+        w->error(w->arg, "Walk", path);
+        return;
+    }
+    d->w = w;
+    if (!w->pool)
+    {
+        d->next = w->todo;
+        w->todo = d;
+    }
+    else if (pool_submit_group(w->pool, &w->group, dir_run, d) != 0)
+    {
+        dir_run(d);
+    }
+}
+
+static void queue_file(struct walk *w, const char *path, const char *name)
+{
+    struct walk_file *f = (struct walk_file*)join_path(
+        sizeof(struct walk_file), path, name);
+    if (!f)
+    {
+        errno = ENOMEM;
+        w->error(w->arg, "Walk", path);
+        return;
+    }
+    f->w = w;
+    if (!w->pool || (pool_submit_group(w->pool, &w->group, file_run, f) != 0))
+    {
+        file_run(f);
+    }
+}
+
+static int want_file(const struct walk *w, const char *name)
+{
+    return ((w->ninclude == 0) || match_any(w->include, w->ninclude, name)) &&
+           !match_any(w->exclude, w->nexclude, name);
+}
+
+// Look at one entry of the directory open as dfd.  type is a DT_ value,
+// DT_UNKNOWN if the filesystem doesn't say.
+static void visit(struct walk *w, int dfd, const char *path,
+                  const char *name, unsigned char type)
+{
+    if ((name[0] == '.') &&
+        ((name[1] == '\0') || ((name[1] == '.') && (name[2] == '\0'))))
+    {
+        return;
+    }
+
+    // Only stat when the answer matters, and before the file is opened.
+    struct stat st;
+    int sized = 0;
+    if ((type == DT_UNKNOWN) ||
+        ((type == DT_REG) && (w->min_size || w->max_size) &&
+         want_file(w, name)))
+    {
+        if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            char *full = (char*)join_path(0, path, name);
+            w->error(w->arg, "Stat", full ? full : path);
+            free(full);
+            return;
+        }
+        type = S_ISDIR(st.st_mode) ? DT_DIR :
+               S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        sized = 1;
+    }
+
+    if (type == DT_DIR)
+    {
+        if (!match_any(w->exclude_dir, w->nexclude_dir, name))
+        {
+            queue_dir(w, path, name);
+        }
+        return;
+    }
+    if ((type != DT_REG) || !want_file(w, name))
+    {
+        return;
+    }
+    if (sized && (((size_t)st.st_size < w->min_size) ||
+                  (w->max_size && ((size_t)st.st_size > w->max_size))))
+    {
+        return;
+    }
+    queue_file(w, path, name);
+}
+
+static void dir_run(void *arg)
+{
+    struct walk_dir *d = (struct walk_dir*)arg;
+    struct walk *w = d->w;
+    if (w->stop && w->stop(w->arg))
+    {
+        free(d);
+        return;
+    }
+    int dfd = openat(AT_FDCWD, d->path,
+                     O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0)
+    {
+        w->error(w->arg, "Open", d->path);
+        free(d);
+        return;
+    }
+
+#ifdef HAVE_GETDENTS64
+    char *buf = (char*)malloc(DENTS_BUF);
+    if (!buf)
+    {
+        errno = ENOMEM;
+        w->error(w->arg, "Walk", d->path);
+        close(dfd); // ignore error
+        free(d);
+        return;
+    }
+    for (;;)
+    {
+        ssize_t n = getdents64(dfd, buf, DENTS_BUF);
+        if (n < 0)
+        {
+            w->error(w->arg, "Read", d->path);
+            break;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        for (ssize_t off = 0; off < n; )
+        {
+            struct dirent64 *e = (struct dirent64*)(buf + off);
+            visit(w, dfd, d->path, e->d_name, e->d_type);
+            off += e->d_reclen;
+        }
+    }
+    free(buf);
+    close(dfd); // ignore error
+#else
+    DIR *dir = fdopendir(dfd);
+    if (!dir)
+    {
+        w->error(w->arg, "Open", d->path);
+        close(dfd); // ignore error
+        free(d);
+        return;
+    }
+    struct dirent *e;
+    errno = 0;
+    while ((e = readdir(dir)) != NULL)
+    {
+        visit(w, dfd, d->path, e->d_name, e->d_type);
+        errno = 0;
+    }
+    if (errno != 0)
+    {
+        w->error(w->arg, "Read", d->path);
+    }
+    closedir(dir); // ignore error
+#endif
+    free(d);
+}
+
+void walk_tree(struct walk *w, const char *root)
+{
+    w->group.pending = 0;
+    w->todo = NULL;
+    queue_dir(w, root, "");
+    if (w->pool)
+    {
+        pool_wait_group(w->pool, &w->group);
+        return;
+    }
+    while (w->todo)
+    {
+        struct walk_dir *d = w->todo;
+        w->todo = d->next;
+        dir_run(d);
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <stddef.h>
+
+#include "pool.h"
+
+// Walk directory trees, calling back for each regular file that passes
+// the filters.  With a pool, every directory and file is its own task,
+// so one slow directory (say, on NFS) doesn't hold up the others, and
+// files are searched while their siblings are still being listed.
+
+// Called with errno set when a directory can't be listed or an entry
+// can't be stat'ed.
+typedef void (*walk_error_fn)(void *arg, const char *what,
+                              const char *path);
+typedef void (*walk_file_fn)(void *arg, const char *path);
+
+struct walk
+{
+    // Globs (fnmatch) on the last part of the path.  Files must match an
+    // include if there are any, and no exclude; directories must match
+    // no exclude_dir.
+    char **include;
+    size_t ninclude;
+    char **exclude;
+    size_t nexclude;
+    char **exclude_dir;
+    size_t nexclude_dir;
+    size_t min_size;        // 0 for no limit
+    size_t max_size;        // 0 for no limit
+
+    walk_file_fn file;      // may run on any worker
+    walk_error_fn error;
+    int (*stop)(void *arg); // non-zero to give up early; may be NULL
+    void *arg;
+    struct pool *pool;      // NULL to walk on the calling thread
+
+    // private
+    struct pool_group group;
+    struct walk_dir *todo;  // directories left, without a pool
+};
+
+// Walk the tree under the directory root, returning when every file in
+// it has been handed to w->file and those calls have returned.  Symbolic
+// links below root are not followed.
+void walk_tree(struct walk *w, const char *root);
+
+#endif // WALK_H